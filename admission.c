@@ -0,0 +1,79 @@
+/********************************************************************************
+ * admission.c
+ *
+ * Computer Science 3357a
+ * Admission Control
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of admission control. Connections in flight are counted
+ * in one shared atomic, touched only on accept and close. Queue delay is
+ * judged per event loop: the time from its wait returning to it reaching
+ * a connection is how long that connection's requests were queued.
+*******************************************************************************/
+
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "ctp.h"
+
+static unsigned max_connections = 0;
+static uint64_t max_delay_ns = 0;
+static _Atomic unsigned inflight = 0;
+static __thread bool shedding = false;
+
+void admission_init(unsigned max_inflight, uint64_t max_queue_delay)
+{
+	max_connections = max_inflight;
+	max_delay_ns = max_queue_delay;
+}
+
+bool admission_open()
+{
+	if(max_connections == 0)
+		return true;
+	if(atomic_fetch_add_explicit(&inflight, 1, memory_order_relaxed) < max_connections)
+		return true;
+	atomic_fetch_sub_explicit(&inflight, 1, memory_order_relaxed);
+	return false;
+}
+
+void admission_close()
+{
+	if(max_connections != 0)
+		atomic_fetch_sub_explicit(&inflight, 1, memory_order_relaxed);
+}
+
+void admission_refuse(int fd)
+{
+	// The response fits any socket buffer, so this never blocks
+	send(fd, OVERLOADED_RESPONSE, sizeof(OVERLOADED_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+	metrics_status(OVERLOADED);
+}
+
+uint64_t admission_clock()
+{
+	struct timespec ts;
+
+	if(max_delay_ns == 0)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void admission_ready(uint64_t ready_since)
+{
+	shedding = ready_since != 0 && admission_clock() - ready_since > max_delay_ns;
+}
+
+bool admission_shedding()
+{
+	return shedding;
+}
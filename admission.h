@@ -0,0 +1,71 @@
+/********************************************************************************
+ * admission.h
+ *
+ * Computer Science 3357a
+ * Admission Control
+ *
+ * Author: Duncan Cai
+ *
+ * Load shedding: past a limit on connections in flight, or on how long
+ * ready connections wait for their event loop, requests are answered at
+ * once with Status: overloaded instead of being queued
+*******************************************************************************/
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OVERLOADED_RESPONSE "Status: overloaded\r\n"
+
+/*
+ * Sets the thresholds; must be called before any connection is accepted
+ *
+ * max_inflight: most connections open at once over every worker, or 0 for no limit
+ * max_queue_delay: most nanoseconds a ready connection may wait to be
+ * served before its requests are shed, or 0 for no limit
+ */
+void admission_init(unsigned max_inflight, uint64_t max_queue_delay);
+
+/*
+ * Counts a newly accepted connection if the server has room for it
+ *
+ * return: false if it must be refused; it is then not counted
+ */
+bool admission_open();
+
+/*
+ * Uncounts a connection that admission_open let in
+ */
+void admission_close();
+
+/*
+ * Refuses a connection that admission_open did not let in: answers it
+ * without blocking and closes it
+ *
+ * fd: the connection
+ */
+void admission_refuse(int fd);
+
+/*
+ * Returns the time to pass to admission_ready, or 0 when queue delay is
+ * not limited, so an event loop only reads the clock when it must
+ */
+uint64_t admission_clock();
+
+/*
+ * Starts serving a ready connection in the calling thread. Its requests
+ * are shed if it waited longer than the queue delay limit.
+ *
+ * ready_since: when the event loop learned the connection was ready,
+ * from admission_clock
+ */
+void admission_ready(uint64_t ready_since);
+
+/*
+ * Returns true if the calling thread is shedding the requests it serves
+ */
+bool admission_shedding();
+
+#endif
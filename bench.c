@@ -0,0 +1,706 @@
+/********************************************************************************
+ * bench.c
+ *
+ * Computer Science 3357a
+ * Microbenchmarks
+ *
+ * Author: Duncan Cai
+ *
+ * Times parse_expr over a corpus of expressions of varying length, nesting
+ * and operator mix, with either parser engine and in any arithmetic, exact
+ * results too long for 64 bits with and without Karatsuba's method, the
+ * tokenizer with and without vector instructions, the stack, and
+ * handle_connection fed through a socket pair, with text or binary
+ * requests, and one expression run over columns of variable bindings,
+ * interpreted or compiled to native code, against the same rows parsed one
+ * by one. Expressions that repeat subexpressions are run with and without
+ * rebuilding them as DAGs. Prints one JSON object per benchmark so runs can
+ * be diffed.
+ *
+ * Usage: calc-bench [FILTER]   (runs only benchmarks whose name contains FILTER)
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "ctp.h"
+#include "parser.h"
+#include "stack.h"
+#include "logger.h"
+#include "jit.h"
+#include "token.h"
+#include "bignum.h"
+#include "dag.h"
+
+#define REPEATS 5					// Timed runs per benchmark; the median is reported
+#define RUN_NS 50000000ULL			// Target length of one timed run
+#define MAX_EXPR 2048
+#define PIPELINE_DEPTH 64			// Requests per connection in the pipelined case
+#define COLUMN_ROWS 4096			// Rows of variable bindings in the column cases
+#define COLUMN_EXPR "x*3+y*(x-1)-x/y"
+#define BIG_EXPR 65536				// Longest generated expression with exact results
+
+//A benchmark: runs its operation iterations times
+struct bench
+{
+	const char * name;
+	void (*run)(struct bench * b, size_t iterations);
+	const char * expr;				// Expression or request, if any
+	size_t size;					// Elements, requests or bytes per operation
+	int expected;					// Status parse_expr should return
+	int frame_type;					// Payload type of binary requests
+	int engine;						// Parser engine compile_expr uses
+	int arith;						// Arithmetic programs are run with
+	size_t dag_threshold;			// Words of code before a program is rebuilt, 0 for never
+};
+
+static volatile int sink;			// Keeps results from being optimized away
+
+static char corpus[32][MAX_EXPR];	// Generated expressions
+static int corpus_len = 0;
+static char big_corpus[4][BIG_EXPR];
+static int big_corpus_len = 0;
+static char shared_corpus[8][BIG_EXPR];
+static int shared_corpus_len = 0;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Generates a flat expression of the given number of terms cycling through
+ * the given operators. Divisors are never zero.
+ */
+static const char * gen_flat(int terms, const char * ops, bool spaced)
+{
+	char * expr = corpus[corpus_len++];
+	int i, len = sprintf(expr, "%d", 17);
+
+	for(i = 1; i < terms; i++)
+		len += sprintf(expr + len, spaced ? " %c %d" : "%c%d", ops[i % strlen(ops)], 1 + (i * 37) % 97);
+	return expr;
+}
+
+/*
+ * Generates a flat expression like gen_flat with each operator on a line
+ * of its own, indented by the given number of spaces
+ */
+static const char * gen_indented(int terms, int indent)
+{
+	char * expr = corpus[corpus_len++];
+	int i, len = sprintf(expr, "%d", 17);
+
+	for(i = 1; i < terms; i++)
+		len += sprintf(expr + len, "\n%*s%c %d", indent, "", "+*-/"[i % 4], 1 + (i * 37) % 97);
+	return expr;
+}
+
+/*
+ * Copies an expression with its last character replaced by one that can
+ * be in no token
+ */
+static const char * gen_invalid(const char * expr)
+{
+	char * copy = corpus[corpus_len++];
+
+	strcpy(copy, expr);
+	copy[strlen(copy) - 1] = '#';
+	return copy;
+}
+
+/*
+ * Generates an expression nested depth parentheses deep, either growing to
+ * the left, ((1+2)*3)-4, or to the right, 1+(2*(3-4))
+ */
+static const char * gen_nested(int depth, bool right)
+{
+	static const char ops[] = "+*-";
+	char * expr = corpus[corpus_len++];
+	int i, len = 0;
+
+	if(right)
+	{
+		for(i = 0; i < depth; i++)
+			len += sprintf(expr + len, "%d%c(", i + 1, ops[i % 3]);
+		len += sprintf(expr + len, "%d", depth + 1);
+		for(i = 0; i < depth; i++)
+			expr[len++] = ')';
+		expr[len] = '\0';
+	}
+	else
+	{
+		for(i = 0; i < depth; i++)
+			expr[len++] = '(';
+		len += sprintf(expr + len, "%d", 1);
+		for(i = 0; i < depth; i++)
+			len += sprintf(expr + len, "%c%d)", ops[i % 3], i + 2);
+	}
+	return expr;
+}
+
+/*
+ * Generates a literal of the given number of digits, repeating the first
+ * digits of pi
+ */
+static int gen_literal(char * out, int digits)
+{
+	static const char pi[] = "31415926535897932384626433832795028841971693993751";
+	int i;
+
+	for(i = 0; i < digits; i++)
+		out[i] = pi[i % (sizeof(pi) - 1)];
+	out[digits] = '\0';
+	return digits;
+}
+
+/*
+ * Generates A^n*B^n-B^n*A^n, with each power written out as a product of
+ * literals of the given number of digits. The result is zero, so the time
+ * goes to multiplying rather than to writing the result in decimal.
+ */
+static const char * gen_big_products(int digits, int n)
+{
+	char * expr = big_corpus[big_corpus_len++];
+	int i, side, len = 0;
+
+	for(side = 0; side < 4; side++)
+	{
+		if(side == 2)
+			expr[len++] = '-';
+		else if(side > 0)
+			expr[len++] = '*';
+		expr[len++] = '(';
+		for(i = 0; i < n; i++)
+		{
+			if(i > 0)
+				expr[len++] = '*';
+			len += gen_literal(expr + len, digits);
+			// A and B differ in their last digit
+			if(side == 1 || side == 2)
+				expr[len - 1] = '7';
+		}
+		expr[len++] = ')';
+	}
+	expr[len] = '\0';
+	return expr;
+}
+
+/*
+ * Generates an expression as a generator that expands a recurrence would
+ * write it out: E(0) is the base and E(k+1) is the step with E(k) as its
+ * first argument and the base as its second. The text doubles with each
+ * level, but there are only about as many distinct subexpressions as
+ * levels. If zero is set, the expression is E(levels)-E(levels), so exact
+ * results are not dominated by writing them in decimal.
+ */
+static const char * gen_shared(const char * step, const char * base, int levels, bool zero)
+{
+	char * expr = shared_corpus[shared_corpus_len++];
+	char * prev = malloc(BIG_EXPR);
+	int k;
+
+	if(prev == NULL)
+		exit(EXIT_FAILURE);
+	strcpy(expr, base);
+	for(k = 0; k < levels; k++)
+	{
+		strcpy(prev, expr);
+		snprintf(expr, BIG_EXPR, step, prev, base);
+	}
+	if(zero)
+	{
+		strcpy(prev, expr);
+		snprintf(expr, BIG_EXPR, "%s-%s", prev, prev);
+	}
+	free(prev);
+	return expr;
+}
+
+static void run_parse(struct bench * b, size_t iterations)
+{
+	int64_t result = 0;
+	size_t i;
+
+	for(i = 0; i < iterations; i++)
+		parse_expr(b->expr, &result);
+	sink = result;
+}
+
+/*
+ * Like run_parse, classifying one byte at a time when tokenizing
+ */
+static void run_parse_scalar(struct bench * b, size_t iterations)
+{
+	token_set_simd(false);
+	run_parse(b, iterations);
+	token_set_simd(true);
+}
+
+/*
+ * Runs an expression as the server does in exact arithmetic: in 64 bits
+ * and, as it overflows, again exactly
+ */
+static void run_parse_big(struct bench * b, size_t iterations)
+{
+	int64_t result = 0;
+	const char * digits;
+	size_t i, len = 0;
+
+	for(i = 0; i < iterations; i++)
+		if(parse_expr(b->expr, &result) == OVERFLOW)
+			parse_expr_big(b->expr, &digits, &len);
+	sink = result + len;
+}
+
+/*
+ * Like run_parse_big, multiplying by schoolbook only
+ */
+static void run_parse_big_schoolbook(struct bench * b, size_t iterations)
+{
+	big_set_karatsuba(false);
+	run_parse_big(b, iterations);
+	big_set_karatsuba(true);
+}
+
+static void run_tokenize(struct bench * b, size_t iterations)
+{
+	static struct token_index index;
+	size_t i;
+
+	for(i = 0; i < iterations; i++)
+		tokenize(b->expr, b->size, &index);
+	sink = index.count;
+}
+
+static void run_tokenize_scalar(struct bench * b, size_t iterations)
+{
+	token_set_simd(false);
+	run_tokenize(b, iterations);
+	token_set_simd(true);
+}
+
+static void run_stack_push_pop(struct bench * b, size_t iterations)
+{
+	stack * s = stack_init();
+	int sum = 0;
+	size_t i, j;
+
+	for(i = 0; i < iterations; i++)
+	{
+		for(j = 0; j < b->size; j++)
+			stack_push(s, j);
+		for(j = 0; j < b->size; j++)
+			sum += stack_pop(s);
+	}
+	stack_free(s);
+	sink = sum;
+}
+
+static void run_stack_lifecycle(struct bench * b, size_t iterations)
+{
+	stack * s;
+	int sum = 0;
+	size_t i, j;
+
+	for(i = 0; i < iterations; i++)
+	{
+		s = stack_init();
+		for(j = 0; j < b->size; j++)
+			stack_push(s, j);
+		sum += stack_top(s);
+		stack_free(s);
+	}
+	sink = sum;
+}
+
+/*
+ * Writes b->size copies of the request into one end of a socket pair,
+ * serves the other end with handle_connection and reads the answers back
+ */
+static void run_connection(struct bench * b, size_t iterations)
+{
+	char requests[PIPELINE_DEPTH * MAX_REQUEST];
+	char responses[PIPELINE_DEPTH * MAX_RESPONSE];
+	size_t len = strlen(b->expr), i, j;
+	ssize_t bytes_read, total = 0;
+	int fds[2];
+
+	for(j = 0; j < b->size; j++)
+		memcpy(requests + j * len, b->expr, len);
+
+	for(i = 0; i < iterations; i++)
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		{
+			perror("Unable to create socket pair");
+			exit(EXIT_FAILURE);
+		}
+		if(send(fds[0], requests, b->size * len, 0) != (ssize_t)(b->size * len))
+		{
+			perror("Unable to send requests");
+			exit(EXIT_FAILURE);
+		}
+		shutdown(fds[0], SHUT_WR);
+
+		handle_connection(fds[1]);
+
+		while((bytes_read = recv(fds[0], responses, sizeof(responses), 0)) > 0)
+			total += bytes_read;
+		close(fds[0]);
+	}
+	sink = total;
+}
+
+/*
+ * Appends a binary frame carrying the expression, as text or compiled to
+ * bytecode, to buf
+ *
+ * return: the length of the frame
+ */
+static size_t binary_frame(const char * expr, int type, char * buf)
+{
+	program * prog = program_init();
+	uint32_t len, word;
+	size_t i;
+
+	if(type == BINARY_PROGRAM)
+	{
+		compile_expr(expr, prog);
+		for(i = 0; i < prog->len; i++)
+		{
+			word = htonl(prog->code[i]);
+			memcpy(buf + BINARY_HEADER + i * sizeof(word), &word, sizeof(word));
+		}
+		len = prog->len * sizeof(word);
+	}
+	else
+	{
+		len = strlen(expr);
+		memcpy(buf + BINARY_HEADER, expr, len);
+	}
+	program_free(prog);
+
+	word = htonl(len);
+	memcpy(buf, &word, sizeof(word));
+	buf[4] = type;
+	return BINARY_HEADER + len;
+}
+
+/*
+ * Like run_connection, with the session switched to binary frames first
+ */
+static void run_binary_connection(struct bench * b, size_t iterations)
+{
+	char requests[8 + PIPELINE_DEPTH * (BINARY_HEADER + MAX_EXPR)];
+	char responses[PIPELINE_DEPTH * BINARY_RESPONSE + 64];
+	size_t len = 8, i, j;
+	ssize_t bytes_read, total = 0;
+	int fds[2];
+
+	memcpy(requests, "BINARY\r\n", 8);
+	for(j = 0; j < b->size; j++)
+		len += binary_frame(b->expr, b->frame_type, requests + len);
+
+	for(i = 0; i < iterations; i++)
+	{
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		{
+			perror("Unable to create socket pair");
+			exit(EXIT_FAILURE);
+		}
+		if(send(fds[0], requests, len, 0) != (ssize_t)len)
+		{
+			perror("Unable to send requests");
+			exit(EXIT_FAILURE);
+		}
+		shutdown(fds[0], SHUT_WR);
+
+		handle_connection(fds[1]);
+
+		while((bytes_read = recv(fds[0], responses, sizeof(responses), 0)) > 0)
+			total += bytes_read;
+		close(fds[0]);
+	}
+	sink = total;
+}
+
+static int32_t column_x[COLUMN_ROWS], column_y[COLUMN_ROWS];
+
+/*
+ * Fills the columns the column cases bind x and y to; y is never zero
+ */
+static void columns_init()
+{
+	size_t i;
+
+	for(i = 0; i < COLUMN_ROWS; i++)
+	{
+		column_x[i] = (i * 7919) % 100000 - 50000;
+		column_y[i] = 1 + i % 13;
+	}
+}
+
+/*
+ * Compiles COLUMN_EXPR once and runs it over every row
+ */
+static void run_columns(struct bench * b, size_t iterations)
+{
+	static int64_t wide[COLUMN_ROWS];
+	static int32_t results[COLUMN_ROWS];
+	static unsigned char statuses[COLUMN_ROWS];
+	const int32_t * columns[2];
+	program * prog = program_init();
+	size_t i;
+
+	for(i = 0; i < iterations; i++)
+	{
+		compile_expr(b->expr, prog);
+		// x is seen first, so it is variable 0
+		columns[0] = column_x;
+		columns[1] = column_y;
+		if(b->arith == ARITH_CHECKED)
+			run_program_columns_checked(prog, columns, b->size, wide, statuses);
+		else
+			run_program_columns(prog, columns, b->size, results, statuses);
+	}
+	program_free(prog);
+	sink = results[b->size - 1] + wide[b->size - 1] + statuses[0];
+}
+
+/*
+ * Compiles COLUMN_EXPR to native code once and runs it over every row
+ */
+static void run_columns_jit(struct bench * b, size_t iterations)
+{
+	static int32_t results[COLUMN_ROWS];
+	static unsigned char statuses[COLUMN_ROWS];
+	const int32_t * columns[2] = { column_x, column_y };
+	program * prog = program_init();
+	size_t size, i;
+	jit_fn fn;
+
+	compile_expr(b->expr, prog);
+	fn = jit_compile(prog, &size);
+	for(i = 0; i < iterations; i++)
+	{
+		if(fn != NULL)
+			fn(columns, b->size, results, statuses);
+		else
+			run_program_columns(prog, columns, b->size, results, statuses);
+	}
+	if(fn != NULL)
+		jit_free(fn, size);
+	program_free(prog);
+	sink = results[b->size - 1] + statuses[0];
+}
+
+/*
+ * Parses COLUMN_EXPR with each row's values written in, as a client
+ * without variables would have to send it
+ */
+static void run_rows(struct bench * b, size_t iterations)
+{
+	static char exprs[COLUMN_ROWS][64];
+	int64_t result = 0;
+	size_t i, j;
+
+	for(j = 0; j < b->size; j++)
+		sprintf(exprs[j], "%d*3+%d*(%d-1)-%d/%d", column_x[j], column_y[j], column_x[j], column_x[j], column_y[j]);
+
+	for(i = 0; i < iterations; i++)
+		for(j = 0; j < b->size; j++)
+			parse_expr(exprs[j], &result);
+	sink = result;
+}
+
+/*
+ * Returns whether a benchmark runs parse_expr
+ */
+static bool bench_parses(const struct bench * b)
+{
+	return b->run == run_parse || b->run == run_parse_scalar
+		|| b->run == run_parse_big || b->run == run_parse_big_schoolbook;
+}
+
+/*
+ * Returns the status the server would give the benchmark's expression
+ */
+static int bench_status(const struct bench * b)
+{
+	int64_t result;
+	const char * digits;
+	size_t len;
+	int status_code = parse_expr(b->expr, &result);
+
+	if(status_code == OVERFLOW && program_arith() == ARITH_BIG)
+		status_code = parse_expr_big(b->expr, &digits, &len);
+	return status_code;
+}
+
+/*
+ * Times a benchmark and prints its result as a JSON object
+ */
+static void bench_run(struct bench * b)
+{
+	uint64_t samples[REPEATS], start, elapsed, tmp;
+	size_t iterations = 1;
+	int i, j;
+
+	// Double the iterations until one run takes a measurable time
+	while(1)
+	{
+		start = now_ns();
+		b->run(b, iterations);
+		elapsed = now_ns() - start;
+		if(elapsed >= RUN_NS / 10)
+			break;
+		iterations *= 2;
+	}
+	iterations = iterations * RUN_NS / (elapsed > 0 ? elapsed : 1) + 1;
+
+	for(i = 0; i < REPEATS; i++)
+	{
+		start = now_ns();
+		b->run(b, iterations);
+		samples[i] = now_ns() - start;
+	}
+
+	// Sort the samples for the median and minimum
+	for(i = 1; i < REPEATS; i++)
+		for(j = i; j > 0 && samples[j - 1] > samples[j]; j--)
+		{
+			tmp = samples[j];
+			samples[j] = samples[j - 1];
+			samples[j - 1] = tmp;
+		}
+
+	printf("{\"name\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,\"size\":%zu",
+		b->name, iterations, (double)samples[REPEATS / 2] / iterations,
+		(double)samples[0] / iterations, b->size);
+	if(bench_parses(b))
+		printf(",\"status\":\"%s\"", status_code_to_str(bench_status(b)));
+	printf("}\n");
+	fflush(stdout);
+}
+
+int main(int argc, char ** argv)
+{
+	const char * filter = argc > 1 ? argv[1] : NULL;
+	size_t i;
+
+	struct bench benches[] =
+	{
+		{ "parse_expr/number", run_parse, "42", 0, OK },
+		{ "parse_expr/flat_add_4", run_parse, gen_flat(4, "+", false), 0, OK },
+		{ "parse_expr/flat_mixed_8", run_parse, gen_flat(8, "+*-/", false), 0, OK },
+		{ "parse_expr/flat_mixed_32", run_parse, gen_flat(32, "+*-/", false), 0, OK },
+		{ "parse_expr/flat_mixed_256", run_parse, gen_flat(256, "+*-/", false), 0, OK },
+		{ "parse_expr/flat_muldiv_32", run_parse, gen_flat(32, "*/", false), 0, OK },
+		{ "parse_expr/spaced_mixed_32", run_parse, gen_flat(32, "+*-/", true), 0, OK },
+		{ "parse_expr/spaced_mixed_256", run_parse, gen_flat(256, "+*-/", true), 0, OK },
+		{ "parse_expr/indented_128", run_parse, gen_indented(128, 8), 0, OK },
+		{ "parse_expr/indented_128_scalar", run_parse_scalar, gen_indented(128, 8), 0, OK },
+		{ "parse_expr/indented_128_invalid", run_parse, gen_invalid(gen_indented(128, 8)), 0, INVALID_EXPR },
+		{ "parse_expr/unary_8", run_parse, "-1*-(2+-3)--4*-(-5)+6/-7-(-8)", 0, OK },
+		{ "parse_expr/nested_left_8", run_parse, gen_nested(8, false), 0, OK },
+		{ "parse_expr/nested_left_64", run_parse, gen_nested(64, false), 0, OK },
+		{ "parse_expr/nested_right_8", run_parse, gen_nested(8, true), 0, OK },
+		{ "parse_expr/nested_right_64", run_parse, gen_nested(64, true), 0, OK },
+		{ "parse_expr/mismatch", run_parse, "((1+2)*3", 0, MISMATCH },
+		{ "parse_expr/invalid", run_parse, "1+2*/3", 0, INVALID_EXPR },
+		{ "parse_expr/divide_by_zero", run_parse, "7*(3-3)+1/0", 0, INVALID_EXPR },
+		{ "climbing/number", run_parse, "42", 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/flat_add_4", run_parse, gen_flat(4, "+", false), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/flat_mixed_8", run_parse, gen_flat(8, "+*-/", false), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/flat_mixed_32", run_parse, gen_flat(32, "+*-/", false), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/flat_mixed_256", run_parse, gen_flat(256, "+*-/", false), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/spaced_mixed_32", run_parse, gen_flat(32, "+*-/", true), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/spaced_mixed_256", run_parse, gen_flat(256, "+*-/", true), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/indented_128", run_parse, gen_indented(128, 8), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/unary_8", run_parse, "-1*-(2+-3)--4*-(-5)+6/-7-(-8)", 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/nested_left_64", run_parse, gen_nested(64, false), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/nested_right_64", run_parse, gen_nested(64, true), 0, OK, 0, PARSER_CLIMBING },
+		{ "climbing/mismatch", run_parse, "((1+2)*3", 0, MISMATCH, 0, PARSER_CLIMBING },
+		{ "climbing/invalid", run_parse, "1+2*/3", 0, INVALID_EXPR, 0, PARSER_CLIMBING },
+		{ "checked/flat_mixed_32", run_parse, gen_flat(32, "+*-/", false), 0, OK, 0, 0, ARITH_CHECKED },
+		{ "checked/nested_right_8", run_parse, gen_nested(8, true), 0, OK, 0, 0, ARITH_CHECKED },
+		{ "checked/nested_right_64", run_parse, gen_nested(64, true), 0, OVERFLOW, 0, 0, ARITH_CHECKED },
+		{ "checked/wide_literals", run_parse, "9000000000*3-4000000000/7+123456789012*(5-2)", 0, OK, 0, 0, ARITH_CHECKED },
+		{ "checked/overflow", run_parse, "3037000500*3037000500", 0, OVERFLOW, 0, 0, ARITH_CHECKED },
+		{ "big/flat_mixed_32", run_parse_big, gen_flat(32, "+*-/", false), 0, OK, 0, 0, ARITH_BIG },
+		{ "big/overflow", run_parse_big, "3037000500*3037000500", 0, OK, 0, 0, ARITH_BIG },
+		{ "big/product_40_digits", run_parse_big, "3141592653589793238462643383279502884197*2718281828459045235360287471352662497757", 0, OK, 0, 0, ARITH_BIG },
+		{ "big/products_500x8", run_parse_big, gen_big_products(500, 8), 0, OK, 0, 0, ARITH_BIG },
+		{ "big/products_500x8_schoolbook", run_parse_big_schoolbook, gen_big_products(500, 8), 0, OK, 0, 0, ARITH_BIG },
+		{ "big/products_2000x8", run_parse_big, gen_big_products(2000, 8), 0, OK, 0, 0, ARITH_BIG },
+		{ "big/products_2000x8_schoolbook", run_parse_big_schoolbook, gen_big_products(2000, 8), 0, OK, 0, 0, ARITH_BIG },
+		{ "tokenize/indented_128", run_tokenize, gen_indented(128, 8), 0, OK },
+		{ "tokenize/indented_128_scalar", run_tokenize_scalar, gen_indented(128, 8), 0, OK },
+		{ "tokenize/spaced_mixed_256", run_tokenize, gen_flat(256, "+*-/", true), 0, OK },
+		{ "stack/push_pop_16", run_stack_push_pop, NULL, 16, 0 },
+		{ "stack/push_pop_1024", run_stack_push_pop, NULL, 1024, 0 },
+		{ "stack/init_push_free_16", run_stack_lifecycle, NULL, 16, 0 },
+		{ "stack/init_push_free_64", run_stack_lifecycle, NULL, 64, 0 },
+		{ "handle_connection/single", run_connection, "12*3-45/6+7\r\n", 1, OK },
+		{ "handle_connection/pipelined_64", run_connection, "12*3-45/6+7\r\n", PIPELINE_DEPTH, OK },
+		{ "handle_connection/binary_expr_64", run_binary_connection, "12*3-45/6+7", PIPELINE_DEPTH, OK, BINARY_EXPR },
+		{ "handle_connection/binary_program_64", run_binary_connection, "12*3-45/6+7", PIPELINE_DEPTH, OK, BINARY_PROGRAM },
+		{ "columns/per_row_4096", run_rows, COLUMN_EXPR, COLUMN_ROWS, OK },
+		{ "columns/vectorized_4096", run_columns, COLUMN_EXPR, COLUMN_ROWS, OK },
+		{ "columns/jit_4096", run_columns_jit, COLUMN_EXPR, COLUMN_ROWS, OK },
+		{ "columns/checked_4096", run_columns, COLUMN_EXPR, COLUMN_ROWS, OK, 0, 0, ARITH_CHECKED },
+		{ "columns/vectorized_16", run_columns, COLUMN_EXPR, 16, OK },
+		{ "columns/jit_16", run_columns_jit, COLUMN_EXPR, 16, OK },
+		// Constants fold before anything is shared, so one-shot text gains nothing
+		{ "dag/parse_shared_8", run_parse, gen_shared("(%1$s*7-%1$s/9)", "(7*3+5)", 8, false), 0, OK },
+		{ "dag/parse_shared_8_dag", run_parse, gen_shared("(%1$s*7-%1$s/9)", "(7*3+5)", 8, false), 0, OK, 0, 0, 0, 1 },
+		{ "dag/columns_shared_8", run_columns, gen_shared("(%1$s*%2$s-%1$s/y)", "(x*3+y)", 8, false), COLUMN_ROWS, OK },
+		{ "dag/columns_shared_8_dag", run_columns, gen_shared("(%1$s*%2$s-%1$s/y)", "(x*3+y)", 8, false), COLUMN_ROWS, OK, 0, 0, 0, 1 },
+		{ "dag/jit_shared_8", run_columns_jit, gen_shared("(%1$s*%2$s-%1$s/y)", "(x*3+y)", 8, false), COLUMN_ROWS, OK },
+		{ "dag/jit_shared_8_dag", run_columns_jit, gen_shared("(%1$s*%2$s-%1$s/y)", "(x*3+y)", 8, false), COLUMN_ROWS, OK, 0, 0, 0, 1 },
+		{ "dag/big_squares_9", run_parse_big, gen_shared("(%1$s*%1$s-%2$s)", "31415926535897932384626433", 9, true), 0, OK, 0, 0, ARITH_BIG },
+		{ "dag/big_squares_9_dag", run_parse_big, gen_shared("(%1$s*%1$s-%2$s)", "31415926535897932384626433", 9, true), 0, OK, 0, 0, ARITH_BIG, 1 },
+	};
+
+	// Parse errors are logged; keep syslog out of the timings
+	setlogmask(LOG_UPTO(LOG_CRIT));
+	logger_start();
+	columns_init();
+
+	for(i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+	{
+		if(filter != NULL && strstr(benches[i].name, filter) == NULL)
+			continue;
+		parser_set_engine(benches[i].engine);
+		program_set_arith(benches[i].arith);
+		dag_init(benches[i].dag_threshold);
+		if(benches[i].run == run_tokenize || benches[i].run == run_tokenize_scalar)
+			benches[i].size = strlen(benches[i].expr);
+		if(bench_parses(&benches[i]))
+		{
+			if(benches[i].size == 0)
+				benches[i].size = strlen(benches[i].expr);
+			if(bench_status(&benches[i]) != benches[i].expected)
+			{
+				fprintf(stderr, "%s: unexpected status for %s\n", benches[i].name, benches[i].expr);
+				exit(EXIT_FAILURE);
+			}
+		}
+		// Pipelining needs keep-alive; a single request closes on its own
+		ctp_config.keep_alive = benches[i].size > 1 && (benches[i].run == run_connection || benches[i].run == run_binary_connection);
+		bench_run(&benches[i]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,673 @@
+/********************************************************************************
+ * bignum.c
+ *
+ * Computer Science 3357a
+ * Arbitrary-Precision Arithmetic
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of exact arithmetic. A value is a sign and a magnitude of
+ * 32-bit limbs, least significant first, so a product of two limbs and a
+ * carry fits in 64 bits. Long products are split by Karatsuba's method,
+ * division is Knuth's algorithm D, and the decimal form is made by
+ * dividing by 10^9 repeatedly. Results are never freed: the arena is
+ * emptied in one step when the next evaluation starts, and temporaries of
+ * a multiplication or division are handed back as soon as it returns.
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "bignum.h"
+#include "parser.h"
+
+#define LIMB_BITS 32
+#define DECIMAL_BASE 1000000000		// Largest power of ten in a limb
+#define DECIMAL_DIGITS 9
+
+//A block of the arena
+struct arena_block
+{
+	struct arena_block* next;
+	size_t size;		// Bytes of data
+	size_t used;		// Bytes of data handed out
+	uint64_t data[];
+};
+
+//A point of the arena to hand everything allocated after it back to
+struct arena_mark
+{
+	struct arena_block* block;
+	size_t used;
+};
+
+//A value being evaluated
+struct big
+{
+	uint32_t* limbs;	// Magnitude, least significant limb first
+	size_t len;			// Limbs in use, without leading zero limbs; 0 for zero
+	size_t cap;			// Limbs that may be written; 0 if they belong to the program
+	bool neg;			// Negative; never set for zero
+};
+
+static __thread struct arena_block* arena = NULL;		// First block, kept between evaluations
+static __thread struct arena_block* arena_top = NULL;	// Block being allocated from
+static bool use_karatsuba = true;
+
+static const uint32_t powers_of_ten[DECIMAL_DIGITS + 1] =
+	{ 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+void big_set_karatsuba(bool karatsuba)
+{
+	use_karatsuba = karatsuba;
+}
+
+static struct arena_block* arena_block_new(size_t size)
+{
+	struct arena_block* b = malloc(sizeof(struct arena_block) + size);
+	if(b == NULL)
+		exit(EXIT_FAILURE);
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+static void arena_free_chain(struct arena_block* b)
+{
+	struct arena_block* next;
+
+	for(; b != NULL; b = next)
+	{
+		next = b->next;
+		free(b);
+	}
+}
+
+/*
+ * Empties the arena, keeping only its first block
+ */
+static void arena_reset()
+{
+	if(arena == NULL)
+		arena = arena_block_new(BIG_ARENA_BLOCK);
+
+	arena_free_chain(arena->next);
+	arena->next = NULL;
+	arena->used = 0;
+	arena_top = arena;
+}
+
+/*
+ * Allocates from the arena, moving on to a new block (at least twice as
+ * large as the last) when the current one is full
+ */
+static void* arena_alloc(size_t bytes)
+{
+	struct arena_block* b = arena_top;
+	struct arena_block* fresh;
+	void* p;
+
+	bytes = (bytes + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	while(b->size - b->used < bytes)
+	{
+		// A block left by an earlier release is reused if it is large enough
+		if(b->next != NULL && b->next->size >= bytes)
+		{
+			b = b->next;
+			b->used = 0;
+			continue;
+		}
+		fresh = arena_block_new(bytes > b->size * 2 ? bytes : b->size * 2);
+		arena_free_chain(b->next);
+		b->next = fresh;
+		b = fresh;
+	}
+
+	p = (unsigned char*)b->data + b->used;
+	b->used += bytes;
+	arena_top = b;
+	return p;
+}
+
+static struct arena_mark arena_save()
+{
+	return (struct arena_mark){ arena_top, arena_top->used };
+}
+
+static void arena_release(struct arena_mark mark)
+{
+	arena_top = mark.block;
+	arena_top->used = mark.used;
+}
+
+static uint32_t* limbs_alloc(size_t n)
+{
+	return arena_alloc((n > 0 ? n : 1) * sizeof(uint32_t));
+}
+
+/*
+ * Operations on magnitudes. A result may be written over an operand
+ * unless stated otherwise, as each limb is read before it is written.
+ */
+static size_t limbs_norm(const uint32_t* a, size_t n)
+{
+	while(n > 0 && a[n - 1] == 0)
+		n--;
+	return n;
+}
+
+static int limbs_cmp(const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	if(an != bn)
+		return an < bn ? -1 : 1;
+	while(an-- > 0)
+		if(a[an] != b[an])
+			return a[an] < b[an] ? -1 : 1;
+	return 0;
+}
+
+/*
+ * r = a + b, where an >= bn and r has room for an + 1 limbs
+ *
+ * return: the length of r
+ */
+static size_t limbs_add(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	uint64_t carry = 0;
+	size_t i;
+
+	for(i = 0; i < bn; i++)
+	{
+		carry += (uint64_t)a[i] + b[i];
+		r[i] = (uint32_t)carry;
+		carry >>= LIMB_BITS;
+	}
+	for(; i < an; i++)
+	{
+		carry += a[i];
+		r[i] = (uint32_t)carry;
+		carry >>= LIMB_BITS;
+	}
+	r[an] = (uint32_t)carry;
+	return an + (carry != 0);
+}
+
+/*
+ * r = a - b, where a >= b
+ *
+ * return: the length of r, without leading zero limbs
+ */
+static size_t limbs_sub(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	uint64_t diff;
+	uint32_t borrow = 0;
+	size_t i;
+
+	for(i = 0; i < bn; i++)
+	{
+		diff = (uint64_t)a[i] - b[i] - borrow;
+		r[i] = (uint32_t)diff;
+		borrow = (diff >> LIMB_BITS) & 1;
+	}
+	for(; i < an; i++)
+	{
+		diff = (uint64_t)a[i] - borrow;
+		r[i] = (uint32_t)diff;
+		borrow = (diff >> LIMB_BITS) & 1;
+	}
+	return limbs_norm(r, an);
+}
+
+/*
+ * r += b, where bn <= rn and the sum fits in rn limbs
+ */
+static void limbs_add_into(uint32_t* r, size_t rn, const uint32_t* b, size_t bn)
+{
+	uint64_t carry = 0;
+	size_t i;
+
+	for(i = 0; i < bn; i++)
+	{
+		carry += (uint64_t)r[i] + b[i];
+		r[i] = (uint32_t)carry;
+		carry >>= LIMB_BITS;
+	}
+	for(; carry != 0 && i < rn; i++)
+	{
+		carry += r[i];
+		r[i] = (uint32_t)carry;
+		carry >>= LIMB_BITS;
+	}
+}
+
+/*
+ * r -= b, where bn <= rn and r >= b
+ */
+static void limbs_sub_into(uint32_t* r, size_t rn, const uint32_t* b, size_t bn)
+{
+	uint64_t diff;
+	uint32_t borrow = 0;
+	size_t i;
+
+	for(i = 0; i < bn; i++)
+	{
+		diff = (uint64_t)r[i] - b[i] - borrow;
+		r[i] = (uint32_t)diff;
+		borrow = (diff >> LIMB_BITS) & 1;
+	}
+	for(; borrow != 0 && i < rn; i++)
+	{
+		diff = (uint64_t)r[i] - borrow;
+		r[i] = (uint32_t)diff;
+		borrow = (diff >> LIMB_BITS) & 1;
+	}
+}
+
+/*
+ * r = a * b by schoolbook, where r has room for an + bn limbs and is
+ * neither operand
+ */
+static void limbs_mul_school(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	uint64_t carry;
+	size_t i, j;
+
+	memset(r, 0, (an + bn) * sizeof(uint32_t));
+	for(i = 0; i < bn; i++)
+	{
+		if(b[i] == 0)
+			continue;
+		carry = 0;
+		for(j = 0; j < an; j++)
+		{
+			// At most (2^32 - 1)^2 + 2 * (2^32 - 1), which is 2^64 - 1
+			carry += (uint64_t)a[j] * b[i] + r[i + j];
+			r[i + j] = (uint32_t)carry;
+			carry >>= LIMB_BITS;
+		}
+		r[i + an] = (uint32_t)carry;
+	}
+}
+
+/*
+ * r = a * b, where r has room for an + bn limbs and is neither operand.
+ * Operands may have leading zero limbs, and so may r.
+ *
+ * Karatsuba splits the longer operand at m limbs, with a = a1 B^m + a0
+ * and b = b1 B^m + b0, and gets the middle of the product from a single
+ * multiplication: a0 b1 + a1 b0 = (a0 + a1)(b0 + b1) - a0 b0 - a1 b1.
+ */
+static void limbs_mul(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	const uint32_t* t;
+	struct arena_mark mark;
+	uint32_t* part, * sa, * sb, * mid;
+	size_t m, i, k, san, sbn, midn;
+
+	if(an < bn)
+	{
+		t = a; a = b; b = t;
+		k = an; an = bn; bn = k;
+	}
+	if(bn < BIG_KARATSUBA_LIMBS || !use_karatsuba)
+	{
+		limbs_mul_school(r, a, an, b, bn);
+		return;
+	}
+
+	mark = arena_save();
+	if(an >= 2 * bn)
+	{
+		// Too lopsided to split evenly; b times slices of a as long as b
+		part = limbs_alloc(2 * bn);
+		memset(r, 0, (an + bn) * sizeof(uint32_t));
+		for(i = 0; i < an; i += bn)
+		{
+			k = an - i < bn ? an - i : bn;
+			limbs_mul(part, a + i, k, b, bn);
+			limbs_add_into(r + i, an + bn - i, part, k + bn);
+		}
+	}
+	else
+	{
+		// bn > an / 2, so b has all m low limbs and b1 may be empty
+		m = (an + 1) / 2;
+		limbs_mul(r, a, m, b, m);
+		limbs_mul(r + 2 * m, a + m, an - m, b + m, bn - m);
+
+		sa = limbs_alloc(m + 1);
+		sb = limbs_alloc(m + 1);
+		san = limbs_add(sa, a, m, a + m, an - m);
+		sbn = limbs_add(sb, b, m, b + m, bn - m);
+		mid = limbs_alloc(san + sbn);
+		limbs_mul(mid, sa, san, sb, sbn);
+		midn = san + sbn;
+		limbs_sub_into(mid, midn, r, 2 * m);
+		limbs_sub_into(mid, midn, r + 2 * m, an + bn - 2 * m);
+		limbs_add_into(r + m, an + bn - m, mid, limbs_norm(mid, midn));
+	}
+	arena_release(mark);
+}
+
+/*
+ * q = a / b, truncated, where a and b have no leading zero limbs, b is
+ * not zero and q has room for an limbs
+ *
+ * return: the length of q, without leading zero limbs
+ */
+static size_t limbs_div(uint32_t* q, const uint32_t* a, size_t an, const uint32_t* b, size_t bn)
+{
+	struct arena_mark mark;
+	uint32_t* u, * v;
+	uint64_t rem, num, qhat, rhat, product;
+	int64_t borrow, diff;
+	size_t i, j;
+	int shift;
+
+	if(limbs_cmp(a, an, b, bn) < 0)
+		return 0;
+
+	if(bn == 1)
+	{
+		rem = 0;
+		for(i = an; i-- > 0;)
+		{
+			rem = rem << LIMB_BITS | a[i];
+			q[i] = (uint32_t)(rem / b[0]);
+			rem %= b[0];
+		}
+		return limbs_norm(q, an);
+	}
+
+	// Shift both so the divisor's top bit is set; then each estimate of a
+	// quotient limb from the top two limbs is at most two too large
+	mark = arena_save();
+	u = limbs_alloc(an + 1);
+	v = limbs_alloc(bn);
+	shift = __builtin_clz(b[bn - 1]);
+	for(i = bn - 1; i > 0; i--)
+		v[i] = (uint32_t)((((uint64_t)b[i] << LIMB_BITS) | b[i - 1]) >> (LIMB_BITS - shift));
+	v[0] = b[0] << shift;
+	u[an] = (uint32_t)((uint64_t)a[an - 1] >> (LIMB_BITS - shift));
+	for(i = an - 1; i > 0; i--)
+		u[i] = (uint32_t)((((uint64_t)a[i] << LIMB_BITS) | a[i - 1]) >> (LIMB_BITS - shift));
+	u[0] = a[0] << shift;
+
+	for(j = an - bn + 1; j-- > 0;)
+	{
+		num = (uint64_t)u[j + bn] << LIMB_BITS | u[j + bn - 1];
+		qhat = num / v[bn - 1];
+		rhat = num % v[bn - 1];
+		while(qhat >> LIMB_BITS != 0 || qhat * v[bn - 2] > (rhat << LIMB_BITS | u[j + bn - 2]))
+		{
+			qhat--;
+			rhat += v[bn - 1];
+			if(rhat >> LIMB_BITS != 0)
+				break;
+		}
+
+		// Subtract qhat times the divisor from the window of the dividend
+		borrow = 0;
+		for(i = 0; i < bn; i++)
+		{
+			product = qhat * v[i];
+			diff = (int64_t)u[i + j] - borrow - (int64_t)(product & UINT32_MAX);
+			u[i + j] = (uint32_t)diff;
+			borrow = (int64_t)(product >> LIMB_BITS) - (diff >> LIMB_BITS);
+		}
+		diff = (int64_t)u[j + bn] - borrow;
+		u[j + bn] = (uint32_t)diff;
+
+		// The estimate was one too large; add the divisor back
+		q[j] = (uint32_t)qhat;
+		if(diff < 0)
+		{
+			q[j]--;
+			limbs_add_into(u + j, bn + 1, v, bn);
+		}
+	}
+
+	arena_release(mark);
+	return limbs_norm(q, an - bn + 1);
+}
+
+size_t big_from_decimal(const char* digits, size_t len, uint32_t* limbs)
+{
+	uint64_t carry;
+	uint32_t chunk;
+	size_t n = 0, i, j, k;
+
+	// The first chunk takes the odd digits so the rest are all whole
+	for(i = 0; i < len; i += k)
+	{
+		k = i == 0 && len % DECIMAL_DIGITS != 0 ? len % DECIMAL_DIGITS : DECIMAL_DIGITS;
+		for(chunk = 0, j = i; j < i + k; j++)
+			chunk = chunk * 10 + (digits[j] - '0');
+
+		carry = chunk;
+		for(j = 0; j < n; j++)
+		{
+			carry += (uint64_t)limbs[j] * powers_of_ten[k];
+			limbs[j] = (uint32_t)carry;
+			carry >>= LIMB_BITS;
+		}
+		if(carry != 0)
+			limbs[n++] = (uint32_t)carry;
+	}
+	return n;
+}
+
+/*
+ * Sets v to a 64-bit value
+ */
+static void big_set(struct big* v, int64_t value)
+{
+	uint64_t mag = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+	v->limbs = limbs_alloc(2);
+	v->cap = 2;
+	v->limbs[0] = (uint32_t)mag;
+	v->limbs[1] = (uint32_t)(mag >> LIMB_BITS);
+	v->len = limbs_norm(v->limbs, 2);
+	v->neg = value < 0;
+}
+
+/*
+ * a = a + b, or a - b if subtract is set. The sum is written over a when
+ * it has room, which it usually does after the first of a run of sums.
+ */
+static void big_add(struct big* a, const struct big* b, bool subtract)
+{
+	bool bneg = b->neg != subtract;
+	size_t need = (a->len > b->len ? a->len : b->len) + 1;
+	uint32_t* r = a->limbs;
+
+	if(a->cap < need)
+	{
+		r = limbs_alloc(need + need / 2);
+		a->cap = need + need / 2;
+	}
+
+	if(b->len == 0)
+		memmove(r, a->limbs, a->len * sizeof(uint32_t));
+	else if(a->neg == bneg)
+	{
+		if(a->len >= b->len)
+			a->len = limbs_add(r, a->limbs, a->len, b->limbs, b->len);
+		else
+			a->len = limbs_add(r, b->limbs, b->len, a->limbs, a->len);
+	}
+	else if(limbs_cmp(a->limbs, a->len, b->limbs, b->len) >= 0)
+		a->len = limbs_sub(r, a->limbs, a->len, b->limbs, b->len);
+	else
+	{
+		a->len = limbs_sub(r, b->limbs, b->len, a->limbs, a->len);
+		a->neg = bneg;
+	}
+
+	a->limbs = r;
+	if(a->len == 0)
+		a->neg = false;
+}
+
+/*
+ * a = a * b
+ */
+static void big_mul(struct big* a, const struct big* b)
+{
+	uint32_t* r;
+
+	if(a->len == 0 || b->len == 0)
+	{
+		a->len = 0;
+		a->neg = false;
+		return;
+	}
+
+	r = limbs_alloc(a->len + b->len);
+	limbs_mul(r, a->limbs, a->len, b->limbs, b->len);
+	a->limbs = r;
+	a->cap = a->len + b->len;
+	a->len = limbs_norm(r, a->cap);
+	a->neg = a->neg != b->neg;
+}
+
+/*
+ * a = a / b, truncated, where b is not zero
+ */
+static void big_div(struct big* a, const struct big* b)
+{
+	uint32_t* q = limbs_alloc(a->len);
+
+	a->len = limbs_div(q, a->limbs, a->len, b->limbs, b->len);
+	a->limbs = q;
+	a->cap = a->len;
+	a->neg = a->len > 0 && a->neg != b->neg;
+}
+
+/*
+ * Writes v in decimal
+ *
+ * return: the text, in the arena; not terminated
+ */
+static const char* big_format(const struct big* v, size_t* len)
+{
+	uint32_t* mag = limbs_alloc(v->len);
+	uint32_t* chunks = limbs_alloc(v->len + v->len / 8 + 2);	// Base 10^9 digits, 1.07 per limb at most
+	uint64_t rem;
+	uint32_t chunk;
+	size_t n = v->len, count = 0, i;
+	char* text, * p;
+	int k;
+
+	memcpy(mag, v->limbs, n * sizeof(uint32_t));
+	do
+	{
+		rem = 0;
+		for(i = n; i-- > 0;)
+		{
+			rem = rem << LIMB_BITS | mag[i];
+			mag[i] = (uint32_t)(rem / DECIMAL_BASE);
+			rem %= DECIMAL_BASE;
+		}
+		n = limbs_norm(mag, n);
+		chunks[count++] = (uint32_t)rem;
+	} while(n > 0);
+
+	text = arena_alloc(count * DECIMAL_DIGITS + 1);
+	p = text;
+	if(v->neg)
+		*p++ = '-';
+
+	// Every chunk but the most significant is zero-padded
+	for(k = DECIMAL_DIGITS - 1, chunk = chunks[count - 1]; k > 0 && chunk < powers_of_ten[k]; k--)
+		;
+	for(; k >= 0; k--)
+		*p++ = '0' + chunk / powers_of_ten[k] % 10;
+	for(i = count - 1; i-- > 0;)
+		for(k = DECIMAL_DIGITS - 1, chunk = chunks[i]; k >= 0; k--)
+			*p++ = '0' + chunk / powers_of_ten[k] % 10;
+
+	*len = p - text;
+	return text;
+}
+
+int run_program_big(const program* prog, const char** digits, size_t* len)
+{
+	const int32_t* pc = prog->code;
+	const int32_t* end = pc + prog->len;
+	struct big* stk, * sp, * slots;
+	size_t n;
+
+	if(prog->num_vars > 0)
+	{
+		syslog(LOG_ERR, "Unbound variable %s", prog->vars[0]);
+		return INVALID_EXPR;
+	}
+
+	arena_reset();
+	stk = arena_alloc((prog->max_depth + 1 + prog->num_slots) * sizeof(struct big));
+	sp = stk;
+	slots = stk + prog->max_depth + 1;
+
+	while(pc < end)
+	{
+		switch(*pc++)
+		{
+			case OP_PUSH:
+				big_set(sp++, *pc++);
+				break;
+			case OP_PUSH_WIDE:
+				big_set(sp++, (int64_t)((uint64_t)(uint32_t)pc[0] << 32 | (uint32_t)pc[1]));
+				pc += 2;
+				break;
+			case OP_PUSH_BIG:
+				// The limbs are read where they are; a result never goes over them
+				n = *pc++;
+				sp->limbs = (uint32_t*)pc;
+				sp->len = limbs_norm(sp->limbs, n);
+				sp->cap = 0;
+				sp->neg = false;
+				sp++;
+				pc += n;
+				break;
+			case OP_SAVE:
+				// Neither copy may now be written over, as the other shares its limbs
+				sp[-1].cap = 0;
+				slots[*pc++] = sp[-1];
+				break;
+			case OP_RECALL:
+				*sp++ = slots[*pc++];
+				break;
+			case OP_ADD:
+				sp--;
+				big_add(&sp[-1], &sp[0], false);
+				break;
+			case OP_SUB:
+				sp--;
+				big_add(&sp[-1], &sp[0], true);
+				break;
+			case OP_MUL:
+				sp--;
+				big_mul(&sp[-1], &sp[0]);
+				break;
+			case OP_DIV:
+				sp--;
+				if(sp[0].len == 0)
+				{
+					syslog(LOG_ERR, "Cannot divide by zero");
+					return INVALID_EXPR;
+				}
+				big_div(&sp[-1], &sp[0]);
+				break;
+			case OP_NEG:
+				sp[-1].neg = !sp[-1].neg && sp[-1].len > 0;
+				break;
+		}
+	}
+
+	if(digits != NULL && sp > stk)
+		*digits = big_format(&sp[-1], len);
+	return OK;
+}
@@ -0,0 +1,61 @@
+/********************************************************************************
+ * bignum.h
+ *
+ * Computer Science 3357a
+ * Arbitrary-Precision Arithmetic
+ *
+ * Author: Duncan Cai
+ *
+ * Exact evaluation of programs whose values do not fit in 64 bits. Values
+ * are arrays of 32-bit limbs, and everything one evaluation allocates comes
+ * from a per-thread arena that is emptied at the start of the next.
+*******************************************************************************/
+
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bytecode.h"
+
+#define BIG_KARATSUBA_LIMBS 32		// Shorter operands are multiplied by schoolbook
+#define BIG_ARENA_BLOCK 65536		// Bytes of arena each thread keeps between evaluations
+
+//Most limbs a decimal literal of the given length needs, as 10^9 < 2^32
+#define BIG_DECIMAL_LIMBS(len) (((len) + 8) / 9)
+
+/*
+ * Converts decimal digits to limbs, least significant first
+ *
+ * digits: the digits, not necessarily terminated
+ * len: number of digits
+ * limbs: room for BIG_DECIMAL_LIMBS(len) limbs
+ *
+ * return: the number of limbs, without leading zero limbs
+ */
+size_t big_from_decimal(const char* digits, size_t len, uint32_t* limbs);
+
+/*
+ * Runs the program in exact integer arithmetic. Division truncates toward
+ * zero, as it does in the other arithmetic.
+ *
+ * prog: a program produced by compile_expr
+ * digits: set to the result in decimal, with a leading minus if it is
+ * negative; it is valid until this thread's next call. NULL if only the
+ * status is wanted.
+ * len: set to the length of the result
+ *
+ * return: OK, or INVALID_EXPR if it divides by zero or has variables
+ */
+int run_program_big(const program* prog, const char** digits, size_t* len);
+
+/*
+ * Chooses whether long operands are multiplied by Karatsuba's method (the
+ * default) or always by schoolbook, to compare the two
+ *
+ * karatsuba: true to split operands of BIG_KARATSUBA_LIMBS limbs or more
+ */
+void big_set_karatsuba(bool karatsuba);
+
+#endif
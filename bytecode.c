@@ -0,0 +1,529 @@
+/********************************************************************************
+ * bytecode.c
+ *
+ * Computer Science 3357a
+ * Expression Bytecode
+ *
+ * Author: Duncan Cai
+ *
+ * Program storage and the stack machine that runs compiled expressions.
+ * The top of the operand stack is kept in a register and the rest in a
+ * small array on the C stack. Programs with variables are instead run over
+ * columns of bindings, an instruction at a time for a block of rows.
+ * Checked arithmetic has a loop of its own that widens to 64 bits and
+ * gathers overflows into one flag, tested once the program has run; exact
+ * arithmetic uses the same loop, and bignum.c only where it overflows.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "bytecode.h"
+#include "bignum.h"
+#include "parser.h"
+
+#define PROGRAM_INITIAL_SIZE 64
+
+static int arith_mode = ARITH_WRAP;
+
+program* program_init()
+{
+	program* prog = malloc(sizeof(program));
+	if(prog == NULL)
+		exit(EXIT_FAILURE);
+	prog->code = malloc(PROGRAM_INITIAL_SIZE * sizeof(int32_t));
+	if(prog->code == NULL)
+		exit(EXIT_FAILURE);
+	prog->capacity = PROGRAM_INITIAL_SIZE;
+	prog->len = 0;
+	prog->max_depth = 0;
+	prog->num_slots = 0;
+	prog->num_vars = 0;
+	return prog;
+}
+
+void program_clear(program* prog)
+{
+	prog->len = 0;
+	prog->max_depth = 0;
+	prog->num_slots = 0;
+	prog->num_vars = 0;
+}
+
+void program_emit(program* prog, int32_t word)
+{
+	if(prog->len == prog->capacity)
+	{
+		int32_t* code = realloc(prog->code, prog->capacity * 2 * sizeof(int32_t));
+		if(code == NULL)
+			exit(EXIT_FAILURE);
+		prog->code = code;
+		prog->capacity *= 2;
+	}
+	prog->code[prog->len++] = word;
+}
+
+int program_variable(program* prog, const char* name, size_t len)
+{
+	int i;
+
+	for(i = 0; i < prog->num_vars; i++)
+		if(strncmp(prog->vars[i], name, len) == 0 && prog->vars[i][len] == '\0')
+			return i;
+
+	if(len >= VAR_NAME_SIZE || prog->num_vars == PROGRAM_MAX_VARS)
+		return -1;
+	memcpy(prog->vars[i], name, len);
+	prog->vars[i][len] = '\0';
+	return prog->num_vars++;
+}
+
+bool program_emit_literal(program* prog, const char* digits, size_t len)
+{
+	int64_t value = 0;
+	uint32_t* limbs;
+	size_t i, n;
+
+	for(i = 0; i < len; i++)
+	{
+		if(__builtin_mul_overflow(value, 10, &value) || __builtin_add_overflow(value, digits[i] - '0', &value))
+			break;
+	}
+
+	if(i < len)
+	{
+		if(arith_mode != ARITH_BIG)
+			return false;
+		limbs = malloc(BIG_DECIMAL_LIMBS(len) * sizeof(uint32_t));
+		if(limbs == NULL)
+			exit(EXIT_FAILURE);
+		n = big_from_decimal(digits, len, limbs);
+		program_emit(prog, OP_PUSH_BIG);
+		program_emit(prog, (int32_t)n);
+		for(i = 0; i < n; i++)
+			program_emit(prog, (int32_t)limbs[i]);
+		free(limbs);
+	}
+	else if(value <= INT32_MAX)
+	{
+		program_emit(prog, OP_PUSH);
+		program_emit(prog, (int32_t)value);
+	}
+	else
+	{
+		program_emit(prog, OP_PUSH_WIDE);
+		program_emit(prog, (int32_t)(value >> 32));
+		program_emit(prog, (int32_t)(uint32_t)value);
+	}
+	return true;
+}
+
+void program_set_arith(int mode)
+{
+	arith_mode = mode;
+}
+
+int program_arith()
+{
+	return arith_mode;
+}
+
+int program_verify(program* prog)
+{
+	size_t depth = 0;
+	size_t i = 0;
+
+	prog->max_depth = 0;
+	prog->num_slots = 0;
+	while(i < prog->len)
+	{
+		switch(prog->code[i++])
+		{
+			case OP_PUSH:
+				if(i++ == prog->len)
+					return INVALID_EXPR;
+				if(++depth > prog->max_depth)
+					prog->max_depth = depth;
+				break;
+			case OP_PUSH_WIDE:
+				if(arith_mode == ARITH_WRAP || prog->len - i < 2)
+					return INVALID_EXPR;
+				i += 2;
+				if(++depth > prog->max_depth)
+					prog->max_depth = depth;
+				break;
+			case OP_PUSH_BIG:
+				if(arith_mode != ARITH_BIG || i == prog->len || prog->code[i] < 0
+					|| prog->len - i - 1 < (size_t)prog->code[i])
+					return INVALID_EXPR;
+				i += 1 + prog->code[i];
+				if(++depth > prog->max_depth)
+					prog->max_depth = depth;
+				break;
+			case OP_ADD:
+			case OP_SUB:
+			case OP_MUL:
+			case OP_DIV:
+				if(depth < 2)
+					return INVALID_EXPR;
+				depth--;
+				break;
+			case OP_NEG:
+				if(depth < 1)
+					return INVALID_EXPR;
+				break;
+			default:
+				return INVALID_EXPR;
+		}
+	}
+	return depth == 1 ? OK : INVALID_EXPR;
+}
+
+/*
+ * Runs the program using the given operand storage
+ *
+ * stk: room for at least max_depth operands, then num_slots slots
+ *
+ * return: OK, or INVALID_EXPR if it divides by zero
+ * If OK and anything is left on the stack, result holds its top
+ */
+static int program_exec(const program* prog, int* stk, int64_t* result)
+{
+	const int32_t* pc = prog->code;
+	const int32_t* end = pc + prog->len;
+	int* sp = stk;		// Operands below the top
+	int* slots = stk + prog->max_depth;
+	int top = 0;		// Top of the operand stack
+
+	while(pc < end)
+	{
+		switch(*pc++)
+		{
+			case OP_PUSH:
+				*sp++ = top;
+				top = *pc++;
+				break;
+			case OP_SAVE:
+				slots[*pc++] = top;
+				break;
+			case OP_RECALL:
+				*sp++ = top;
+				top = slots[*pc++];
+				break;
+			case OP_ADD:
+				top = *--sp + top;
+				break;
+			case OP_SUB:
+				top = *--sp - top;
+				break;
+			case OP_MUL:
+				top = *--sp * top;
+				break;
+			case OP_DIV:
+				if(top == 0)
+				{
+					syslog(LOG_ERR, "Cannot divide by zero");
+					return INVALID_EXPR;
+				}
+				// The most negative value would trap in the divider
+				top = top == -1 ? -*--sp : *--sp / top;
+				break;
+			case OP_NEG:
+				top = -top;
+				break;
+		}
+	}
+
+	if(sp > stk)
+		*result = top;
+	return OK;
+}
+
+/*
+ * Runs the program in checked arithmetic using the given operand storage
+ *
+ * stk: room for at least max_depth operands, then num_slots slots
+ * columns: for each variable, its values, or NULL if there are none
+ * row: the row of columns to bind
+ *
+ * return: OK, INVALID_EXPR if it divides by zero, or OVERFLOW (as
+ * run_program describes); rows are not logged, as a column may fail in
+ * every one of them
+ * If OK and anything is left on the stack, result holds its top
+ */
+static int program_exec_checked(const program* prog, int64_t* stk, const int32_t* const* columns, size_t row,
+	int64_t* result)
+{
+	const int32_t* pc = prog->code;
+	const int32_t* end = pc + prog->len;
+	int64_t* sp = stk;		// Operands below the top
+	int64_t* slots = stk + prog->max_depth;
+	int64_t top = 0;		// Top of the operand stack
+	bool overflow = false;	// Some operation overflowed
+
+	while(pc < end)
+	{
+		switch(*pc++)
+		{
+			case OP_PUSH:
+				*sp++ = top;
+				top = *pc++;
+				break;
+			case OP_PUSH_WIDE:
+				*sp++ = top;
+				top = (int64_t)((uint64_t)(uint32_t)pc[0] << 32 | (uint32_t)pc[1]);
+				pc += 2;
+				break;
+			case OP_PUSH_BIG:
+				*sp++ = top;
+				top = 0;
+				overflow = true;
+				pc += 1 + *pc;
+				break;
+			case OP_LOAD:
+				*sp++ = top;
+				top = columns[*pc++][row];
+				break;
+			case OP_SAVE:
+				slots[*pc++] = top;
+				break;
+			case OP_RECALL:
+				*sp++ = top;
+				top = slots[*pc++];
+				break;
+			case OP_ADD:
+				overflow |= __builtin_add_overflow(*--sp, top, &top);
+				break;
+			case OP_SUB:
+				overflow |= __builtin_sub_overflow(*--sp, top, &top);
+				break;
+			case OP_MUL:
+				overflow |= __builtin_mul_overflow(*--sp, top, &top);
+				break;
+			case OP_DIV:
+				// A divisor that overflowed may only have wrapped to zero
+				if(top == 0)
+					return overflow ? OVERFLOW : INVALID_EXPR;
+				// Only the most negative value over -1 overflows
+				if(top == -1)
+					overflow |= __builtin_sub_overflow(0, *--sp, &top);
+				else
+					top = *--sp / top;
+				break;
+			case OP_NEG:
+				overflow |= __builtin_sub_overflow(0, top, &top);
+				break;
+		}
+	}
+
+	if(overflow)
+		return OVERFLOW;
+	if(sp > stk)
+		*result = top;
+	return OK;
+}
+
+int run_program(const program* prog, int64_t* result)
+{
+	int local[EVAL_STACK_SIZE];
+	int* stk = local;
+	int status_code;
+	unsigned char status;
+
+	// Variables are only bound when run over columns
+	if(prog->num_vars > 0)
+	{
+		syslog(LOG_ERR, "Unbound variable %s", prog->vars[0]);
+		return INVALID_EXPR;
+	}
+
+	// Checked arithmetic is one row with nothing to bind; in exact
+	// arithmetic an overflow only means the result must be worked out again
+	if(arith_mode != ARITH_WRAP)
+	{
+		run_program_columns_checked(prog, NULL, 1, result, &status);
+		if(status == INVALID_EXPR)
+			syslog(LOG_ERR, "Cannot divide by zero");
+		else if(status == OVERFLOW && arith_mode == ARITH_CHECKED)
+			syslog(LOG_ERR, "Arithmetic overflow");
+		return status;
+	}
+
+	// Only very deeply nested or shared expressions need more than the local array
+	if(prog->max_depth + prog->num_slots > EVAL_STACK_SIZE)
+	{
+		stk = malloc((prog->max_depth + prog->num_slots) * sizeof(int));
+		if(stk == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	status_code = program_exec(prog, stk, result);
+
+	if(stk != local)
+		free(stk);
+	return status_code;
+}
+
+/*
+ * Operations on whole blocks. The operands never overlap, and the trip
+ * count is fixed, so each loop becomes vector instructions with no
+ * scalar remainder.
+ */
+static inline void column_fill(int32_t* restrict a, int32_t value)
+{
+	for(int i = 0; i < COLUMN_BLOCK; i++)
+		a[i] = value;
+}
+
+static inline void column_add(int32_t* restrict a, const int32_t* restrict b)
+{
+	for(int i = 0; i < COLUMN_BLOCK; i++)
+		a[i] += b[i];
+}
+
+static inline void column_sub(int32_t* restrict a, const int32_t* restrict b)
+{
+	for(int i = 0; i < COLUMN_BLOCK; i++)
+		a[i] -= b[i];
+}
+
+static inline void column_mul(int32_t* restrict a, const int32_t* restrict b)
+{
+	for(int i = 0; i < COLUMN_BLOCK; i++)
+		a[i] *= b[i];
+}
+
+static inline void column_neg(int32_t* restrict a)
+{
+	for(int i = 0; i < COLUMN_BLOCK; i++)
+		a[i] = -a[i];
+}
+
+/*
+ * Divides a block, flagging the rows that divide by zero. There is no
+ * vector integer division, but the checks are vectorized. Dividing by -1
+ * negates, since the most negative value would trap in the divider.
+ */
+static inline void column_div(int32_t* restrict a, const int32_t* restrict b, unsigned char* restrict failed)
+{
+	int i;
+
+	for(i = 0; i < COLUMN_BLOCK; i++)
+		failed[i] |= b[i] == 0;
+	for(i = 0; i < COLUMN_BLOCK; i++)
+		a[i] = b[i] == 0 ? 0 : b[i] == -1 ? -a[i] : a[i] / b[i];
+}
+
+/*
+ * Runs the program over the block of rows starting at the given row
+ * Lanes past the last row hold zeros, and their results are ignored
+ *
+ * stk: room for max_depth blocks, then num_slots blocks of slots
+ * failed: set nonzero for each row that divides by zero
+ *
+ * Built for AVX2 as well as the baseline, picked when the program loads
+ */
+__attribute__((target_clones("avx2", "default")))
+static void program_exec_block(const program* prog, const int32_t* const* columns, size_t start, size_t n,
+	int32_t (*stk)[COLUMN_BLOCK], unsigned char* failed)
+{
+	const int32_t* pc = prog->code;
+	const int32_t* end = pc + prog->len;
+	int32_t (*sp)[COLUMN_BLOCK] = stk;	// Block above the top of the stack
+	int32_t (*slots)[COLUMN_BLOCK] = stk + prog->max_depth;
+
+	memset(failed, 0, COLUMN_BLOCK);
+	while(pc < end)
+	{
+		switch(*pc++)
+		{
+			case OP_PUSH:
+				column_fill(*sp++, *pc++);
+				break;
+			case OP_LOAD:
+				memcpy(*sp, columns[*pc++] + start, n * sizeof(int32_t));
+				memset(*sp + n, 0, (COLUMN_BLOCK - n) * sizeof(int32_t));
+				sp++;
+				break;
+			case OP_SAVE:
+				memcpy(slots[*pc++], sp[-1], sizeof(*sp));
+				break;
+			case OP_RECALL:
+				memcpy(*sp++, slots[*pc++], sizeof(*sp));
+				break;
+			case OP_ADD:
+				sp--;
+				column_add(sp[-1], sp[0]);
+				break;
+			case OP_SUB:
+				sp--;
+				column_sub(sp[-1], sp[0]);
+				break;
+			case OP_MUL:
+				sp--;
+				column_mul(sp[-1], sp[0]);
+				break;
+			case OP_DIV:
+				sp--;
+				column_div(sp[-1], sp[0], failed);
+				break;
+			case OP_NEG:
+				column_neg(sp[-1]);
+				break;
+		}
+	}
+}
+
+void run_program_columns(const program* prog, const int32_t* const* columns, size_t rows, int32_t* results, unsigned char* statuses)
+{
+	int32_t (*stk)[COLUMN_BLOCK];
+	unsigned char failed[COLUMN_BLOCK];
+	size_t start, n, i;
+
+	stk = malloc((prog->max_depth > 0 ? prog->max_depth + prog->num_slots : 1) * sizeof(*stk));
+	if(stk == NULL)
+		exit(EXIT_FAILURE);
+
+	for(start = 0; start < rows; start += n)
+	{
+		n = rows - start < COLUMN_BLOCK ? rows - start : COLUMN_BLOCK;
+		program_exec_block(prog, columns, start, n, stk, failed);
+		for(i = 0; i < n; i++)
+		{
+			results[start + i] = failed[i] ? 0 : stk[0][i];
+			statuses[start + i] = failed[i] ? INVALID_EXPR : OK;
+		}
+	}
+
+	free(stk);
+}
+
+void run_program_columns_checked(const program* prog, const int32_t* const* columns, size_t rows, int64_t* results, unsigned char* statuses)
+{
+	int64_t local[EVAL_STACK_SIZE];
+	int64_t* stk = local;
+	size_t row;
+
+	if(prog->max_depth + prog->num_slots > EVAL_STACK_SIZE)
+	{
+		stk = malloc((prog->max_depth + prog->num_slots) * sizeof(int64_t));
+		if(stk == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	for(row = 0; row < rows; row++)
+	{
+		results[row] = 0;
+		statuses[row] = program_exec_checked(prog, stk, columns, row, &results[row]);
+	}
+
+	if(stk != local)
+		free(stk);
+}
+
+void program_free(program* prog)
+{
+	free(prog->code);
+	free(prog);
+}
@@ -0,0 +1,181 @@
+/********************************************************************************
+ * bytecode.h
+ *
+ * Computer Science 3357a
+ * Expression Bytecode
+ *
+ * Author: Duncan Cai
+ *
+ * Compiled form of an expression: a postfix program for a stack machine
+*******************************************************************************/
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//Instructions; OP_PUSH is followed by the operand it pushes, OP_PUSH_WIDE
+//by the high and then the low half of a 64-bit one, OP_PUSH_BIG by a count
+//of limbs and then the limbs of a longer one, least significant first, and
+//OP_LOAD by the index of the variable whose value it pushes. OP_SAVE is
+//followed by a slot, which it copies the top of the stack to, leaving it
+//there, and OP_RECALL by a slot whose value it pushes.
+#define OP_PUSH	0
+#define OP_ADD	1
+#define OP_SUB	2
+#define OP_MUL	3
+#define OP_DIV	4
+#define OP_NEG	5
+#define OP_LOAD	6
+#define OP_PUSH_WIDE	7	// Only in checked or exact arithmetic
+#define OP_PUSH_BIG		8	// Only in exact arithmetic
+#define OP_SAVE		9	// Only in programs rebuilt by dag_optimize
+#define OP_RECALL	10
+
+//Arithmetic programs are run with
+#define ARITH_WRAP		0	// 32-bit integers that wrap around on overflow
+#define ARITH_CHECKED	1	// 64-bit integers; overflow is an error
+#define ARITH_BIG		2	// Checked, then exact (see bignum.h) where 64 bits overflow
+
+#define EVAL_STACK_SIZE 64	// Operand stack depth evaluated without allocating
+#define PROGRAM_MAX_VARS 16	// Most distinct variables in one expression
+#define VAR_NAME_SIZE 32	// Longest variable name, terminator included
+#define COLUMN_BLOCK 256	// Rows run_program_columns evaluates per instruction
+
+//A compiled expression
+typedef struct
+{
+	int32_t * code;		// Instructions and inline operands, in postfix order
+	size_t len;			// Words of code in use
+	size_t capacity;	// Words of code allocated
+	size_t max_depth;	// Deepest the operand stack gets while running
+	size_t num_slots;	// Slots OP_SAVE and OP_RECALL use
+	int num_vars;		// Variables the program loads
+	char vars[PROGRAM_MAX_VARS][VAR_NAME_SIZE];	// Their names, by index
+} program;
+
+/*
+ * Initialize an empty program dynamically
+ * Must be freed with program_free
+ *
+ * return: a pointer to a new program
+ */
+program* program_init();
+
+/*
+ * Removes every instruction but keeps the storage for reuse
+ *
+ * prog: pointer to program
+ */
+void program_clear(program* prog);
+
+/*
+ * Appends a word (an instruction or an operand) to the program
+ *
+ * prog: pointer to program
+ * word: the word to append
+ */
+void program_emit(program* prog, int32_t word);
+
+/*
+ * Returns the index of a variable, adding it to the program if it is new
+ *
+ * prog: pointer to program
+ * name: the name, not necessarily terminated
+ * len: length of the name
+ *
+ * return: the index, or -1 if the name is too long or the program already
+ * has PROGRAM_MAX_VARS variables
+ */
+int program_variable(program* prog, const char* name, size_t len);
+
+/*
+ * Appends an instruction that pushes a literal in checked or exact
+ * arithmetic, wide if it does not fit in 32 bits, and in exact arithmetic
+ * big if it does not fit in 64
+ *
+ * prog: pointer to program
+ * digits: the literal's digits, not necessarily terminated
+ * len: number of digits
+ *
+ * return: false if the literal does not fit in 64 bits in checked arithmetic
+ */
+bool program_emit_literal(program* prog, const char* digits, size_t len);
+
+/*
+ * Chooses the arithmetic programs are run with, for every thread. It is
+ * meant to be set once at startup: results cached or compiled under one
+ * are not valid under another.
+ *
+ * mode: ARITH_WRAP (the default), ARITH_CHECKED or ARITH_BIG
+ */
+void program_set_arith(int mode);
+
+/*
+ * Returns the arithmetic programs are run with
+ */
+int program_arith();
+
+/*
+ * Checks a program that did not come from compile_expr, such as one sent
+ * by a client, and works out its max_depth
+ *
+ * prog: pointer to program
+ *
+ * return: OK if every instruction is known, has its operands, and the
+ * program leaves exactly one value; INVALID_EXPR otherwise. Such a program
+ * has no variable names, so OP_LOAD is rejected, OP_PUSH_WIDE is only
+ * accepted in checked or exact arithmetic, and OP_PUSH_BIG only in exact.
+ * OP_SAVE and OP_RECALL are rejected, as a slot may be recalled unsaved.
+ */
+int program_verify(program* prog);
+
+/*
+ * Runs the program on a stack machine, in the arithmetic chosen by
+ * program_set_arith. Each has its own loop, so wrapping arithmetic pays
+ * nothing for the checks.
+ *
+ * prog: a program produced by compile_expr
+ * result: a pointer to the result
+ *
+ * return: OK, or INVALID_EXPR if it divides by zero or has variables,
+ * which only run_program_columns can bind. In checked arithmetic,
+ * OVERFLOW if a value does not fit in 64 bits before anything divides by
+ * zero; dividing by zero after an overflow is also OVERFLOW, as the divisor
+ * may only have wrapped to zero. Exact arithmetic runs as checked, and
+ * leaves run_program_big to decide on an OVERFLOW.
+ */
+int run_program(const program* prog, int64_t* result);
+
+/*
+ * Runs the program once for each row of the given variable bindings.
+ * Each instruction is applied to COLUMN_BLOCK rows at a time, in loops
+ * the compiler vectorizes, so the cost of decoding it is shared by the
+ * whole block.
+ *
+ * prog: a program produced by compile_expr
+ * columns: for each variable of the program, by index, its value in each row
+ * rows: number of rows
+ * results: set to the result of each row, or 0 where the row failed
+ * statuses: set to OK for each row, or INVALID_EXPR where it divides by zero
+ */
+void run_program_columns(const program* prog, const int32_t* const* columns, size_t rows, int32_t* results, unsigned char* statuses);
+
+/*
+ * Like run_program_columns in checked arithmetic, one row at a time
+ *
+ * statuses: set to OK for each row, or the status run_program would give
+ * the row
+ */
+void run_program_columns_checked(const program* prog, const int32_t* const* columns, size_t rows, int64_t* results, unsigned char* statuses);
+
+/*
+ * Frees memory allocated to the program
+ *
+ * prog: pointer to program
+ */
+void program_free(program* prog);
+
+#endif
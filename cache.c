@@ -0,0 +1,302 @@
+/********************************************************************************
+ * cache.c
+ *
+ * Computer Science 3357a
+ * Expression Cache
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the expression cache. Keys are hashed once; the hash
+ * picks a shard, and each shard has its own lock, hash chains and
+ * recency list.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "parser.h"
+
+#define CACHE_LINE 64
+
+//A cached outcome
+struct cache_entry
+{
+	struct cache_entry * chain;		// Next entry in the same hash bucket
+	struct cache_entry * prev;		// Towards the most recently used entry
+	struct cache_entry * next;		// Towards the entry evicted next
+	uint64_t hash;
+	int status_code;
+	int64_t result;
+	size_t len;
+	char key[];
+};
+
+//An independently locked part of the cache
+struct cache_shard
+{
+	pthread_mutex_t lock;
+	struct cache_entry ** buckets;
+	size_t num_buckets;				// A power of two
+	struct cache_entry * head;		// Most recently used (or inserted)
+	struct cache_entry * tail;		// Next to be evicted
+	size_t entries;
+	size_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct cache_shard * shards = NULL;
+static size_t num_shards = 0;		// A power of two
+static int eviction_policy = CACHE_LRU;
+
+/*
+ * Returns true for the characters of numbers and variable names
+ */
+static bool is_word(char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+/*
+ * Copies the expression without whitespace, keeping one space only where
+ * it separates two numbers or names, so every spelling of an expression
+ * shares a key
+ *
+ * return: the key length, or 0 if the key would not fit
+ */
+static size_t cache_normalize(const char * expr, char * key)
+{
+	size_t len = 0;
+	bool space = false;
+
+	for(; *expr != '\0'; expr++)
+	{
+		if(*expr == ' ' || *expr == '\n' || *expr == '\r')
+		{
+			space = true;
+			continue;
+		}
+		if(len + 2 > CACHE_MAX_KEY)
+			return 0;
+		if(space && len > 0 && is_word(key[len - 1]) && is_word(*expr))
+			key[len++] = ' ';
+		space = false;
+		key[len++] = *expr;
+	}
+	return len;
+}
+
+/*
+ * FNV-1a hash of the key
+ */
+static uint64_t cache_hash(const char * key, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static size_t next_pow2(size_t n)
+{
+	size_t p = 1;
+	while(p < n)
+		p <<= 1;
+	return p;
+}
+
+/*
+ * Unlinks an entry from the recency list of its shard
+ */
+static void list_remove(struct cache_shard * shard, struct cache_entry * entry)
+{
+	if(entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		shard->head = entry->next;
+	if(entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		shard->tail = entry->prev;
+}
+
+/*
+ * Links an entry at the most recently used end of the list
+ */
+static void list_push_front(struct cache_shard * shard, struct cache_entry * entry)
+{
+	entry->prev = NULL;
+	entry->next = shard->head;
+	if(shard->head != NULL)
+		shard->head->prev = entry;
+	else
+		shard->tail = entry;
+	shard->head = entry;
+}
+
+/*
+ * Returns the link that points at the entry with this key, or at the end
+ * of its bucket's chain if there is none
+ */
+static struct cache_entry ** shard_find(struct cache_shard * shard, const char * key, size_t len, uint64_t hash)
+{
+	struct cache_entry ** link = &shard->buckets[(hash >> 6) & (shard->num_buckets - 1)];
+
+	while(*link != NULL)
+	{
+		if((*link)->hash == hash && (*link)->len == len && memcmp((*link)->key, key, len) == 0)
+			break;
+		link = &(*link)->chain;
+	}
+	return link;
+}
+
+/*
+ * Removes the entry at the tail of the list from the shard and frees it
+ */
+static void shard_evict(struct cache_shard * shard)
+{
+	struct cache_entry * victim = shard->tail;
+	struct cache_entry ** link = shard_find(shard, victim->key, victim->len, victim->hash);
+
+	*link = victim->chain;
+	list_remove(shard, victim);
+	free(victim);
+	shard->entries--;
+	shard->evictions++;
+}
+
+void cache_init(size_t capacity, int policy)
+{
+	size_t i, per_shard;
+
+	// Use fewer shards than entries so the capacity is honoured
+	num_shards = CACHE_MAX_SHARDS;
+	while(num_shards > 1 && num_shards > capacity)
+		num_shards >>= 1;
+	per_shard = (capacity + num_shards - 1) / num_shards;
+
+	shards = aligned_alloc(CACHE_LINE, num_shards * sizeof(struct cache_shard));
+	if(shards == NULL)
+	{
+		perror("Unable to allocate cache");
+		exit(EXIT_FAILURE);
+	}
+
+	for(i = 0; i < num_shards; i++)
+	{
+		pthread_mutex_init(&shards[i].lock, NULL);
+		shards[i].num_buckets = next_pow2(per_shard);
+		shards[i].buckets = calloc(shards[i].num_buckets, sizeof(struct cache_entry *));
+		if(shards[i].buckets == NULL)
+		{
+			perror("Unable to allocate cache");
+			exit(EXIT_FAILURE);
+		}
+		shards[i].head = NULL;
+		shards[i].tail = NULL;
+		shards[i].entries = 0;
+		shards[i].capacity = per_shard;
+		shards[i].hits = 0;
+		shards[i].misses = 0;
+		shards[i].evictions = 0;
+	}
+	eviction_policy = policy;
+}
+
+bool cache_enabled()
+{
+	return shards != NULL;
+}
+
+int cached_parse_expr(const char * expr, int64_t * result)
+{
+	char key[CACHE_MAX_KEY];
+	struct cache_shard * shard;
+	struct cache_entry ** link;
+	struct cache_entry * entry;
+	size_t len = cache_normalize(expr, key);
+	uint64_t hash;
+	int status_code;
+
+	// Keys that are too long (or empty) are not worth keeping
+	if(len == 0)
+		return parse_expr(expr, result);
+
+	hash = cache_hash(key, len);
+	shard = &shards[hash & (num_shards - 1)];
+
+	pthread_mutex_lock(&shard->lock);
+	entry = *shard_find(shard, key, len, hash);
+	if(entry != NULL)
+	{
+		shard->hits++;
+		if(eviction_policy == CACHE_LRU && shard->head != entry)
+		{
+			list_remove(shard, entry);
+			list_push_front(shard, entry);
+		}
+		status_code = entry->status_code;
+		*result = entry->result;
+		pthread_mutex_unlock(&shard->lock);
+		return status_code;
+	}
+	shard->misses++;
+	pthread_mutex_unlock(&shard->lock);
+
+	// Parse without holding the lock
+	status_code = parse_expr(expr, result);
+
+	entry = malloc(sizeof(struct cache_entry) + len);
+	if(entry == NULL)
+		return status_code;
+	entry->hash = hash;
+	entry->status_code = status_code;
+	entry->result = status_code == OK ? *result : 0;
+	entry->len = len;
+	memcpy(entry->key, key, len);
+
+	pthread_mutex_lock(&shard->lock);
+	link = shard_find(shard, key, len, hash);
+	// Another thread may have inserted the same expression meanwhile
+	if(*link != NULL)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		free(entry);
+		return status_code;
+	}
+	entry->chain = NULL;
+	*link = entry;
+	list_push_front(shard, entry);
+	if(++shard->entries > shard->capacity)
+		shard_evict(shard);
+	pthread_mutex_unlock(&shard->lock);
+
+	return status_code;
+}
+
+void cache_get_stats(struct cache_stats * stats)
+{
+	size_t i;
+
+	memset(stats, 0, sizeof(struct cache_stats));
+	for(i = 0; i < num_shards; i++)
+	{
+		pthread_mutex_lock(&shards[i].lock);
+		stats->hits += shards[i].hits;
+		stats->misses += shards[i].misses;
+		stats->evictions += shards[i].evictions;
+		stats->entries += shards[i].entries;
+		stats->capacity += shards[i].capacity;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
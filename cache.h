@@ -0,0 +1,68 @@
+/********************************************************************************
+ * cache.h
+ *
+ * Computer Science 3357a
+ * Expression Cache
+ *
+ * Author: Duncan Cai
+ *
+ * Bounded cache of expression outcomes, sharded so that worker threads
+ * rarely contend on the same lock
+*******************************************************************************/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LRU 0			// Evict the least recently used entry
+#define CACHE_FIFO 1		// Evict the oldest entry; hits do not reorder
+
+#define CACHE_MAX_SHARDS 64
+#define CACHE_MAX_KEY 256	// Longer normalized expressions are not cached
+
+//Cache counters, summed over every shard
+struct cache_stats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	size_t capacity;
+};
+
+/*
+ * Creates the cache; must be called before any thread uses it
+ *
+ * capacity: maximum number of entries
+ * policy: CACHE_LRU or CACHE_FIFO
+ */
+void cache_init(size_t capacity, int policy);
+
+/*
+ * Returns true if cache_init was called
+ */
+bool cache_enabled();
+
+/*
+ * Parses the given expression like parse_expr, but answers from the cache
+ * when the same expression (ignoring whitespace that does not separate
+ * two numbers) was seen before. Error statuses are cached too.
+ *
+ * expr: the expression to be parsed
+ * result: a pointer to the result variable
+ *
+ * return: status code as described for parse_expr
+ */
+int cached_parse_expr(const char * expr, int64_t * result);
+
+/*
+ * Reads the counters of the cache
+ *
+ * stats: filled with the counters
+ */
+void cache_get_stats(struct cache_stats * stats);
+
+#endif
@@ -1,13 +1,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
 #include <getopt.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <arpa/inet.h>
+
+#include "loadgen.h"
 
 #define MAX_RESPONSE	50
+#define BINARY_HEADER	5		// Payload length (network order) and type
+#define BINARY_RESPONSE	9		// Status byte and 64-bit result (network order)
+#define BINARY_EXPR	1
+#define BINARY_COLUMNS	3
+#define COLUMNS_HEADER	7		// Rows, columns and expression length
+#define MAX_COLUMNS	255
+#define BINARY_SWITCH	"BINARY\r\n"	// Sent to switch the connection to binary frames
+#define BINARY_GREETING	"Protocol: binary\r\n"
+
+// Names of the status codes a binary response may carry
+static const char * status_names[] =
+{
+  "unknown", "ok", "mismatch", "invalid-expr", "max-length-exceeded", "malformed-req", "overloaded", "overflow"
+};
 
 struct addrinfo* get_sockaddr(const char* hostname, const char* port)
 {
@@ -68,13 +88,371 @@ int open_connection(struct addrinfo* addr_list)
 
 }
 
+/*
+ * Sends every byte of the buffer
+ */
+void send_all(int sockfd, const char * buf, size_t len)
+{
+  ssize_t bytes_sent;
+
+  while (len > 0)
+  {
+    bytes_sent = send(sockfd, buf, len, 0);
+    if (bytes_sent == -1)
+    {
+      perror("Unable to send");
+      exit(EXIT_FAILURE);
+    }
+    buf += bytes_sent;
+    len -= bytes_sent;
+  }
+}
+
+/*
+ * Returns whether more of a text response is to come: a successful one
+ * ends with the line of its result
+ *
+ * response: what has been received so far, terminated
+ */
+int response_pending(const char * response)
+{
+  const char * end = strstr(response, "\r\n");
+
+  if (end == NULL)
+    return 1;
+  if (strncmp(response, "Status: ok\r\n", 12) == 0)
+    return strstr(end + 2, "\r\n") == NULL;
+  return 0;
+}
+
+/*
+ * Sends every non-empty line of the file as one batch request and prints
+ * the server's response block
+ *
+ * sockfd: connection to the server
+ * path: file with one expression per line
+ */
+void run_batch(int sockfd, const char * path)
+{
+  FILE * file = fopen(path, "r");
+  char * line = NULL;
+  size_t line_size = 0;
+  ssize_t line_len;
+  char * body = NULL;		// The expressions, each ending with \r\n
+  size_t body_len = 0, body_cap = 0;
+  size_t count = 0;
+  char header[32];
+  char buf[4096];
+  ssize_t bytes_read;
+
+  if (file == NULL)
+  {
+    perror("Unable to open batch file");
+    exit(EXIT_FAILURE);
+  }
+
+  while ((line_len = getline(&line, &line_size, file)) != -1)
+  {
+    while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+      line_len--;
+    if (line_len == 0)
+      continue;
+
+    if (body_len + line_len + 2 > body_cap)
+    {
+      body_cap = (body_len + line_len + 2) * 2;
+      body = realloc(body, body_cap);
+      if (body == NULL)
+      {
+        perror("Unable to allocate batch");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memcpy(body + body_len, line, line_len);
+    memcpy(body + body_len + line_len, "\r\n", 2);
+    body_len += line_len + 2;
+    count++;
+  }
+  free(line);
+  fclose(file);
+
+  if (count == 0)
+  {
+    printf("The batch file has no expressions.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Batch request: %zu expressions\n", count);
+  sprintf(header, "BATCH %zu\r\n", count);
+  send_all(sockfd, header, strlen(header));
+  send_all(sockfd, body, body_len);
+  free(body);
+
+  // Nothing more to send; the server closes once the batch is answered
+  shutdown(sockfd, SHUT_WR);
+
+  while ((bytes_read = recv(sockfd, buf, sizeof(buf), 0)) > 0)
+    fwrite(buf, 1, bytes_read, stdout);
+  if (bytes_read == -1)
+  {
+    perror("Unable to read");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Switches the connection to binary frames, sends the expression as one
+ * frame and prints the decoded response
+ *
+ * sockfd: connection to the server
+ * expr: the expression
+ */
+void run_binary(int sockfd, const char * expr)
+{
+  size_t len = strlen(expr);
+  size_t prefix = strlen(BINARY_SWITCH);
+  size_t want = strlen(BINARY_GREETING) + BINARY_RESPONSE;
+  char * request = malloc(prefix + BINARY_HEADER + len);
+  char response[64];
+  size_t received = 0;
+  ssize_t bytes_read;
+  uint32_t net_len = htonl(len);
+  uint64_t result = 0;
+  unsigned char status;
+  int i;
+
+  if (request == NULL)
+  {
+    perror("Unable to allocate request");
+    exit(EXIT_FAILURE);
+  }
+
+  // The greeting and the frame go out together
+  memcpy(request, BINARY_SWITCH, prefix);
+  memcpy(request + prefix, &net_len, sizeof(net_len));
+  request[prefix + 4] = BINARY_EXPR;
+  memcpy(request + prefix + BINARY_HEADER, expr, len);
+  printf("Request: %s (binary)\n", expr);
+  send_all(sockfd, request, prefix + BINARY_HEADER + len);
+  free(request);
+
+  while (received < want && (bytes_read = recv(sockfd, response + received, want - received, 0)) > 0)
+    received += bytes_read;
+  if (received < want || memcmp(response, BINARY_GREETING, strlen(BINARY_GREETING)) != 0)
+  {
+    printf("The server did not answer in binary.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  status = response[strlen(BINARY_GREETING)];
+  for (i = 1; i <= 8; i++)
+    result = result << 8 | (unsigned char)response[strlen(BINARY_GREETING) + i];
+
+  printf("Status Code: %s\n", status < sizeof(status_names) / sizeof(status_names[0]) ? status_names[status] : "unknown");
+  if (status == 1)
+    printf("Result: %lld\n", (long long)result);
+}
+
+/*
+ * Receives exactly len bytes
+ *
+ * return: 0 if the connection closed first
+ */
+int recv_all(int sockfd, char * buf, size_t len)
+{
+  ssize_t bytes_read;
+
+  while (len > 0)
+  {
+    bytes_read = recv(sockfd, buf, len, 0);
+    if (bytes_read <= 0)
+      return 0;
+    buf += bytes_read;
+    len -= bytes_read;
+  }
+  return 1;
+}
+
+/*
+ * Appends a 32-bit value in network order to the request
+ */
+static char * put_word(char * out, uint32_t value)
+{
+  value = htonl(value);
+  memcpy(out, &value, sizeof(value));
+  return out + sizeof(value);
+}
+
+/*
+ * Sends the expression with the columns of a CSV file as one binary
+ * request and prints the result of each row. The first line of the file
+ * names the columns; each line after it holds a row of integer values.
+ *
+ * sockfd: connection to the server
+ * expr: the expression
+ * path: the CSV file
+ */
+void run_columns(int sockfd, const char * expr, const char * path)
+{
+  FILE * file = fopen(path, "r");
+  char * line = NULL;
+  size_t line_size = 0;
+  char * names[MAX_COLUMNS];
+  int32_t * values = NULL;    // Row by row, as read
+  size_t rows = 0, cap = 0;
+  int count = 0, i;
+  char * field, * end, * save;
+  size_t expr_len = strlen(expr), len, r;
+  char * request, * out;
+  char header[BINARY_RESPONSE];
+  char * response;
+  uint16_t net_expr_len;
+  uint64_t result;
+  long value;
+
+  if (file == NULL)
+  {
+    perror("Unable to open columns file");
+    exit(EXIT_FAILURE);
+  }
+
+  while (getline(&line, &line_size, file) != -1)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0')
+      continue;
+
+    // The header line names the columns
+    if (count == 0)
+    {
+      for (field = strtok_r(line, ",", &save); field != NULL; field = strtok_r(NULL, ",", &save))
+      {
+        if (count == MAX_COLUMNS || strlen(field) > 255 || (names[count] = strdup(field)) == NULL)
+        {
+          printf("Too many columns or a name too long.\n");
+          exit(EXIT_FAILURE);
+        }
+        count++;
+      }
+      continue;
+    }
+
+    if ((rows + 1) * count > cap)
+    {
+      cap = (rows + 1) * count * 2;
+      values = realloc(values, cap * sizeof(int32_t));
+      if (values == NULL)
+      {
+        perror("Unable to allocate columns");
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (i = 0, field = strtok_r(line, ",", &save); field != NULL && i < count; field = strtok_r(NULL, ",", &save), i++)
+    {
+      errno = 0;
+      value = strtol(field, &end, 10);
+      if (end == field || *end != '\0')
+        break;
+      // Columns are sent as 32-bit words, which must not wrap
+      if (errno == ERANGE || value < INT32_MIN || value > INT32_MAX)
+      {
+        printf("Row %zu: %s does not fit in 32 bits.\n", rows + 1, field);
+        exit(EXIT_FAILURE);
+      }
+      values[rows * count + i] = value;
+    }
+    if (i != count || field != NULL)
+    {
+      printf("Row %zu does not have a number for each column.\n", rows + 1);
+      exit(EXIT_FAILURE);
+    }
+    rows++;
+  }
+  free(line);
+  fclose(file);
+
+  if (count == 0 || expr_len > 65535)
+  {
+    printf("The columns file has no header, or the expression is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // The request holds the columns one after another
+  len = COLUMNS_HEADER + expr_len;
+  for (i = 0; i < count; i++)
+    len += 1 + strlen(names[i]) + rows * sizeof(int32_t);
+  request = malloc(strlen(BINARY_SWITCH) + BINARY_HEADER + len);
+  if (request == NULL)
+  {
+    perror("Unable to allocate request");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(request, BINARY_SWITCH, strlen(BINARY_SWITCH));
+  out = put_word(request + strlen(BINARY_SWITCH), len);
+  *out++ = BINARY_COLUMNS;
+  out = put_word(out, rows);
+  *out++ = count;
+  net_expr_len = htons(expr_len);
+  memcpy(out, &net_expr_len, sizeof(net_expr_len));
+  out += sizeof(net_expr_len);
+  memcpy(out, expr, expr_len);
+  out += expr_len;
+  for (i = 0; i < count; i++)
+  {
+    *out++ = strlen(names[i]);
+    memcpy(out, names[i], strlen(names[i]));
+    out += strlen(names[i]);
+    for (r = 0; r < rows; r++)
+      out = put_word(out, values[r * count + i]);
+    free(names[i]);
+  }
+  free(values);
+
+  printf("Request: %s over %zu rows (binary)\n", expr, rows);
+  send_all(sockfd, request, out - request);
+  free(request);
+
+  if (!recv_all(sockfd, header, strlen(BINARY_GREETING)) || memcmp(header, BINARY_GREETING, strlen(BINARY_GREETING)) != 0
+      || !recv_all(sockfd, header, BINARY_RESPONSE))
+  {
+    printf("The server did not answer in binary.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("Status Code: %s\n", (unsigned char)header[0] < sizeof(status_names) / sizeof(status_names[0]) ? status_names[(unsigned char)header[0]] : "unknown");
+  if (header[0] != 1)
+    return;
+
+  // A result per row, then a status per row
+  response = malloc(rows * 9 + 1);
+  if (response == NULL || !recv_all(sockfd, response, rows * 9))
+  {
+    printf("The server did not send every row.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (r = 0; r < rows; r++)
+  {
+    for (i = 0, result = 0; i < 8; i++)
+      result = result << 8 | (unsigned char)response[r * 8 + i];
+    if (response[rows * 8 + r] == 1)
+      printf("Row %zu: %lld\n", r + 1, (long long)result);
+    else
+      printf("Row %zu: %s\n", r + 1, (unsigned char)response[rows * 8 + r] < sizeof(status_names) / sizeof(status_names[0]) ? status_names[(unsigned char)response[rows * 8 + r]] : "unknown");
+  }
+  free(response);
+}
+
 int main(int argc, char** argv)
 {
   int c;
   int bytes_read;      // Number of bytes read from the server
-  char response[MAX_RESPONSE];   // Buffer to store received message
-  char *server, *port, *expr; //Stores the arguments
-  server = port = expr = NULL;
+  char *response;      // Buffer to store received message
+  size_t received = 0, response_size = MAX_RESPONSE;
+  char *server, *port, *expr, *batch, *columns; //Stores the arguments
+  server = port = expr = batch = columns = NULL;
+  int bench = 0;
+  int binary = 0;
+  struct loadgen_config load = { 1, 0, 10, NULL, false, NULL, 1 };
 
   //Parse the command line arguments
   while(1)
@@ -84,11 +462,22 @@ int main(int argc, char** argv)
       {"server", required_argument, 0, 's'},
       {"port", required_argument, 0, 'p'},
       {"expr", required_argument, 0, 'e'},
+      {"batch", required_argument, 0, 'b'},
+      {"bench", no_argument, 0, 'B'},
+      {"connections", required_argument, 0, 'n'},
+      {"rate", required_argument, 0, 'r'},
+      {"duration", required_argument, 0, 't'},
+      {"expr-file", required_argument, 0, 'f'},
+      {"keep-alive", no_argument, 0, 'k'},
+      {"replay", required_argument, 0, 'R'},
+      {"speed", required_argument, 0, 'S'},
+      {"binary", no_argument, 0, 'y'},
+      {"columns", required_argument, 0, 'c'},
       {0, 0, 0, 0}
     };
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "s:p:e:", long_options, &option_index);
+    c = getopt_long(argc, argv, "s:p:e:b:n:r:t:f:k", long_options, &option_index);
     if(c == -1)
       break;
 
@@ -103,15 +492,60 @@ int main(int argc, char** argv)
       case 'e':
         expr = optarg;
         break;
+      case 'b':
+        batch = optarg;
+        break;
+      case 'B':
+        bench = 1;
+        break;
+      case 'n':
+        load.connections = atoi(optarg);
+        break;
+      case 'r':
+        load.rate = atof(optarg);
+        break;
+      case 't':
+        load.duration = atof(optarg);
+        break;
+      case 'f':
+        load.expr_file = optarg;
+        break;
+      case 'k':
+        load.keep_alive = true;
+        break;
+      case 'R':
+        bench = 1;
+        load.replay_file = optarg;
+        break;
+      case 'S':
+        load.speed = atof(optarg);
+        break;
+      case 'y':
+        binary = 1;
+        break;
+      case 'c':
+        columns = optarg;
+        break;
       case '?':
         exit(EXIT_FAILURE);
         break;
     }
   }
 
-  if(server == NULL || port == NULL || expr == NULL)
+  if(bench)
   {
-    printf("You must specify a server, port and expression.\n");
+    if(server == NULL || port == NULL || load.connections < 1 || load.rate < 0 || load.speed < 0
+       || (load.replay_file == NULL && load.duration <= 0))
+    {
+      printf("You must specify a server, port, at least one connection and a positive duration.\n");
+      exit(EXIT_FAILURE);
+    }
+    exit(loadgen_run(get_sockaddr(server, port), &load));
+  }
+
+  if(server == NULL || port == NULL || (expr == NULL && batch == NULL) || (columns != NULL && expr == NULL))
+  {
+    printf("You must specify a server, port and expression (or batch file).\n");
     exit(EXIT_FAILURE);
   }
 
@@ -119,6 +553,27 @@ int main(int argc, char** argv)
   struct addrinfo* results = get_sockaddr(server, port);
   int sockfd = open_connection(results);
 
+  if(batch != NULL)
+  {
+    run_batch(sockfd, batch);
+    close(sockfd);
+    exit(EXIT_SUCCESS);
+  }
+
+  if(columns != NULL)
+  {
+    run_columns(sockfd, expr, columns);
+    close(sockfd);
+    exit(EXIT_SUCCESS);
+  }
+
+  if(binary)
+  {
+    run_binary(sockfd, expr);
+    close(sockfd);
+    exit(EXIT_SUCCESS);
+  }
+
 	// Create the request string	
 	// Allocating 3 extra spaces for \r\n\0
 	char *request = malloc(strlen(expr) + 3);
@@ -134,8 +589,20 @@ int main(int argc, char** argv)
   }
 	free(request);
 
-  // Read the reponse
-  bytes_read = recv(sockfd, response, sizeof(response), 0);
+  // Read the reponse; an exact result may take more than one read
+  response = malloc(response_size + 1);
+  while ((bytes_read = recv(sockfd, response + received, response_size - received, 0)) > 0)
+  {
+    received += bytes_read;
+    response[received] = '\0';
+    if (!response_pending(response))
+      break;
+    if (received == response_size)
+    {
+      response_size *= 2;
+      response = realloc(response, response_size + 1);
+    }
+  }
   
   if (bytes_read == -1)
   {
@@ -144,14 +611,15 @@ int main(int argc, char** argv)
   }
 
 	// Allocate 5 extra spaces for " Code" (plus 1 for \0)
-	char *output = malloc(bytes_read + 6);
-	response[bytes_read] = '\0';
+	char *output = malloc(received + 6);
+	response[received] = '\0';
 
 	// Construct and print the output string
 	strcpy(output, "Status Code");
 	strcat(output, &response[6]);
   printf("%s", output);
 	free(output);
+	free(response);
 
   // Close the connection
   close(sockfd);
@@ -1,21 +1,49 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
+#include <arpa/inet.h>
+
+#include "ctp.h"
+#include "reactor.h"
+#include "uring.h"
+#include "trace.h"
+#include "logger.h"
+#include "cache.h"
+#include "dag.h"
+#include "jit.h"
+#include "metrics.h"
+#include "iplimit.h"
+#include "admission.h"
+
+#define BACKLOG 25			// Default length of the listen queue
+#define ADMIN_TIMEOUT 1		// Seconds an admin client gets to send its request
+
+#define MODE_SERIAL 0
+#define MODE_EPOLL 1
+#define MODE_URING 2
+
+//A worker thread with its own listening socket and event loop
+struct worker
+{
+	pthread_t thread;
+	int cpu;			// CPU the worker is pinned to, or -1
+	const char * port;
+	int mode;
+};
 
-#include "parser.h"
-
-#define BACKLOG 25
-#define MAX_RESPONSE 50
-#define MAX_REQUEST 80
-
-#define MAX_LENGTH_EXCEEDED 4
-#define MALFORMED_REQ 5
+static int listen_backlog = BACKLOG;
 
 struct addrinfo* get_server_sockaddr(const char* port)
 {
@@ -40,7 +68,7 @@ struct addrinfo* get_server_sockaddr(const char* port)
   return results;
 }
 
-int bind_socket(struct addrinfo* addr_list)
+int bind_socket(struct addrinfo* addr_list, int reuse_port)
 {
   struct addrinfo* addr;
   int sockfd;
@@ -64,6 +92,14 @@ int bind_socket(struct addrinfo* addr_list)
       exit(EXIT_FAILURE);
     }
 
+    // Let several sockets bind the same port; the kernel balances
+    // incoming connections between them
+    if (reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(int)) == -1)
+    {
+      perror("Unable to set socket option");
+      exit(EXIT_FAILURE);
+    }
+
     // Try to bind the socket to the address/port
     if (bind(sockfd, addr->ai_addr, addr->ai_addrlen) == -1)
     {
@@ -100,7 +136,6 @@ int wait_for_connection(int sockfd)
 {
   struct sockaddr_in client_addr;            // Remote IP that is connecting to us
   int addr_len = sizeof(struct sockaddr_in); // Length of the remote IP structure
-  char ip_address[INET_ADDRSTRLEN];          // Buffer to store human-friendly IP address
   int connectionfd;                          // Socket file descriptor for the new connection
 
   // Wait for a new connection
@@ -113,111 +148,303 @@ int wait_for_connection(int sockfd)
     exit(EXIT_FAILURE);
   }
 
-  // Convert the connecting IP to a human-friendly form and print it
-  inet_ntop(client_addr.sin_family, &client_addr.sin_addr, ip_address, sizeof(ip_address));
-  syslog(LOG_INFO, "Request received from client %s", ip_address);
+  // Log the connecting IP; it is converted to a human-friendly form later
+  logger_client(client_addr.sin_addr.s_addr);
 
   // Return the socket file descriptor for the new connection
   return connectionfd;
 }
 
 /*
- * Converts a status code to a string representation
+ * Parses a size such as 4096, 64K or 2M
+ *
+ * str: the size as given on the command line
+ *
+ * return: the size in bytes, or 0 if it is not a valid size
+ */
+size_t parse_size(const char * str)
+{
+	char * end;
+	unsigned long long size = strtoull(str, &end, 10);
+
+	if(end == str)
+		return 0;
+	if(*end == 'k' || *end == 'K')
+		size <<= 10, end++;
+	else if(*end == 'm' || *end == 'M')
+		size <<= 20, end++;
+	return *end == '\0' ? size : 0;
+}
+
+/*
+ * Parses a duration in seconds such as 30 or 0.005
+ *
+ * str: the duration as given on the command line
+ * units: units per second to return it in
+ *
+ * return: the duration in those units (0 for none), or -1 if it is not valid
+ */
+long parse_seconds(const char * str, long units)
+{
+	char * end;
+	double seconds = strtod(str, &end);
+
+	if(end == str || *end != '\0' || seconds < 0 || seconds > 86400)
+		return -1;
+	return (long)(seconds * units + 0.5);
+}
+
+/*
+ * Creates a socket bound to the port and starts listening on it
  *
- * code: the status code
+ * port: the port number
+ * reuse_port: non-zero to share the port with other listening sockets
+ *
+ * return: the listening socket
+ */
+int open_listener(const char * port, int reuse_port)
+{
+  struct addrinfo* results = get_server_sockaddr(port);
+
+  // Create a listening socket
+  int sockfd = bind_socket(results, reuse_port);
+
+  // Start listening on the socket
+  if (listen(sockfd, listen_backlog) == -1)
+  {
+    perror("Unable to listen on socket");
+    exit(EXIT_FAILURE);
+  }
+
+	return sockfd;
+}
+
+/*
+ * Serves connections from the listening socket forever
  *
- * return: string representation of the status code
+ * sockfd: the listening socket
+ * mode: MODE_SERIAL, MODE_EPOLL or MODE_URING
  */
-char * status_code_to_str(int code)
+void serve(int sockfd, int mode)
 {
-	switch(code)
+	// Completion-based I/O, unless the kernel is too old for it
+	if(mode == MODE_URING)
 	{
-		case MALFORMED_REQ:
-			return "malformed-req";
-		case MAX_LENGTH_EXCEEDED:
-			return "max-length-exceeded";
-		case MISMATCH:
-			return "mismatch";
-		case INVALID_EXPR:
-			return "invalid-expr";
-		case OK:
-			return "ok";
-		default:
-			printf("Invalid status code.\n");
-			exit(EXIT_FAILURE);
+		uring_run(sockfd);
+		syslog(LOG_WARNING, "io_uring is not supported by this kernel, using epoll");
+		mode = MODE_EPOLL;
 	}
+
+	// Multiplex every connection on one thread
+	if(mode == MODE_EPOLL)
+		reactor_run(sockfd);
+
+  while (1)
+  {
+    // Wait for a connection and handle it
+    int connectionfd = wait_for_connection(sockfd);
+    if (!admission_open())
+    {
+      admission_refuse(connectionfd);
+      continue;
+    }
+    handle_connection(connectionfd);
+    admission_close();
+  }
 }
 
 /*
- * Reads the CTP request from the client and processes it
- * Sends a response to the client with the result
+ * Entry point of a worker thread: pins itself to its CPU, then serves
+ * from a listening socket of its own so nothing is shared between workers
  */
-void handle_connection(int connectionfd)
+void * worker_main(void * arg)
 {
-	int status_code = OK;
-  char request[MAX_REQUEST];		// Stores the request from client
-	char response[MAX_RESPONSE];	// Stores the response to client
-	int result;					// Stores the result of parsing
-  int bytes_read;
+	struct worker * w = arg;
+	cpu_set_t cpus;
 
-  // Read up to 80 bytes from the client
-  bytes_read = recv(connectionfd, request, sizeof(request), 0);  
+	if(w->cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(w->cpu, &cpus);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+			syslog(LOG_WARNING, "Unable to pin worker to CPU %d", w->cpu);
+	}
 
-  // If the data was read successfully
-  if (bytes_read > 0)
-  {
-		// If we read 80 bytes, must end on newline
-		// If we read 2 bytes, then expression is empty
-		if(bytes_read == MAX_REQUEST && request[MAX_REQUEST  - 1] != '\n')
-		{
-			status_code = MAX_LENGTH_EXCEEDED;
-		}
-		// Otherwise, must end with \r\n and be non-empty
-		else if(bytes_read == 2 || request[bytes_read - 1] != '\n' || request[bytes_read - 2] != '\r')
-		{
-			status_code = MALFORMED_REQ;
-		}
+	serve(open_listener(w->port, 1), w->mode);
+	return NULL;
+}
+
+/*
+ * Starts the worker threads, spreading them over the CPUs this process
+ * may run on, and waits for them
+ *
+ * num_workers: number of workers to start
+ * port: the port every worker listens on
+ * mode: how each worker serves its connections
+ */
+void run_workers(int num_workers, const char * port, int mode)
+{
+	struct worker * workers = calloc(num_workers, sizeof(struct worker));
+	cpu_set_t allowed;
+	int i, cpu = -1;
+
+	if(workers == NULL)
+	{
+		perror("Unable to allocate workers");
+		exit(EXIT_FAILURE);
+	}
 
-    // Add a terminating NULL character to indicate end of string
-    request[bytes_read - 2] = '\0';
-    syslog(LOG_INFO, "Expression was: %s", request);
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		CPU_ZERO(&allowed);
 
-		// If the status code is OK so far, parse the expression
-		if(status_code == OK)
+	for(i = 0; i < num_workers; i++)
+	{
+		// Round-robin over the allowed CPUs
+		if(CPU_COUNT(&allowed) > 0)
 		{
-			status_code = parse_expr(request, &result);
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while(!CPU_ISSET(cpu, &allowed));
 		}
+		workers[i].cpu = cpu;
+		workers[i].port = port;
+		workers[i].mode = mode;
 
-		// Parse succesful, construct OK response
-		if(status_code == OK)
-		{
-			sprintf(response, "Status: ok\r\nResult: %d\r\n", result);	
-			syslog(LOG_INFO, "Status: ok, result: %d", result);
-		// Parse error, construct error code response
-		}
-		else
+		if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
 		{
-			sprintf(response, "Status: %s\r\n", status_code_to_str(status_code));
-			syslog(LOG_INFO, "Status: %s", status_code_to_str(status_code));
+			perror("Unable to start worker");
+			exit(EXIT_FAILURE);
 		}
+	}
+
+	for(i = 0; i < num_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+	free(workers);
+}
+
+/*
+ * Logs the server's counters
+ */
+void log_stats()
+{
+	struct cache_stats stats;
+	struct dag_stats dag;
 
-		// Send response to client
-		if (send(connectionfd, response, strlen(response), 0) == -1)
+	if(cache_enabled())
+	{
+		cache_get_stats(&stats);
+		syslog(LOG_INFO, "Cache: %llu hits, %llu misses, %llu evictions, %zu of %zu entries used",
+			(unsigned long long)stats.hits, (unsigned long long)stats.misses,
+			(unsigned long long)stats.evictions, stats.entries, stats.capacity);
+	}
+	if(jit_enabled())
+		syslog(LOG_INFO, "JIT: %llu expressions compiled", (unsigned long long)jit_compiled());
+	if(dag_enabled())
+	{
+		dag_get_stats(&dag);
+		syslog(LOG_INFO, "DAG: %llu of %llu nodes eliminated in %llu programs",
+			(unsigned long long)dag.eliminated, (unsigned long long)dag.nodes, (unsigned long long)dag.programs);
+	}
+	syslog(LOG_INFO, "Log records dropped: %llu", (unsigned long long)logger_dropped());
+}
+
+/*
+ * Entry point of the thread that logs the counters on every SIGUSR1
+ */
+void * stats_main(void * arg)
+{
+	sigset_t * signals = arg;
+	int sig;
+
+	while(1)
+	{
+		if(sigwait(signals, &sig) == 0)
+			log_stats();
+	}
+	return NULL;
+}
+
+/*
+ * Blocks SIGUSR1 in this thread and every thread started after it, and
+ * starts a thread that waits for the signal to report the counters
+ */
+void start_stats_reporter()
+{
+	static sigset_t signals;
+	pthread_t thread;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if(pthread_create(&thread, NULL, stats_main, &signals) != 0)
+	{
+		perror("Unable to start stats reporter");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+}
+
+/*
+ * Entry point of the thread that answers every connection to the admin
+ * port with the metrics, as an HTTP response Prometheus can scrape
+ */
+void * admin_main(void * arg)
+{
+	int sockfd = *(int *)arg;
+	struct timeval timeout = { ADMIN_TIMEOUT, 0 };
+	char request[1024];
+	char header[128];
+	char * body;
+	size_t body_len;
+	FILE * out;
+	int connectionfd;
+
+	while(1)
+	{
+		connectionfd = accept(sockfd, NULL, NULL);
+		if(connectionfd == -1)
+			continue;
+
+		// Whatever was asked for, the metrics are the answer; the request
+		// is read only so closing does not reset the connection
+		setsockopt(connectionfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		recv(connectionfd, request, sizeof(request), 0);
+
+		out = open_memstream(&body, &body_len);
+		if(out != NULL)
 		{
-			perror("Unable to send to socket");
-			exit(EXIT_FAILURE);
+			metrics_format(out);
+			fclose(out);
+			sprintf(header, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+			send(connectionfd, header, strlen(header), MSG_NOSIGNAL);
+			send(connectionfd, body, body_len, MSG_NOSIGNAL);
+			free(body);
 		}
+		close(connectionfd);
+	}
+	return NULL;
+}
 
-  }
-  else if (bytes_read == -1)
-  {
-    // Otherwise, if the read failed,
-    perror("Unable to read from socket");
-    exit(EXIT_FAILURE);
-  }
+/*
+ * Turns metrics on and starts a thread serving them on the admin port
+ *
+ * port: the admin port number
+ */
+void start_admin_server(const char * port)
+{
+	static int sockfd;
+	pthread_t thread;
 
-  // Close the connection
-  close(connectionfd);
+	sockfd = open_listener(port, 0);
+	metrics_enabled = true;
+
+	if(pthread_create(&thread, NULL, admin_main, &sockfd) != 0)
+	{
+		perror("Unable to start admin server");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
 }
 
 int main(int argc, char** argv)
@@ -229,6 +456,18 @@ int main(int argc, char** argv)
   int c;
 	static int debug_flag = 0;
   char * port = NULL;	// Stores the port number
+	char * admin_port = NULL;	// Port metrics are served on, if any
+	char * capture_path = NULL;	// File requests are captured to, if any
+	int mode = -1;	// How connections are served
+	int num_workers = 0;	// Number of worker threads, 0 to serve from main
+	size_t cache_size = 0;	// Entries in the expression cache, 0 for no cache
+	int cache_policy = CACHE_LRU;
+	int max_per_ip = 0;	// Connections one client may hold, 0 for no limit
+	int max_inflight = 0;	// Connections open at once before new ones are refused
+	uint64_t max_queue_delay = 0;	// Nanoseconds requests may wait before being shed
+	long jit_threshold = 0;	// Evaluations before an expression is compiled, 0 for no JIT
+	long dag_threshold = 0;	// Words of code before a program is rebuilt as a DAG, 0 for never
+	long timeout;
 
   // Parse the command line arguments
   while(1)
@@ -237,11 +476,30 @@ int main(int argc, char** argv)
     {
       {"port", required_argument, 0, 'p'},
 			{"debug", no_argument, &debug_flag, 1},
+			{"mode", required_argument, 0, 'm'},
+			{"workers", required_argument, 0, 'w'},
+			{"keep-alive", no_argument, 0, 'k'},
+			{"max-request", required_argument, 0, 'r'},
+			{"cache-size", required_argument, 0, 'c'},
+			{"cache-policy", required_argument, 0, 'E'},
+			{"admin-port", required_argument, 0, 'A'},
+			{"capture", required_argument, 0, 'C'},
+			{"read-timeout", required_argument, 0, 'R'},
+			{"write-timeout", required_argument, 0, 'W'},
+			{"idle-timeout", required_argument, 0, 'I'},
+			{"max-conns-per-ip", required_argument, 0, 'L'},
+			{"backlog", required_argument, 0, 'b'},
+			{"max-inflight", required_argument, 0, 'F'},
+			{"max-queue-delay", required_argument, 0, 'Q'},
+			{"jit-threshold", required_argument, 0, 'J'},
+			{"dag-threshold", required_argument, 0, 'G'},
+			{"parser", required_argument, 0, 'P'},
+			{"arith", required_argument, 0, 'a'},
       {0, 0, 0, 0}
     };
     int option_index = 0;
 
-    c = getopt_long(argc, argv, "dp:", long_options, &option_index);
+    c = getopt_long(argc, argv, "dkp:m:w:r:c:", long_options, &option_index);
     if(c == -1)
       break;
 
@@ -253,6 +511,154 @@ int main(int argc, char** argv)
 			case 'd':
 				debug_flag = 1;
 				break;
+			case 'm':
+				if(strcmp(optarg, "serial") == 0)
+					mode = MODE_SERIAL;
+				else if(strcmp(optarg, "epoll") == 0)
+					mode = MODE_EPOLL;
+				else if(strcmp(optarg, "uring") == 0)
+					mode = MODE_URING;
+				else
+				{
+					printf("Mode must be serial, epoll or uring.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'k':
+				ctp_config.keep_alive = true;
+				break;
+			case 'r':
+				// Must hold at least one character and the \r\n
+				ctp_config.max_request = parse_size(optarg);
+				if(ctp_config.max_request < 3)
+				{
+					printf("Maximum request size must be at least 3 bytes.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'c':
+				// 0 turns the cache off only when written as such
+				cache_size = parse_size(optarg);
+				if(cache_size == 0 && strcmp(optarg, "0") != 0)
+				{
+					printf("Cache size must be a number of entries such as 4096 or 64K.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'E':
+				if(strcmp(optarg, "lru") == 0)
+					cache_policy = CACHE_LRU;
+				else if(strcmp(optarg, "fifo") == 0)
+					cache_policy = CACHE_FIFO;
+				else
+				{
+					printf("Cache policy must be lru or fifo.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'A':
+				admin_port = optarg;
+				break;
+			case 'C':
+				capture_path = optarg;
+				break;
+			case 'R':
+			case 'W':
+			case 'I':
+				timeout = parse_seconds(optarg, 1000);
+				if(timeout < 0)
+				{
+					printf("Timeouts must be a number of seconds, or 0 for none.\n");
+					exit(EXIT_FAILURE);
+				}
+				if(c == 'R')
+					ctp_config.read_timeout = timeout;
+				else if(c == 'W')
+					ctp_config.write_timeout = timeout;
+				else
+					ctp_config.idle_timeout = timeout;
+				break;
+			case 'b':
+				listen_backlog = atoi(optarg);
+				if(listen_backlog <= 0)
+				{
+					printf("Backlog must be positive.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'F':
+				max_inflight = atoi(optarg);
+				if(max_inflight < 0)
+				{
+					printf("Maximum in-flight connections must not be negative.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'Q':
+				timeout = parse_seconds(optarg, 1000000000);
+				if(timeout < 0)
+				{
+					printf("Maximum queue delay must be a number of seconds, or 0 for none.\n");
+					exit(EXIT_FAILURE);
+				}
+				max_queue_delay = timeout;
+				break;
+			case 'P':
+				if(strcmp(optarg, "shunting-yard") == 0)
+					parser_set_engine(PARSER_SHUNTING_YARD);
+				else if(strcmp(optarg, "climbing") == 0)
+					parser_set_engine(PARSER_CLIMBING);
+				else
+				{
+					printf("Parser must be shunting-yard or climbing.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'a':
+				if(strcmp(optarg, "wrap") == 0)
+					program_set_arith(ARITH_WRAP);
+				else if(strcmp(optarg, "checked") == 0)
+					program_set_arith(ARITH_CHECKED);
+				else if(strcmp(optarg, "big") == 0)
+					program_set_arith(ARITH_BIG);
+				else
+				{
+					printf("Arithmetic must be wrap, checked or big.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'J':
+				jit_threshold = atol(optarg);
+				if(jit_threshold < 0)
+				{
+					printf("JIT threshold must not be negative.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'G':
+				dag_threshold = atol(optarg);
+				if(dag_threshold < 0)
+				{
+					printf("DAG threshold must not be negative.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'L':
+				max_per_ip = atoi(optarg);
+				if(max_per_ip < 0)
+				{
+					printf("Connections per IP must not be negative.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'w':
+				num_workers = atoi(optarg);
+				if(num_workers <= 0)
+				{
+					printf("Number of workers must be positive.\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
       case '?':
         exit(EXIT_FAILURE);
         break;
@@ -261,7 +667,13 @@ int main(int argc, char** argv)
 
 	// Set debug mode
 	if(debug_flag)
+	{
 		setlogmask(LOG_UPTO(LOG_DEBUG));
+		trace_enabled = true;
+#ifdef CALC_NO_TRACE
+		syslog(LOG_WARNING, "Tracing was compiled out of this build");
+#endif
+	}
 
   // Argument passed should be port number
   if(port == NULL)
@@ -270,24 +682,40 @@ int main(int argc, char** argv)
     exit(EXIT_FAILURE);
   }
 
-  struct addrinfo* results = get_server_sockaddr(port);
+	if(cache_size > 0)
+		cache_init(cache_size, cache_policy);
 
-  // Create a listening socket
-  int sockfd = bind_socket(results);
+	iplimit_init(max_per_ip);
+	admission_init(max_inflight, max_queue_delay);
+	if(jit_threshold > 0)
+		jit_init(jit_threshold);
+	if(dag_threshold > 0)
+		dag_init(dag_threshold);
 
-  // Start listening on the socket
-  if (listen(sockfd, BACKLOG) == -1)
-  {
-    perror("Unable to listen on socket");
-    exit(EXIT_FAILURE);
-  }
+	// Counters are logged on SIGUSR1; start before any other thread
+	start_stats_reporter();
 
-  while (1)
-  {
-    // Wait for a connection and handle it
-    int connectionfd = wait_for_connection(sockfd);
-    handle_connection(connectionfd);
-  }
+	if(admin_port != NULL)
+		start_admin_server(admin_port);
+
+	if(capture_path != NULL && !logger_capture_open(capture_path))
+	{
+		perror("Unable to open capture file");
+		exit(EXIT_FAILURE);
+	}
+
+	// Request logs are flushed to syslog in the background from now on
+	logger_start();
+
+	// Workers run event loops unless told otherwise
+	if(mode == -1)
+		mode = num_workers > 0 ? MODE_EPOLL : MODE_SERIAL;
+
+	// Each worker gets its own SO_REUSEPORT listener and event loop
+	if(num_workers > 0)
+		run_workers(num_workers, port, mode);
+	else
+		serve(open_listener(port, 0), mode);
 
 	closelog();
   exit(EXIT_SUCCESS);
@@ -0,0 +1,244 @@
+/********************************************************************************
+ * climb.c
+ *
+ * Computer Science 3357a
+ * Precedence Climbing Parser
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the precedence climbing parser. Each character is
+ * classified by one table lookup. Operators are emitted as soon as their
+ * right operand is complete, so no operator stack is kept: recursion
+ * holds the operators of enclosing parentheses, and a flat expression
+ * needs only the pending additive and multiplicative operator.
+*******************************************************************************/
+
+#include "climb.h"
+
+//Character classes
+#define C_INVALID	0
+#define C_SPACE		1
+#define C_DIGIT		2
+#define C_ALPHA		3
+#define C_ADD		4
+#define C_SUB		5
+#define C_MUL		6
+#define C_DIV		7
+#define C_LEFT_P	8
+#define C_RIGHT_P	9
+#define C_END		10
+#define C_COUNT		11
+
+static const unsigned char char_class[256] =
+{
+	['\0'] = C_END,
+	[' '] = C_SPACE, ['\n'] = C_SPACE, ['\r'] = C_SPACE,
+	['0' ... '9'] = C_DIGIT,
+	['a' ... 'z'] = C_ALPHA, ['A' ... 'Z'] = C_ALPHA, ['_'] = C_ALPHA,
+	['+'] = C_ADD, ['-'] = C_SUB, ['*'] = C_MUL, ['/'] = C_DIV,
+	['('] = C_LEFT_P, [')'] = C_RIGHT_P,
+};
+
+// Precedence of each class as a binary operator, 0 if it is not one
+static const unsigned char binary_prec[C_COUNT] = { [C_ADD] = 1, [C_SUB] = 1, [C_MUL] = 2, [C_DIV] = 2 };
+static const unsigned char binary_op[C_COUNT] = { [C_ADD] = OP_ADD, [C_SUB] = OP_SUB, [C_MUL] = OP_MUL, [C_DIV] = OP_DIV };
+
+//State of one compilation
+struct climber
+{
+	const unsigned char * p;	// Next character
+	program * prog;
+	size_t depth;				// Operand stack depth when the program gets here
+	int nesting;				// Parentheses open
+	bool paren;					// The flat path stopped at a parenthesis
+};
+
+/*
+ * Skips whitespace and returns the class of the next character
+ */
+static inline int climb_next(struct climber * c)
+{
+	while(char_class[*c->p] == C_SPACE)
+		c->p++;
+	return char_class[*c->p];
+}
+
+/*
+ * Appends a word to the program, without a call unless it must grow
+ */
+static inline void climb_emit(struct climber * c, int32_t word)
+{
+	program * prog = c->prog;
+
+	if(prog->len < prog->capacity)
+		prog->code[prog->len++] = word;
+	else
+		program_emit(prog, word);
+}
+
+/*
+ * Emits an instruction that pushes a value
+ */
+static inline void climb_push(struct climber * c, int32_t op, int32_t operand)
+{
+	climb_emit(c, op);
+	climb_emit(c, operand);
+	if(++c->depth > c->prog->max_depth)
+		c->prog->max_depth = c->depth;
+}
+
+/*
+ * Emits a binary operator given by its class
+ */
+static inline void climb_binary(struct climber * c, int cls)
+{
+	climb_emit(c, binary_op[cls]);
+	c->depth--;
+}
+
+static bool climb_rest(struct climber * c, int min_prec);
+
+/*
+ * Compiles an operand: a number, a name or, if allowed, a parenthesized
+ * expression, after any number of unary minuses
+ *
+ * nested: false on the flat path, which stops at a parenthesis
+ */
+static bool climb_operand(struct climber * c, bool nested)
+{
+	const unsigned char * start;
+	int minus = 0;
+	int cls, index;
+	int value;
+
+	while((cls = climb_next(c)) == C_SUB)
+	{
+		minus++;
+		c->p++;
+	}
+
+	if(cls == C_DIGIT)
+	{
+		start = c->p;
+		value = 0;
+		while(char_class[*c->p] == C_DIGIT)
+			value = value * 10 + (*c->p++ - '0');
+		// Long literals in checked or exact arithmetic are the shunting yard's
+		if(c->p - start > 9 && program_arith() != ARITH_WRAP)
+			return false;
+		climb_push(c, OP_PUSH, value);
+	}
+	else if(cls == C_ALPHA)
+	{
+		start = c->p;
+		while(char_class[*c->p] == C_ALPHA || char_class[*c->p] == C_DIGIT)
+			c->p++;
+		if((index = program_variable(c->prog, (const char *)start, c->p - start)) < 0)
+			return false;
+		climb_push(c, OP_LOAD, index);
+	}
+	else if(cls == C_LEFT_P && nested)
+	{
+		if(++c->nesting > CLIMB_MAX_DEPTH)
+			return false;
+		c->p++;
+		if(!climb_operand(c, true) || !climb_rest(c, 1) || climb_next(c) != C_RIGHT_P)
+			return false;
+		c->p++;
+		c->nesting--;
+	}
+	else
+	{
+		c->paren = cls == C_LEFT_P;
+		return false;
+	}
+
+	// Unary minus binds tighter than any binary operator
+	for(; minus > 0; minus--)
+		climb_emit(c, OP_NEG);
+	return true;
+}
+
+/*
+ * Compiles every binary operator of at least the given precedence that
+ * follows an operand already compiled, with its right operand. The right
+ * operand is itself the left operand of any tighter operator after it.
+ */
+static bool climb_rest(struct climber * c, int min_prec)
+{
+	int cls;
+
+	// Classes that are not binary operators have precedence 0
+	while(binary_prec[cls = climb_next(c)] >= min_prec)
+	{
+		c->p++;
+		if(!climb_operand(c, true))
+			return false;
+		while(binary_prec[climb_next(c)] > binary_prec[cls])
+		{
+			if(!climb_rest(c, binary_prec[cls] + 1))
+				return false;
+		}
+		climb_binary(c, cls);
+	}
+	return true;
+}
+
+/*
+ * Compiles an expression without parentheses in one loop. An operator is
+ * emitted once the next one is known not to bind tighter.
+ */
+static bool climb_flat(struct climber * c)
+{
+	int cls;
+	int add = 0, mul = 0;	// Classes of the pending operators, 0 for none
+
+	if(!climb_operand(c, false))
+		return false;
+
+	while((cls = climb_next(c)) != C_END)
+	{
+		if(binary_prec[cls] == 0)
+			return false;
+		c->p++;
+
+		if(mul != 0)
+			climb_binary(c, mul);
+		mul = 0;
+		if(binary_prec[cls] == 2)
+			mul = cls;
+		else
+		{
+			if(add != 0)
+				climb_binary(c, add);
+			add = cls;
+		}
+
+		if(!climb_operand(c, false))
+			return false;
+	}
+
+	if(mul != 0)
+		climb_binary(c, mul);
+	if(add != 0)
+		climb_binary(c, add);
+	return true;
+}
+
+bool climb_compile(const char * expr, program * prog)
+{
+	struct climber c = { (const unsigned char *)expr, prog, 0, 0, false };
+
+	if(climb_flat(&c))
+		return true;
+	if(!c.paren)
+		return false;
+
+	// Start again on the general path
+	program_clear(prog);
+	c.p = (const unsigned char *)expr;
+	c.depth = 0;
+	if(!climb_operand(&c, true) || !climb_rest(&c, 1))
+		return false;
+	return climb_next(&c) == C_END;
+}
@@ -0,0 +1,36 @@
+/********************************************************************************
+ * climb.h
+ *
+ * Computer Science 3357a
+ * Precedence Climbing Parser
+ *
+ * Author: Duncan Cai
+ *
+ * Single-pass recursive descent compiler for well-formed expressions. It
+ * emits the same program the shunting yard would, but rejects anything it
+ * cannot parse without saying why; the shunting yard then compiles the
+ * expression again, so error statuses are the same whichever engine runs.
+*******************************************************************************/
+
+#ifndef CLIMB_H
+#define CLIMB_H
+
+#include <stdbool.h>
+#include "bytecode.h"
+
+#define CLIMB_MAX_DEPTH 256		// Parentheses nested before giving up
+
+/*
+ * Compiles an expression by precedence climbing. Expressions without
+ * parentheses take a loop with no recursion.
+ *
+ * expr: the expression to be compiled
+ * prog: the program, which must be empty
+ *
+ * return: true if the expression is well-formed and prog holds it; false
+ * if it is malformed or nested deeper than CLIMB_MAX_DEPTH, leaving prog
+ * in an unspecified state
+ */
+bool climb_compile(const char * expr, program * prog);
+
+#endif
@@ -0,0 +1,812 @@
+/********************************************************************************
+ * ctp.c
+ *
+ * Computer Science 3357a
+ * Calculator Transfer Protocol
+ *
+ * Author: Duncan Cai
+ *
+ * Validation of CTP requests and construction of CTP responses.
+*******************************************************************************/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "ctp.h"
+#include "logger.h"
+#include "cache.h"
+#include "metrics.h"
+#include "admission.h"
+#include "jit.h"
+
+struct ctp_config ctp_config = { false, MAX_REQUEST, READ_TIMEOUT, WRITE_TIMEOUT, IDLE_TIMEOUT };
+
+// Program of the binary bytecode and column requests of this thread
+static __thread program * binary_prog = NULL;
+
+char * status_code_to_str(int code)
+{
+	switch(code)
+	{
+		case MALFORMED_REQ:
+			return "malformed-req";
+		case MAX_LENGTH_EXCEEDED:
+			return "max-length-exceeded";
+		case OVERLOADED:
+			return "overloaded";
+		case MISMATCH:
+			return "mismatch";
+		case INVALID_EXPR:
+			return "invalid-expr";
+		case OVERFLOW:
+			return "overflow";
+		case OK:
+			return "ok";
+		default:
+			printf("Invalid status code.\n");
+			exit(EXIT_FAILURE);
+	}
+}
+
+int ctp_process_request(char * request, size_t len, char * response)
+{
+	int status_code = OK;
+	int64_t result;				// Stores the result of parsing
+	const char * digits = NULL;	// An exact result that does not fit in result
+	size_t max = ctp_config.max_request;
+	size_t expr_len, digits_len;
+	uint64_t arrival;
+	int written;
+
+	// A request of the maximum length must end on newline
+	// If we read 2 bytes, then expression is empty
+	if(len > max || (len == max && request[len - 1] != '\n'))
+	{
+		status_code = MAX_LENGTH_EXCEEDED;
+	}
+	// Otherwise, must end with \r\n and be non-empty
+	else if(len <= 2 || request[len - 1] != '\n' || request[len - 2] != '\r')
+	{
+		status_code = MALFORMED_REQ;
+	}
+
+	// Add a terminating NULL character to indicate end of string
+	request[len >= 2 ? len - 2 : 0] = '\0';
+	expr_len = strlen(request);
+	logger_expression(request, expr_len);
+
+	// Shed the request rather than parse it while overloaded
+	if(status_code == OK && admission_shedding())
+		status_code = OVERLOADED;
+
+	// If the status code is OK so far, parse the expression
+	if(status_code == OK)
+	{
+		arrival = logger_capturing() ? logger_clock() : 0;
+		if(cache_enabled())
+			status_code = cached_parse_expr(request, &result);
+		else
+			status_code = parse_expr(request, &result);
+		// Exact arithmetic takes over from checked where 64 bits overflow
+		if(status_code == OVERFLOW && program_arith() == ARITH_BIG)
+		{
+			status_code = parse_expr_big(request, &digits, &digits_len);
+			if(status_code != OK)
+				digits = NULL;
+		}
+		// A result of more than 64 bits is captured as a string
+		if(arrival != 0 && digits != NULL)
+			logger_capture_digits(request, expr_len, arrival, digits, digits_len);
+		else if(arrival != 0)
+			logger_capture(request, expr_len, arrival, status_code, status_code == OK ? result : 0);
+	}
+
+	metrics_status(status_code);
+
+	// The digits are no more than the expression's characters, so they fit
+	if(digits != NULL)
+	{
+		logger_status_digits(digits, digits_len);
+		written = sprintf(response, "Status: ok\r\nResult: ");
+		memcpy(response + written, digits, digits_len);
+		memcpy(response + written + digits_len, "\r\n", 2);
+		return written + digits_len + 2;
+	}
+	// Parse succesful, construct OK response
+	else if(status_code == OK)
+	{
+		logger_status(status_code, result);
+		return sprintf(response, "Status: ok\r\nResult: %" PRId64 "\r\n", result);
+	}
+	// Parse error, construct error code response
+	else
+	{
+		logger_status(status_code, 0);
+		return sprintf(response, "Status: %s\r\n", status_code_to_str(status_code));
+	}
+}
+
+/*
+ * Stores a 64-bit value in network order
+ */
+static void encode_wide(char * out, int64_t value)
+{
+	uint64_t encoded = (uint64_t)value;
+	int i;
+
+	for(i = 7; i >= 0; i--, encoded >>= 8)
+		out[i] = encoded & 0xff;
+}
+
+/*
+ * Loads bytecode words in network order into this thread's program and
+ * checks that it can run
+ *
+ * return: status code; OK if the program is ready to run
+ */
+static int load_program(const char * words, size_t len, program ** prog)
+{
+	uint32_t word;
+	size_t i;
+
+	if(len == 0 || len % sizeof(uint32_t) != 0)
+		return MALFORMED_REQ;
+
+	if(binary_prog == NULL)
+		binary_prog = program_init();
+	program_clear(binary_prog);
+	for(i = 0; i < len; i += sizeof(uint32_t))
+	{
+		memcpy(&word, words + i, sizeof(uint32_t));
+		program_emit(binary_prog, (int32_t)ntohl(word));
+	}
+	*prog = binary_prog;
+	return program_verify(binary_prog);
+}
+
+int ctp_process_binary(int type, char * payload, size_t len, char * response)
+{
+	int status_code = OK;
+	int64_t result = 0;
+	program * prog;
+	char saved;
+
+	if(len > ctp_config.max_request)
+		status_code = MAX_LENGTH_EXCEEDED;
+	else if(admission_shedding())
+		status_code = OVERLOADED;
+	else if(type == BINARY_EXPR)
+	{
+		// The length frames the expression, so it may not hold a terminator
+		if(len == 0 || memchr(payload, '\0', len) != NULL)
+			status_code = MALFORMED_REQ;
+		else
+		{
+			saved = payload[len];
+			payload[len] = '\0';
+			logger_expression(payload, len);
+			if(cache_enabled())
+				status_code = cached_parse_expr(payload, &result);
+			else
+				status_code = parse_expr(payload, &result);
+			payload[len] = saved;
+		}
+	}
+	else if(type == BINARY_PROGRAM)
+	{
+		status_code = load_program(payload, len, &prog);
+		if(status_code == OK)
+			status_code = run_program(prog, &result);
+	}
+	else
+		status_code = MALFORMED_REQ;
+
+	metrics_status(status_code);
+	logger_status(status_code, status_code == OK ? result : 0);
+
+	response[0] = status_code;
+	encode_wide(response + 1, status_code == OK ? result : 0);
+	return BINARY_RESPONSE;
+}
+
+/*
+ * Finds the variable of the program a column name binds
+ *
+ * return: its index, or -1 if the program does not use the name
+ */
+static int column_variable(const program * prog, const char * name, size_t len)
+{
+	int i;
+
+	for(i = 0; i < prog->num_vars; i++)
+		if(strlen(prog->vars[i]) == len && memcmp(prog->vars[i], name, len) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Decodes the columns of a BINARY_COLUMNS payload that bind variables of
+ * the program, skipping the rest
+ *
+ * pos: offset of the first column
+ * values: room for rows values per variable of the program
+ * columns: set to the column of each variable
+ *
+ * return: status code; OK if every variable is bound exactly once
+ */
+static int load_columns(const program * prog, const char * payload, size_t len, size_t pos, int count,
+	uint32_t rows, int32_t * values, const int32_t ** columns)
+{
+	size_t name_len, i;
+	uint32_t word;
+	int32_t * column;
+	int index;
+
+	for(index = 0; index < prog->num_vars; index++)
+		columns[index] = NULL;
+
+	for(; count > 0; count--)
+	{
+		if(pos == len)
+			return MALFORMED_REQ;
+		name_len = (unsigned char)payload[pos++];
+		if(name_len > len - pos || (size_t)rows * sizeof(word) > len - pos - name_len)
+			return MALFORMED_REQ;
+
+		index = column_variable(prog, payload + pos, name_len);
+		pos += name_len;
+		if(index >= 0)
+		{
+			if(columns[index] != NULL)
+				return MALFORMED_REQ;
+			column = values + (size_t)index * rows;
+			for(i = 0; i < rows; i++)
+			{
+				memcpy(&word, payload + pos + i * sizeof(word), sizeof(word));
+				column[i] = (int32_t)ntohl(word);
+			}
+			columns[index] = column;
+		}
+		pos += (size_t)rows * sizeof(word);
+	}
+	if(pos != len)
+		return MALFORMED_REQ;
+
+	for(index = 0; index < prog->num_vars; index++)
+	{
+		if(columns[index] == NULL)
+		{
+			syslog(LOG_ERR, "Unbound variable %s", prog->vars[index]);
+			return INVALID_EXPR;
+		}
+	}
+	return OK;
+}
+
+size_t ctp_process_columns(const char * payload, size_t len, char * response)
+{
+	int status_code = OK;
+	uint32_t rows = 0;
+	uint16_t expr_len = 0;
+	int count = 0;
+	char * expr;
+	int32_t * values = NULL;
+	int32_t * results = NULL;
+	int64_t * wide = NULL;		// Results of checked arithmetic
+	const int32_t * columns[PROGRAM_MAX_VARS];
+	unsigned char * statuses;
+	jit_fn fn;
+	uint64_t start;
+	size_t i;
+
+	if(len > ctp_config.max_request)
+		status_code = MAX_LENGTH_EXCEEDED;
+	else if(admission_shedding())
+		status_code = OVERLOADED;
+	else if(len < COLUMNS_HEADER)
+		status_code = MALFORMED_REQ;
+	else
+	{
+		memcpy(&rows, payload, sizeof(rows));
+		rows = ntohl(rows);
+		count = (unsigned char)payload[4];
+		memcpy(&expr_len, payload + 5, sizeof(expr_len));
+		expr_len = ntohs(expr_len);
+
+		// Every column has a value per row, so the payload bounds the rows
+		// before anything is allocated for them
+		if(count == 0 || expr_len == 0 || expr_len > len - COLUMNS_HEADER
+			|| memchr(payload + COLUMNS_HEADER, '\0', expr_len) != NULL
+			|| (size_t)rows * sizeof(int32_t) * count > len - COLUMNS_HEADER - expr_len)
+			status_code = MALFORMED_REQ;
+	}
+
+	if(status_code == OK && (expr = malloc(expr_len + 1)) == NULL)
+		status_code = OVERLOADED;
+	else if(status_code == OK)
+	{
+		memcpy(expr, payload + COLUMNS_HEADER, expr_len);
+		expr[expr_len] = '\0';
+		logger_expression(expr, expr_len);
+
+		if(binary_prog == NULL)
+			binary_prog = program_init();
+		start = METRICS_START();
+		status_code = compile_expr(expr, binary_prog);
+		free(expr);
+		start = metrics_stage(METRIC_PARSE, start);
+
+		if(status_code == OK)
+		{
+			values = malloc((size_t)rows * binary_prog->num_vars * sizeof(int32_t) + 1);
+			if(program_arith() != ARITH_WRAP)
+				wide = malloc((size_t)rows * sizeof(int64_t) + 1);
+			else
+				results = malloc((size_t)rows * sizeof(int32_t) + 1);
+			// A client is refused rather than the server brought down
+			if(values == NULL || (results == NULL && wide == NULL))
+				status_code = OVERLOADED;
+			else
+				status_code = load_columns(binary_prog, payload, len, COLUMNS_HEADER + expr_len, count, rows, values, columns);
+		}
+
+		// The statuses go straight to the response, after the results.
+		// Fewer rows than a block are mostly padding to the interpreter,
+		// so expressions sent that way again and again are compiled.
+		if(status_code == OK)
+		{
+			statuses = (unsigned char *)response + BINARY_RESPONSE + (size_t)rows * 8;
+			if(wide != NULL)
+			{
+				run_program_columns_checked(binary_prog, columns, rows, wide, statuses);
+				for(i = 0; i < rows; i++)
+					encode_wide(response + BINARY_RESPONSE + i * 8, wide[i]);
+			}
+			else
+			{
+				fn = rows < COLUMN_BLOCK ? jit_lookup(binary_prog, rows) : NULL;
+				if(fn != NULL)
+					fn(columns, rows, results, statuses);
+				else
+					run_program_columns(binary_prog, columns, rows, results, statuses);
+				for(i = 0; i < rows; i++)
+					encode_wide(response + BINARY_RESPONSE + i * 8, results[i]);
+			}
+			metrics_stage(METRIC_EVAL, start);
+		}
+		free(values);
+		free(results);
+		free(wide);
+	}
+
+	metrics_status(status_code);
+	logger_status(status_code, 0);
+
+	response[0] = status_code;
+	encode_wide(response + 1, status_code == OK ? rows : 0);
+	return status_code == OK ? BINARY_RESPONSE + (size_t)rows * 9 : BINARY_RESPONSE;
+}
+
+void ctp_session_init(struct ctp_session * s)
+{
+	s->rbuf = NULL;
+	s->rcap = 0;
+	s->rlen = 0;
+	s->rstart = 0;
+	s->rscan = 0;
+	s->wbuf = NULL;
+	s->wcap = 0;
+	s->wlen = 0;
+	s->woff = 0;
+	s->wstage = 0;
+	s->batch_left = 0;
+	s->binary = false;
+	s->closing = false;
+}
+
+void ctp_session_free(struct ctp_session * s)
+{
+	free(s->rbuf);
+	free(s->wbuf);
+	s->rbuf = NULL;
+	s->rcap = 0;
+	s->wbuf = NULL;
+	s->wcap = 0;
+}
+
+char * ctp_session_rspace(struct ctp_session * s, size_t * len)
+{
+	size_t limit = ctp_config.max_request > SESSION_RBUF_SIZE ? ctp_config.max_request : SESSION_RBUF_SIZE;
+	size_t partial = s->rlen - s->rstart;
+	size_t new_cap;
+	char * new_buf;
+
+	if(s->rlen == s->rcap)
+	{
+		// Slide the partial request to the front only when that frees at
+		// least half the buffer; otherwise grow, so bytes are rarely moved
+		if(s->rstart > 0 && (s->rstart >= s->rcap / 2 || s->rcap >= limit))
+		{
+			memmove(s->rbuf, s->rbuf + s->rstart, partial);
+			s->rscan -= s->rstart;
+			s->rlen = partial;
+			s->rstart = 0;
+		}
+		else
+		{
+			new_cap = s->rcap == 0 ? SESSION_RBUF_SIZE : s->rcap * 2;
+			if(new_cap > limit && s->rcap < limit)
+				new_cap = limit;
+			new_buf = realloc(s->rbuf, new_cap);
+			if(new_buf == NULL)
+			{
+				*len = 0;
+				return NULL;
+			}
+			s->rbuf = new_buf;
+			s->rcap = new_cap;
+		}
+	}
+
+	*len = s->rcap - s->rlen;
+	return s->rbuf + s->rlen;
+}
+
+/*
+ * Makes room for one more response of up to need bytes in the write
+ * buffer. Outside a batch the buffer stays at SESSION_WBUF_SIZE and must be
+ * drained when full; a batch grows it until the whole batch can be sent at
+ * once, and so does a response longer than MAX_RESPONSE.
+ *
+ * return: false if the responses must be sent first (or memory ran out)
+ */
+static bool session_wreserve(struct ctp_session * s, size_t need)
+{
+	size_t new_cap = s->wcap == 0 ? SESSION_WBUF_SIZE : s->wcap;
+	char * new_buf;
+
+	while(new_cap - s->wstage < need && (s->batch_left > 0 || need > MAX_RESPONSE))
+		new_cap *= 2;
+	if(new_cap - s->wstage < need)
+		return false;
+
+	if(new_cap != s->wcap)
+	{
+		new_buf = realloc(s->wbuf, new_cap);
+		if(new_buf == NULL)
+			return false;
+		s->wbuf = new_buf;
+		s->wcap = new_cap;
+	}
+	return true;
+}
+
+/*
+ * Starts a batch if the request line is a batch header
+ *
+ * return: false if the line is an ordinary request
+ */
+static bool session_batch_begin(struct ctp_session * s, const char * line, size_t len)
+{
+	char * end;
+	unsigned long count;
+
+	if(len < 6 || memcmp(line, "BATCH ", 6) != 0)
+		return false;
+
+	count = strtoul(line + 6, &end, 10);
+	if(end == line + 6 || end != line + len - 2 || end[0] != '\r' || count == 0 || count > MAX_BATCH)
+	{
+		s->wstage += sprintf(s->wbuf + s->wstage, "Status: %s\r\n", status_code_to_str(MALFORMED_REQ));
+		return true;
+	}
+
+	s->wstage += sprintf(s->wbuf + s->wstage, "Batch: %lu\r\n", count);
+	s->batch_left = count;
+	return true;
+}
+
+/*
+ * Switches the session to binary frames if the request line asks for it
+ *
+ * return: false if the line is an ordinary request
+ */
+static bool session_binary_begin(struct ctp_session * s, const char * line, size_t len)
+{
+	if(len != 8 || memcmp(line, "BINARY\r\n", 8) != 0)
+		return false;
+
+	s->wstage += sprintf(s->wbuf + s->wstage, "Protocol: binary\r\n");
+	s->binary = true;
+	return true;
+}
+
+/*
+ * Answers the binary request at the front of the read buffer, if it has
+ * arrived whole. A frame that is too long, or cut short by the end of the
+ * input, is answered with an error and ends the session.
+ *
+ * return: false if nothing was answered
+ */
+static bool session_binary_request(struct ctp_session * s, bool eof)
+{
+	char * frame = s->rbuf + s->rstart;
+	size_t avail = s->rlen - s->rstart;
+	uint32_t len;
+	char * copy;
+
+	if(avail >= BINARY_HEADER)
+	{
+		memcpy(&len, frame, sizeof(len));
+		len = ntohl(len);
+
+		// The rest of the stream cannot be framed without reading it all
+		if(len > ctp_config.max_request)
+		{
+			s->wstage += ctp_process_binary(0, NULL, len, s->wbuf + s->wstage);
+			s->closing = true;
+			return true;
+		}
+
+		if(avail >= BINARY_HEADER + len)
+		{
+			// A column request's response is as long as its columns
+			if(frame[4] == BINARY_COLUMNS)
+			{
+				if(!session_wreserve(s, COLUMNS_RESPONSE(len)))
+				{
+					s->closing = true;
+					return false;
+				}
+				s->wstage += ctp_process_columns(frame + BINARY_HEADER, len, s->wbuf + s->wstage);
+			}
+			// An expression is terminated in place unless it ends the buffer
+			else if(frame[4] != BINARY_EXPR || s->rstart + BINARY_HEADER + len < s->rcap)
+				s->wstage += ctp_process_binary((unsigned char)frame[4], frame + BINARY_HEADER, len, s->wbuf + s->wstage);
+			else if((copy = malloc(len + 1)) != NULL)
+			{
+				memcpy(copy, frame + BINARY_HEADER, len);
+				s->wstage += ctp_process_binary(BINARY_EXPR, copy, len, s->wbuf + s->wstage);
+				free(copy);
+			}
+			else
+			{
+				s->closing = true;
+				return false;
+			}
+			s->rstart += BINARY_HEADER + len;
+			s->rscan = s->rstart;
+			return true;
+		}
+	}
+
+	// Wait for the rest of the frame unless the peer has gone away
+	if(!eof)
+		return false;
+	s->closing = true;
+	if(avail == 0)
+		return false;
+	s->wstage += ctp_process_binary(0, NULL, 0, s->wbuf + s->wstage);
+	s->rstart = s->rlen;
+	return true;
+}
+
+bool ctp_session_process(struct ctp_session * s, bool eof)
+{
+	char * newline;
+	size_t len;
+
+	if(s->closing)
+		return false;
+
+	// Move the unsent responses to the front to make room for new ones
+	if(s->woff > 0)
+	{
+		memmove(s->wbuf, s->wbuf + s->woff, s->wstage - s->woff);
+		s->wlen -= s->woff;
+		s->wstage -= s->woff;
+		s->woff = 0;
+	}
+
+	// Give back the memory of a large batch once it has been sent
+	if(s->wstage == 0 && s->wcap > SESSION_WBUF_SIZE)
+	{
+		free(s->wbuf);
+		s->wbuf = NULL;
+		s->wcap = 0;
+	}
+
+	while(!s->closing)
+	{
+		if(!session_wreserve(s, MAX_RESPONSE))
+		{
+			if(s->batch_left == 0)
+				return true;
+			s->closing = true;
+			break;
+		}
+
+		// Binary requests are framed by their length instead of a newline
+		if(s->binary)
+		{
+			if(!session_binary_request(s, eof))
+				break;
+			s->wlen = s->wstage;
+			if(!ctp_config.keep_alive)
+				s->closing = true;
+			continue;
+		}
+
+		// Only the bytes that arrived since the last call are searched
+		newline = memchr(s->rbuf + s->rscan, '\n', s->rlen - s->rscan);
+		if(newline != NULL)
+		{
+			len = newline + 1 - (s->rbuf + s->rstart);
+		}
+		else
+		{
+			s->rscan = s->rlen;
+			len = s->rlen - s->rstart;
+
+			// Wait for the rest of the line, unless it is already too long
+			// or the peer has gone away
+			if(len < ctp_config.max_request && !eof)
+				break;
+
+			// The line can never be completed, so the session ends with it
+			s->closing = true;
+			if(len == 0)
+				break;
+		}
+
+		// An exact result may take a character per byte of its expression;
+		// outside a batch, the responses before it are sent first
+		if(program_arith() == ARITH_BIG && s->wcap - s->wstage < MAX_RESPONSE + len)
+		{
+			if(s->batch_left == 0 && s->wstage > 0)
+				return true;
+			if(!session_wreserve(s, MAX_RESPONSE + len))
+			{
+				s->closing = true;
+				break;
+			}
+		}
+
+		if(s->batch_left > 0)
+		{
+			s->wstage += ctp_process_request(s->rbuf + s->rstart, len, s->wbuf + s->wstage);
+			s->batch_left--;
+		}
+		else if(!session_batch_begin(s, s->rbuf + s->rstart, len) && !session_binary_begin(s, s->rbuf + s->rstart, len))
+			s->wstage += ctp_process_request(s->rbuf + s->rstart, len, s->wbuf + s->wstage);
+		s->rstart += len;
+		s->rscan = s->rstart;
+
+		// A response (or a whole batch) is complete and can be sent
+		if(s->batch_left == 0)
+		{
+			s->wlen = s->wstage;
+			// Switching to binary is not a request of its own
+			if(!ctp_config.keep_alive && !s->binary)
+				s->closing = true;
+		}
+	}
+
+	// Whatever part of a batch was answered is sent before closing
+	if(s->closing)
+		s->wlen = s->wstage;
+
+	// Everything received was answered, so the buffer can be reused from the start
+	if(s->rstart == s->rlen)
+	{
+		s->rstart = 0;
+		s->rscan = 0;
+		s->rlen = 0;
+	}
+	return false;
+}
+
+/*
+ * Makes blocking sends or receives on the socket give up after a timeout
+ *
+ * option: SO_RCVTIMEO or SO_SNDTIMEO
+ * ms: the timeout in milliseconds, or 0 to wait forever
+ */
+static void set_socket_timeout(int sockfd, int option, unsigned ms)
+{
+	struct timeval timeout = { ms / 1000, (ms % 1000) * 1000 };
+
+	if(ms > 0)
+		setsockopt(sockfd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+void handle_connection(int connectionfd)
+{
+	struct ctp_session session;		// Stores the requests and responses
+	bool eof = false;
+	bool more;						// Requests left over for lack of output room
+	int bytes_read, bytes_sent;
+	size_t space;
+	char * rspace;
+	uint64_t start;
+
+	ctp_session_init(&session);
+	metrics_connection_opened();
+
+	// Without an event loop a request's time limit is enforced per recv
+	set_socket_timeout(connectionfd, SO_RCVTIMEO, ctp_config.read_timeout > 0 ? ctp_config.read_timeout : ctp_config.idle_timeout);
+	set_socket_timeout(connectionfd, SO_SNDTIMEO, ctp_config.write_timeout);
+
+	while(1)
+	{
+		more = ctp_session_process(&session, eof);
+
+		// Send responses to client
+		while(session.woff < session.wlen)
+		{
+			start = METRICS_START();
+			bytes_sent = send(connectionfd, session.wbuf + session.woff, session.wlen - session.woff, 0);
+			metrics_stage(METRIC_SEND, start);
+			if (bytes_sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				// The client is not reading its responses
+				metrics_connection_dropped(METRIC_DROP_TIMEOUT);
+				session.closing = true;
+				break;
+			}
+			else if (bytes_sent == -1)
+			{
+				perror("Unable to send to socket");
+				exit(EXIT_FAILURE);
+			}
+			session.woff += bytes_sent;
+		}
+
+		if(session.closing)
+			break;
+		if(more)
+			continue;
+
+		// Read as much as the buffer holds from the client
+		rspace = ctp_session_rspace(&session, &space);
+		if (rspace == NULL)
+		{
+			perror("Unable to grow request buffer");
+			exit(EXIT_FAILURE);
+		}
+		start = METRICS_START();
+		bytes_read = recv(connectionfd, rspace, space, 0);
+		if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// The client has stopped sending
+			metrics_connection_dropped(METRIC_DROP_TIMEOUT);
+			break;
+		}
+		else if (bytes_read == -1)
+		{
+			// Otherwise, if the read failed,
+			perror("Unable to read from socket");
+			exit(EXIT_FAILURE);
+		}
+		metrics_stage(METRIC_RECV, start);
+		if (bytes_read == 0)
+			eof = true;
+		else
+			session.rlen += bytes_read;
+	}
+
+	// Close the connection
+	ctp_session_free(&session);
+	close(connectionfd);
+	metrics_connection_closed();
+}
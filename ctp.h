@@ -0,0 +1,190 @@
+/********************************************************************************
+ * ctp.h
+ *
+ * Computer Science 3357a
+ * Calculator Transfer Protocol
+ *
+ * Author: Duncan Cai
+ *
+ * CTP request processing shared by every server I/O mode
+*******************************************************************************/
+
+#ifndef CTP_H
+#define CTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "parser.h"
+
+#define MAX_RESPONSE 50
+#define MAX_REQUEST 80			// Default maximum request size, \r\n included
+#define SESSION_RBUF_SIZE 1024	// Initial size of a session's read buffer
+#define SESSION_WBUF_SIZE 4096	// Responses buffered before they must be sent
+#define MAX_BATCH 100000		// Most expressions in one batch request
+#define BINARY_HEADER 5			// Payload length (32 bits, network order) and type of a binary request
+#define BINARY_RESPONSE 9		// Status byte and 64-bit result (network order) of a binary response
+#define READ_TIMEOUT 30000		// Default milliseconds to receive a request once started
+#define WRITE_TIMEOUT 30000		// Default milliseconds responses may wait without being sent
+#define IDLE_TIMEOUT 60000		// Default milliseconds a connection may wait between requests
+
+#define MAX_LENGTH_EXCEEDED 4
+#define MALFORMED_REQ 5
+#define OVERLOADED 6
+
+//Payload types of binary requests
+#define BINARY_EXPR 1			// The expression text, not terminated
+#define BINARY_PROGRAM 2		// Bytecode words, 32 bits each in network order
+#define BINARY_COLUMNS 3		// An expression and columns of its variables' values, evaluated per row
+
+//A BINARY_COLUMNS payload starts with the number of rows (32 bits), of columns
+//(8 bits, at least one) and the length of the expression (16 bits), followed by
+//the expression. Each column is a name length (8 bits), the name and a value
+//(32 bits) per row. Every number is in network order.
+#define COLUMNS_HEADER 7
+
+//Longest response to a BINARY_COLUMNS payload of len bytes: the status byte
+//and row count, then a 64-bit result and a status byte per row
+#define COLUMNS_RESPONSE(len) (BINARY_RESPONSE + (len) / 4 * 9)
+
+//Protocol options, set once at startup before any connection is served
+struct ctp_config
+{
+	bool keep_alive;	// Answer many \r\n-terminated requests per connection
+	size_t max_request;	// Longest request accepted, \r\n included
+	unsigned read_timeout;	// Milliseconds to receive a request once started, 0 for none
+	unsigned write_timeout;	// Milliseconds without sending any pending response, 0 for none
+	unsigned idle_timeout;	// Milliseconds with no request in progress, 0 for none
+};
+
+extern struct ctp_config ctp_config;
+
+//Buffered protocol state of one connection
+struct ctp_session
+{
+	char * rbuf;						// Bytes received, grown as lines get longer
+	size_t rcap;
+	size_t rlen;
+	size_t rstart;						// Start of the first unanswered request
+	size_t rscan;						// No newline before this offset
+	char * wbuf;						// Responses waiting to be sent, in order
+	size_t wcap;
+	size_t wlen;						// Bytes of wbuf ready to be sent
+	size_t woff;						// Bytes of wbuf already sent
+	size_t wstage;						// End of the responses of an unfinished batch
+	size_t batch_left;					// Expressions still to come in the batch
+	bool binary;						// Requests are binary frames from now on
+	bool closing;						// No further requests will be answered
+};
+
+/*
+ * Converts a status code to a string representation
+ *
+ * code: the status code
+ *
+ * return: string representation of the status code
+ */
+char * status_code_to_str(int code);
+
+/*
+ * Validates and evaluates a raw CTP request and builds the response
+ * The request is modified in place (its \r\n is replaced by a terminator)
+ *
+ * request: the bytes received from the client, including the \r\n
+ * len: number of bytes in request
+ * response: buffer of at least MAX_RESPONSE bytes for the response, or
+ * MAX_RESPONSE + len in exact arithmetic (ARITH_BIG), whose results are
+ * written out in full
+ *
+ * return: the length of the response
+ */
+int ctp_process_request(char * request, size_t len, char * response);
+
+/*
+ * Evaluates a binary request and builds its fixed-size response
+ *
+ * type: BINARY_EXPR or BINARY_PROGRAM
+ * payload: the payload; an expression must be followed by a writable byte,
+ * which is overwritten while it is parsed and then restored
+ * len: number of bytes in payload
+ * response: buffer of at least BINARY_RESPONSE bytes for the response
+ *
+ * return: the length of the response, BINARY_RESPONSE
+ */
+int ctp_process_binary(int type, char * payload, size_t len, char * response);
+
+/*
+ * Evaluates a BINARY_COLUMNS request: the expression is compiled once and
+ * run over the columns, whose names bind its variables; columns it does
+ * not use are ignored. If the request is OK, the response carries the
+ * number of rows in place of a result, followed by the result column and
+ * then the status column.
+ *
+ * payload: the payload
+ * len: number of bytes in payload
+ * response: buffer of at least COLUMNS_RESPONSE(len) bytes for the response
+ *
+ * return: the length of the response
+ */
+size_t ctp_process_columns(const char * payload, size_t len, char * response);
+
+/*
+ * Resets a session for a newly accepted connection
+ *
+ * s: pointer to session
+ */
+void ctp_session_init(struct ctp_session * s);
+
+/*
+ * Frees the buffers of a session
+ *
+ * s: pointer to session
+ */
+void ctp_session_free(struct ctp_session * s);
+
+/*
+ * Returns where the next received bytes should be stored, making room in
+ * the read buffer first. The caller adds what it received to s->rlen.
+ *
+ * s: pointer to session
+ * len: set to the number of bytes that may be stored
+ *
+ * return: pointer into the read buffer, or NULL if out of memory
+ */
+char * ctp_session_rspace(struct ctp_session * s, size_t * len);
+
+/*
+ * Answers every request that is complete in the read buffer, appending the
+ * responses to the write buffer in order. Requests are framed by their
+ * newline however many reads they took, and are evaluated in place.
+ * Without keep-alive the first request closes the session.
+ *
+ * A "BATCH n" line starts a batch of the n lines that follow. It is answered
+ * with "Batch: n" followed by the n responses, which become ready to send
+ * together once the last one is known.
+ *
+ * A "BINARY" line is answered with "Protocol: binary" and switches the
+ * session to binary frames: a BINARY_HEADER (payload length and type)
+ * followed by the payload, each answered with a BINARY_RESPONSE of a
+ * status byte and the result. Results are never formatted as text.
+ * A BINARY_COLUMNS payload is answered with a column of results instead.
+ *
+ * s: pointer to session
+ * eof: true if the peer will send nothing more
+ *
+ * return: true if it stopped because the write buffer is full; call it
+ * again once the responses have been sent
+ */
+bool ctp_session_process(struct ctp_session * s, bool eof);
+
+/*
+ * Reads the CTP request from the client and processes it
+ * Sends a response to the client with the result
+ * Blocks until the client is answered, then closes the connection
+ * A client that takes longer than the read timeout (or the idle timeout
+ * if there is none) to send, or the write timeout to receive, is dropped
+ *
+ * connectionfd: socket of the accepted connection
+ */
+void handle_connection(int connectionfd);
+
+#endif
@@ -0,0 +1,422 @@
+/********************************************************************************
+ * dag.c
+ *
+ * Computer Science 3357a
+ * Expression DAG Optimizer
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the optimizer. The program is read as postfix once,
+ * and each node is hash-consed: looked up by its instruction and operand
+ * nodes, and only added if no identical node exists. An operator whose
+ * operands are constants becomes a constant itself. The graph is written
+ * back out depth first, in the order the tree was, so every operator that
+ * is evaluated is evaluated in the same order as before.
+*******************************************************************************/
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dag.h"
+
+//A node: a constant, a variable, or an operator and its operand nodes
+struct dag_node
+{
+	int32_t op;			// Instruction; OP_PUSH for every 64-bit constant
+	int32_t left;		// Operand, variable, or offset of a big literal's count in the code
+	int32_t right;		// Second operand, or limbs of a big literal; -1 if none
+	int64_t value;		// Constant, or hash of a big literal's limbs
+	uint32_t refs;		// Nodes that use it, and the program if it is the result
+	int32_t slot;		// Slot it was saved in, or -1 until it is evaluated
+};
+
+//A node being written out, and how many of its operands already are
+struct dag_frame
+{
+	int32_t node;
+	int done;
+};
+
+static size_t dag_threshold = 0;
+static _Atomic uint64_t stat_programs = 0;
+static _Atomic uint64_t stat_nodes = 0;
+static _Atomic uint64_t stat_eliminated = 0;
+
+// Storage of each thread, kept between calls
+static __thread struct dag_node * nodes = NULL;
+static __thread int32_t * operands = NULL;		// Operand stack of the program being read
+static __thread struct dag_frame * frames = NULL;
+static __thread size_t nodes_cap = 0;
+static __thread int32_t * table = NULL;			// Node index plus one, or 0 where free
+static __thread size_t table_cap = 0;
+static __thread program * rebuilt = NULL;
+
+void dag_init(size_t threshold)
+{
+	dag_threshold = threshold;
+}
+
+bool dag_enabled()
+{
+	return dag_threshold > 0;
+}
+
+void dag_get_stats(struct dag_stats * stats)
+{
+	stats->programs = atomic_load_explicit(&stat_programs, memory_order_relaxed);
+	stats->nodes = atomic_load_explicit(&stat_nodes, memory_order_relaxed);
+	stats->eliminated = atomic_load_explicit(&stat_eliminated, memory_order_relaxed);
+}
+
+/*
+ * Makes room for a program of the given length, which has at most that
+ * many nodes
+ *
+ * return: the size of the hash table to use, a power of two
+ */
+static size_t dag_reserve(size_t len)
+{
+	size_t size = 16;
+
+	if(len > nodes_cap)
+	{
+		nodes = realloc(nodes, len * sizeof(*nodes));
+		operands = realloc(operands, len * sizeof(*operands));
+		frames = realloc(frames, len * sizeof(*frames));
+		if(nodes == NULL || operands == NULL || frames == NULL)
+			exit(EXIT_FAILURE);
+		nodes_cap = len;
+	}
+
+	// At most half full
+	while(size < 2 * len)
+		size *= 2;
+	if(size > table_cap)
+	{
+		free(table);
+		table = malloc(size * sizeof(*table));
+		if(table == NULL)
+			exit(EXIT_FAILURE);
+		table_cap = size;
+	}
+	memset(table, 0, size * sizeof(*table));
+	return size;
+}
+
+static uint64_t dag_hash(int32_t op, int32_t left, int32_t right, int64_t value)
+{
+	uint64_t hash = (uint64_t)value;
+
+	hash = (hash ^ (uint32_t)op) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ (uint32_t)left) * 0x9e3779b97f4a7c15ULL;
+	hash = (hash ^ (uint32_t)right) * 0x9e3779b97f4a7c15ULL;
+	return hash ^ (hash >> 32);
+}
+
+/*
+ * FNV-1a hash of a big literal's limbs
+ */
+static int64_t dag_hash_limbs(const int32_t * limbs, int32_t count)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int32_t i;
+
+	for(i = 0; i < count; i++)
+	{
+		hash ^= (uint32_t)limbs[i];
+		hash *= 1099511628211ULL;
+	}
+	return (int64_t)hash;
+}
+
+/*
+ * Returns the node with the given contents, adding it if there is none
+ *
+ * code: the code of the program being read, for big literals
+ * size: size of the hash table
+ * count: number of nodes, updated if one is added
+ */
+static int32_t dag_intern(const int32_t * code, size_t size, size_t * count,
+	int32_t op, int32_t left, int32_t right, int64_t value)
+{
+	// A big literal is hashed by its limbs, not by where it is
+	size_t i = dag_hash(op, op == OP_PUSH_BIG ? 0 : left, right, value) & (size - 1);
+	struct dag_node * n;
+	int32_t id;
+
+	while((id = table[i]) != 0)
+	{
+		n = &nodes[id - 1];
+		if(n->op == op && n->right == right && n->value == value
+			&& (op == OP_PUSH_BIG ? memcmp(code + n->left + 1, code + left + 1, right * sizeof(int32_t)) == 0 : n->left == left))
+			return id - 1;
+		i = (i + 1) & (size - 1);
+	}
+
+	id = (*count)++;
+	nodes[id] = (struct dag_node){ op, left, right, value, 0, -1 };
+	table[i] = id + 1;
+	return id;
+}
+
+/*
+ * Works out an operator on constants as the program would
+ *
+ * op: the instruction; b is ignored for OP_NEG
+ * value: set to the result
+ *
+ * return: false if it divides by zero or overflows, so it must be left to run
+ */
+static bool dag_fold(int32_t op, int64_t a, int64_t b, int64_t * value)
+{
+	uint32_t x = (uint32_t)a, y = (uint32_t)b;
+
+	if(program_arith() == ARITH_WRAP)
+	{
+		switch(op)
+		{
+			case OP_ADD:
+				*value = (int32_t)(x + y);
+				return true;
+			case OP_SUB:
+				*value = (int32_t)(x - y);
+				return true;
+			case OP_MUL:
+				*value = (int32_t)(x * y);
+				return true;
+			case OP_DIV:
+				if(b == 0)
+					return false;
+				*value = b == -1 ? (int32_t)(0 - x) : (int32_t)a / (int32_t)b;
+				return true;
+			case OP_NEG:
+				*value = (int32_t)(0 - x);
+				return true;
+		}
+		return false;
+	}
+
+	switch(op)
+	{
+		case OP_ADD:
+			return !__builtin_add_overflow(a, b, value);
+		case OP_SUB:
+			return !__builtin_sub_overflow(a, b, value);
+		case OP_MUL:
+			return !__builtin_mul_overflow(a, b, value);
+		case OP_DIV:
+			if(b == 0 || (b == -1 && a == INT64_MIN))
+				return false;
+			*value = a / b;
+			return true;
+		case OP_NEG:
+			return !__builtin_sub_overflow(0, a, value);
+	}
+	return false;
+}
+
+/*
+ * Reads the program into nodes
+ *
+ * size: size of the hash table
+ * count: set to the number of nodes
+ * tree: set to the number of nodes the expression tree has
+ *
+ * return: the node of the result
+ */
+static int32_t dag_build(const program * prog, size_t size, size_t * count, size_t * tree)
+{
+	const int32_t * code = prog->code;
+	const int32_t * pc = code;
+	const int32_t * end = pc + prog->len;
+	size_t depth = 0;
+	int32_t op, a, b = -1, id;
+	int64_t value;
+
+	*count = 0;
+	*tree = 0;
+	while(pc < end)
+	{
+		op = *pc++;
+		(*tree)++;
+		switch(op)
+		{
+			case OP_PUSH:
+				id = dag_intern(code, size, count, OP_PUSH, 0, -1, *pc++);
+				break;
+			case OP_PUSH_WIDE:
+				value = (int64_t)((uint64_t)(uint32_t)pc[0] << 32 | (uint32_t)pc[1]);
+				pc += 2;
+				id = dag_intern(code, size, count, OP_PUSH, 0, -1, value);
+				break;
+			case OP_PUSH_BIG:
+				id = dag_intern(code, size, count, OP_PUSH_BIG, pc - code, *pc, dag_hash_limbs(pc + 1, *pc));
+				pc += 1 + *pc;
+				break;
+			case OP_LOAD:
+				id = dag_intern(code, size, count, OP_LOAD, *pc++, -1, 0);
+				break;
+			default:
+				if(op != OP_NEG)
+					b = operands[--depth];
+				a = operands[--depth];
+				if(nodes[a].op == OP_PUSH && (op == OP_NEG || nodes[b].op == OP_PUSH)
+					&& dag_fold(op, nodes[a].value, op == OP_NEG ? 0 : nodes[b].value, &value))
+					id = dag_intern(code, size, count, OP_PUSH, 0, -1, value);
+				else
+					id = dag_intern(code, size, count, op, a, op == OP_NEG ? -1 : b, 0);
+				break;
+		}
+		operands[depth++] = id;
+	}
+	return operands[0];
+}
+
+/*
+ * Appends a constant to the program, as narrow as it fits
+ */
+static void dag_emit_constant(program * out, int64_t value)
+{
+	if(value >= INT32_MIN && value <= INT32_MAX)
+	{
+		program_emit(out, OP_PUSH);
+		program_emit(out, (int32_t)value);
+	}
+	else
+	{
+		program_emit(out, OP_PUSH_WIDE);
+		program_emit(out, (int32_t)((uint64_t)value >> 32));
+		program_emit(out, (int32_t)(uint32_t)value);
+	}
+}
+
+/*
+ * Writes the nodes out as a program, depth first from the result. An
+ * operator used more than once is saved the first time and recalled after;
+ * constants and variables are as quick to push again.
+ *
+ * code: the code the nodes were read from, for big literals
+ * out: the program, which must be empty
+ *
+ * return: the number of nodes written, not counting recalls
+ */
+static size_t dag_emit(const int32_t * code, int32_t root, program * out)
+{
+	struct dag_frame * f;
+	struct dag_node * n;
+	size_t top = 1, depth = 0, written = 0;
+
+	frames[0] = (struct dag_frame){ root, 0 };
+	while(top > 0)
+	{
+		f = &frames[top - 1];
+		n = &nodes[f->node];
+
+		if(f->done == 0 && n->slot >= 0)
+		{
+			program_emit(out, OP_RECALL);
+			program_emit(out, n->slot);
+			if(++depth > out->max_depth)
+				out->max_depth = depth;
+			top--;
+			continue;
+		}
+
+		switch(n->op)
+		{
+			case OP_PUSH:
+			case OP_PUSH_BIG:
+			case OP_LOAD:
+				if(n->op == OP_PUSH)
+					dag_emit_constant(out, n->value);
+				else if(n->op == OP_PUSH_BIG)
+					for(int32_t i = -1; i <= n->right; i++)
+						program_emit(out, code[n->left + i]);
+				else
+				{
+					program_emit(out, OP_LOAD);
+					program_emit(out, n->left);
+				}
+				if(++depth > out->max_depth)
+					out->max_depth = depth;
+				written++;
+				top--;
+				continue;
+			case OP_NEG:
+				if(f->done++ == 0)
+				{
+					frames[top++] = (struct dag_frame){ n->left, 0 };
+					continue;
+				}
+				program_emit(out, OP_NEG);
+				break;
+			default:
+				if(f->done < 2)
+				{
+					frames[top++] = (struct dag_frame){ f->done++ == 0 ? n->left : n->right, 0 };
+					continue;
+				}
+				program_emit(out, n->op);
+				depth--;
+				break;
+		}
+
+		written++;
+		if(n->refs > 1)
+		{
+			n->slot = out->num_slots++;
+			program_emit(out, OP_SAVE);
+			program_emit(out, n->slot);
+		}
+		top--;
+	}
+	return written;
+}
+
+size_t dag_optimize(program * prog)
+{
+	size_t size, count, tree, written, capacity, i;
+	int32_t root;
+	int32_t * code;
+
+	if(dag_threshold == 0 || prog->len < dag_threshold)
+		return 0;
+
+	size = dag_reserve(prog->len);
+	root = dag_build(prog, size, &count, &tree);
+
+	for(i = 0; i < count; i++)
+	{
+		if(nodes[i].op == OP_NEG)
+			nodes[nodes[i].left].refs++;
+		else if(nodes[i].op != OP_PUSH && nodes[i].op != OP_PUSH_BIG && nodes[i].op != OP_LOAD)
+		{
+			nodes[nodes[i].left].refs++;
+			nodes[nodes[i].right].refs++;
+		}
+	}
+	nodes[root].refs++;
+
+	if(rebuilt == NULL)
+		rebuilt = program_init();
+	program_clear(rebuilt);
+	written = dag_emit(prog->code, root, rebuilt);
+
+	atomic_fetch_add_explicit(&stat_programs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stat_nodes, tree, memory_order_relaxed);
+	if(written == tree)
+		return 0;
+	atomic_fetch_add_explicit(&stat_eliminated, tree - written, memory_order_relaxed);
+
+	// The program takes the rebuilt code, and its old code is rebuilt into next time
+	code = prog->code;
+	capacity = prog->capacity;
+	prog->code = rebuilt->code;
+	prog->capacity = rebuilt->capacity;
+	prog->len = rebuilt->len;
+	prog->max_depth = rebuilt->max_depth;
+	prog->num_slots = rebuilt->num_slots;
+	rebuilt->code = code;
+	rebuilt->capacity = capacity;
+	return tree - written;
+}
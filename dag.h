@@ -0,0 +1,63 @@
+/********************************************************************************
+ * dag.h
+ *
+ * Computer Science 3357a
+ * Expression DAG Optimizer
+ *
+ * Author: Duncan Cai
+ *
+ * Rebuilds long programs as a directed acyclic graph in which identical
+ * subexpressions are one node and operators on constants are folded. Each
+ * node is then evaluated once: a subexpression used again is saved in a
+ * slot the first time and recalled after that.
+*******************************************************************************/
+
+#ifndef DAG_H
+#define DAG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bytecode.h"
+
+//What the optimizer has done since the server started
+struct dag_stats
+{
+	uint64_t programs;		// Programs long enough to rebuild
+	uint64_t nodes;			// Nodes of their expression trees
+	uint64_t eliminated;	// Nodes shared with an identical one or folded away
+};
+
+/*
+ * Turns the optimizer on; must be called before any thread uses it
+ *
+ * threshold: words of code a program compiled by compile_expr needs to be
+ * rebuilt, as shorter ones are quicker to run than to rebuild
+ */
+void dag_init(size_t threshold);
+
+/*
+ * Returns true if dag_init was called
+ */
+bool dag_enabled();
+
+/*
+ * Rebuilds a program as a DAG, if it is long enough, in the arithmetic
+ * chosen by program_set_arith. A division by zero or an overflow is left
+ * for the program to run into, so it reports the same status as before and
+ * any error comes from the same operator.
+ *
+ * prog: a program produced by compile_expr, replaced by the rebuilt one
+ *
+ * return: the number of nodes eliminated
+ */
+size_t dag_optimize(program * prog);
+
+/*
+ * Gets what the optimizer has done
+ *
+ * stats: filled with the counts of every thread
+ */
+void dag_get_stats(struct dag_stats * stats);
+
+#endif
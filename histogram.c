@@ -0,0 +1,89 @@
+/********************************************************************************
+ * histogram.c
+ *
+ * Computer Science 3357a
+ * Latency Histogram
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the log-linear histogram. Values below 2^7 have a
+ * bucket each; above that, the top seven bits of a value pick its bucket.
+*******************************************************************************/
+
+#include <string.h>
+#include "histogram.h"
+
+void histogram_init(struct histogram * h)
+{
+	memset(h, 0, sizeof(struct histogram));
+}
+
+int histogram_bucket(uint64_t value)
+{
+	int shift;
+
+	if(value < (1 << HIST_SUB_BITS))
+		return value;
+
+	// Keep the top HIST_SUB_BITS bits of the value
+	shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+	return shift * HIST_HALF + (int)(value >> shift);
+}
+
+uint64_t histogram_bucket_max(int bucket)
+{
+	int shift;
+
+	if(bucket < (1 << HIST_SUB_BITS))
+		return bucket;
+
+	shift = bucket / HIST_HALF - 1;
+	return ((uint64_t)(bucket - shift * HIST_HALF + 1) << shift) - 1;
+}
+
+void histogram_record(struct histogram * h, uint64_t value)
+{
+	h->counts[histogram_bucket(value)]++;
+	h->total++;
+	h->sum += value;
+	if(value > h->max)
+		h->max = value;
+}
+
+void histogram_merge(struct histogram * dst, const struct histogram * src)
+{
+	int i;
+
+	for(i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if(src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t histogram_percentile(const struct histogram * h, double percentile)
+{
+	uint64_t rank, seen = 0;
+	uint64_t value;
+	int i;
+
+	if(h->total == 0)
+		return 0;
+
+	// The rank of the value we want, counting from 1
+	rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+	if(rank < 1)
+		rank = 1;
+
+	for(i = 0; i < HIST_BUCKETS; i++)
+	{
+		seen += h->counts[i];
+		if(seen >= rank)
+		{
+			value = histogram_bucket_max(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+	return h->max;
+}
@@ -0,0 +1,82 @@
+/********************************************************************************
+ * histogram.h
+ *
+ * Computer Science 3357a
+ * Latency Histogram
+ *
+ * Author: Duncan Cai
+ *
+ * Log-linear (HDR-style) histogram of 64-bit values. Every power of two is
+ * split into 64 sub-buckets, so any recorded value is reported within 1.6%.
+*******************************************************************************/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 7									// 2^7 sub-buckets below the first power
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))			// Sub-buckets per power of two after that
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF + HIST_HALF)
+
+//A histogram of values such as nanosecond latencies
+struct histogram
+{
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;		// Number of values recorded
+	uint64_t max;
+	uint64_t sum;
+};
+
+/*
+ * Empties a histogram
+ *
+ * h: pointer to histogram
+ */
+void histogram_init(struct histogram * h);
+
+/*
+ * Records one value
+ *
+ * h: pointer to histogram
+ * value: the value
+ */
+void histogram_record(struct histogram * h, uint64_t value);
+
+/*
+ * Adds every value recorded in src to dst
+ *
+ * dst: pointer to the histogram added to
+ * src: pointer to the histogram added
+ */
+void histogram_merge(struct histogram * dst, const struct histogram * src);
+
+/*
+ * Returns the value below which the given share of the values fall
+ *
+ * h: pointer to histogram
+ * percentile: between 0 and 100
+ *
+ * return: the highest value equivalent to that percentile, or 0 if empty
+ */
+uint64_t histogram_percentile(const struct histogram * h, double percentile);
+
+/*
+ * Returns the index of the bucket a value is counted in
+ *
+ * value: the value
+ *
+ * return: index into counts
+ */
+int histogram_bucket(uint64_t value);
+
+/*
+ * Returns the highest value counted in a bucket
+ *
+ * bucket: index into counts
+ *
+ * return: the highest value of the bucket
+ */
+uint64_t histogram_bucket_max(int bucket);
+
+#endif
@@ -0,0 +1,129 @@
+/********************************************************************************
+ * iplimit.c
+ *
+ * Computer Science 3357a
+ * Per-Client Connection Limit
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the per-client limit: a hash of addresses to counts,
+ * sharded like the expression cache. An address is only in the table while
+ * it has a connection open.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "iplimit.h"
+
+#define CACHE_LINE 64
+
+//Open connections of one address
+struct iplimit_entry
+{
+	struct iplimit_entry * chain;	// Next entry in the same hash bucket
+	uint32_t addr;
+	unsigned count;
+};
+
+//An independently locked part of the table
+struct iplimit_shard
+{
+	pthread_mutex_t lock;
+	struct iplimit_entry * buckets[IPLIMIT_BUCKETS];
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct iplimit_shard * shards = NULL;
+static unsigned max_per_addr = 0;
+
+void iplimit_init(unsigned max)
+{
+	int i, b;
+
+	max_per_addr = max;
+	if(max == 0)
+		return;
+
+	shards = aligned_alloc(CACHE_LINE, IPLIMIT_SHARDS * sizeof(struct iplimit_shard));
+	if(shards == NULL)
+	{
+		perror("Unable to allocate connection limits");
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < IPLIMIT_SHARDS; i++)
+	{
+		pthread_mutex_init(&shards[i].lock, NULL);
+		for(b = 0; b < IPLIMIT_BUCKETS; b++)
+			shards[i].buckets[b] = NULL;
+	}
+}
+
+/*
+ * Returns the link that points at the entry of the address, or at the end
+ * of its bucket's chain if there is none, and locks its shard
+ */
+static struct iplimit_entry ** iplimit_find(uint32_t addr, struct iplimit_shard ** shard)
+{
+	// Fibonacci hashing spreads neighbouring addresses
+	uint32_t hash = addr * 2654435769U;
+	struct iplimit_entry ** link;
+
+	*shard = &shards[hash >> 26];
+	pthread_mutex_lock(&(*shard)->lock);
+	link = &(*shard)->buckets[(hash >> 16) & (IPLIMIT_BUCKETS - 1)];
+	while(*link != NULL && (*link)->addr != addr)
+		link = &(*link)->chain;
+	return link;
+}
+
+bool iplimit_acquire(uint32_t addr)
+{
+	struct iplimit_shard * shard;
+	struct iplimit_entry ** link;
+	struct iplimit_entry * entry;
+	bool allowed = true;
+
+	if(max_per_addr == 0)
+		return true;
+
+	link = iplimit_find(addr, &shard);
+	if(*link == NULL)
+	{
+		entry = malloc(sizeof(struct iplimit_entry));
+		if(entry != NULL)
+		{
+			entry->chain = NULL;
+			entry->addr = addr;
+			entry->count = 1;
+			*link = entry;
+		}
+		else
+			allowed = false;
+	}
+	else if((*link)->count < max_per_addr)
+		(*link)->count++;
+	else
+		allowed = false;
+	pthread_mutex_unlock(&shard->lock);
+	return allowed;
+}
+
+void iplimit_release(uint32_t addr)
+{
+	struct iplimit_shard * shard;
+	struct iplimit_entry ** link;
+	struct iplimit_entry * entry;
+
+	if(max_per_addr == 0)
+		return;
+
+	link = iplimit_find(addr, &shard);
+	entry = *link;
+	if(entry != NULL && --entry->count == 0)
+	{
+		*link = entry->chain;
+		free(entry);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
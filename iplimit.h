@@ -0,0 +1,46 @@
+/********************************************************************************
+ * iplimit.h
+ *
+ * Computer Science 3357a
+ * Per-Client Connection Limit
+ *
+ * Author: Duncan Cai
+ *
+ * Counts the open connections of each client IPv4 address, shared by every
+ * worker, so that one client cannot take all the server's connections
+*******************************************************************************/
+
+#ifndef IPLIMIT_H
+#define IPLIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define IPLIMIT_SHARDS 64
+#define IPLIMIT_BUCKETS 1024	// Hash buckets per shard
+
+/*
+ * Sets the most connections one address may have open; must be called
+ * before any connection is accepted
+ *
+ * max: the limit, or 0 for no limit
+ */
+void iplimit_init(unsigned max);
+
+/*
+ * Counts a new connection from the address if it is under the limit
+ *
+ * addr: client IPv4 address in network byte order
+ *
+ * return: false if the connection must be refused
+ */
+bool iplimit_acquire(uint32_t addr);
+
+/*
+ * Uncounts a connection that iplimit_acquire let in
+ *
+ * addr: client IPv4 address in network byte order
+ */
+void iplimit_release(uint32_t addr);
+
+#endif
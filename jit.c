@@ -0,0 +1,353 @@
+/********************************************************************************
+ * jit.c
+ *
+ * Computer Science 3357a
+ * Native Code Compiler
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the compiler. A program becomes a loop over the rows
+ * in which each instruction is a few machine instructions: the top of the
+ * operand stack is kept in eax and the rest on the machine stack, which is
+ * reset after every row. Slots are on the machine stack too, above it.
+ * Code is written to fresh anonymous memory that is made executable (and
+ * no longer writable) before it is called.
+*******************************************************************************/
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "jit.h"
+#include "parser.h"
+
+#define JIT_OP_BYTES 32			// Most machine code one instruction becomes
+#define JIT_FIXED_BYTES 128		// Machine code around the instructions
+
+//Evaluations counted for one program
+struct jit_entry
+{
+	uint64_t hash;
+	int32_t * code;				// Copy of the program's code, or NULL if the entry is free
+	size_t len;
+	uint64_t hits;				// Evaluations, less those of programs that wanted the entry
+	jit_fn fn;					// Compiled program, once hot
+	size_t size;
+	bool failed;				// The program could not be compiled
+};
+
+static unsigned long jit_threshold = 0;
+static _Atomic uint64_t compiled = 0;
+static __thread struct jit_entry * jit_table = NULL;
+
+void jit_init(unsigned long threshold)
+{
+	jit_threshold = threshold;
+}
+
+bool jit_enabled()
+{
+	return jit_threshold > 0;
+}
+
+uint64_t jit_compiled()
+{
+	return atomic_load_explicit(&compiled, memory_order_relaxed);
+}
+
+#if defined(__x86_64__)
+
+static unsigned char * emit(unsigned char * pos, const unsigned char * bytes, size_t len)
+{
+	memcpy(pos, bytes, len);
+	return pos + len;
+}
+
+static unsigned char * emit32(unsigned char * pos, int32_t value)
+{
+	memcpy(pos, &value, sizeof(value));
+	return pos + sizeof(value);
+}
+
+/*
+ * Points the rel32 field that ends at the given position to target
+ */
+static void patch_rel32(unsigned char * end, const unsigned char * target)
+{
+	int32_t rel = (int32_t)(target - end);
+	memcpy(end - sizeof(rel), &rel, sizeof(rel));
+}
+
+/*
+ * Writes the code of the program
+ * Register use: rdi columns, rsi rows, r11 results, [r8 + 8 * num_slots]
+ * statuses, r8 the stack pointer at the start of each row and the first
+ * slot, r9 the row, r10 a column
+ *
+ * return: the end of the code
+ */
+static unsigned char * jit_emit(const program * prog, unsigned char * code)
+{
+	static const unsigned char prologue[] =
+	{
+		0x51,					// push rcx				statuses, found above the slots
+		0x48, 0x81, 0xec, 0, 0, 0, 0,	// sub rsp, slots
+		0x49, 0x89, 0xd3,		// mov r11, rdx			results
+		0x45, 0x31, 0xc9,		// xor r9d, r9d			row
+		0x49, 0x89, 0xe0,		// mov r8, rsp
+		0x48, 0x85, 0xf6,		// test rsi, rsi
+		0x0f, 0x84, 0, 0, 0, 0,	// jz end
+	};
+	static const unsigned char store[] =
+	{
+		0x43, 0x89, 0x04, 0x8b,			// mov [r11 + r9*4], eax
+		0x4d, 0x8b, 0x90, 0, 0, 0, 0,	// mov r10, [r8 + slots]
+		0x43, 0xc6, 0x04, 0x0a, OK,		// mov byte [r10 + r9], OK
+	};
+	static const unsigned char next[] =
+	{
+		0x4c, 0x89, 0xc4,		// mov rsp, r8			drop what the row left
+		0x49, 0xff, 0xc1,		// inc r9
+		0x49, 0x39, 0xf1,		// cmp r9, rsi
+		0x0f, 0x82, 0, 0, 0, 0,	// jb loop
+	};
+	static const unsigned char epilogue[] =
+	{
+		0x48, 0x81, 0xc4, 0, 0, 0, 0,	// add rsp, slots
+		0x59,					// pop rcx
+		0xc3,					// ret
+	};
+	static const unsigned char fail[] =
+	{
+		0x43, 0xc7, 0x04, 0x8b, 0, 0, 0, 0,	// mov dword [r11 + r9*4], 0
+		0x4d, 0x8b, 0x90, 0, 0, 0, 0,		// mov r10, [r8 + slots]
+		0x43, 0xc6, 0x04, 0x0a, INVALID_EXPR,	// mov byte [r10 + r9], INVALID_EXPR
+		0xe9, 0, 0, 0, 0,					// jmp next
+	};
+	static const unsigned char divide[] =
+	{
+		0x89, 0xc1,				// mov ecx, eax			divisor
+		0x58,					// pop rax				dividend
+		0x83, 0xf9, 0xff,		// cmp ecx, -1			the most negative value would trap
+		0x74, 0x05,				// je negate
+		0x99,					// cdq
+		0xf7, 0xf9,				// idiv ecx
+		0xeb, 0x02,				// jmp done
+		0xf7, 0xd8,				// negate: neg eax
+	};
+	const int32_t * pc = prog->code;
+	const int32_t * end = pc + prog->len;
+	unsigned char * pos = code;
+	unsigned char * skip, * loop, * next_row, * tail;
+	unsigned char ** jumps;			// rel32 fields that jump to fail, by their end
+	size_t njumps = 0;
+	int32_t slots = (int32_t)(prog->num_slots * sizeof(int64_t));	// Bytes of slots
+	size_t i;
+
+	jumps = malloc((prog->len + 1) * sizeof(*jumps));
+	if(jumps == NULL)
+		return NULL;
+
+	pos = emit(pos, prologue, sizeof(prologue));
+	emit32(pos - sizeof(prologue) + 4, slots);
+	skip = pos;
+	loop = pos;
+
+	while(pc < end)
+	{
+		switch(*pc++)
+		{
+			case OP_PUSH:
+				*pos++ = 0x50;								// push rax
+				*pos++ = 0xb8;								// mov eax, imm32
+				pos = emit32(pos, *pc++);
+				break;
+			case OP_LOAD:
+				*pos++ = 0x50;								// push rax
+				pos = emit(pos, (const unsigned char[]){ 0x4c, 0x8b, 0x97 }, 3);	// mov r10, [rdi + disp32]
+				pos = emit32(pos, *pc++ * (int32_t)sizeof(int32_t *));
+				pos = emit(pos, (const unsigned char[]){ 0x43, 0x8b, 0x04, 0x8a }, 4);	// mov eax, [r10 + r9*4]
+				break;
+			case OP_ADD:
+				pos = emit(pos, (const unsigned char[]){ 0x59, 0x01, 0xc8 }, 3);	// pop rcx; add eax, ecx
+				break;
+			case OP_SUB:
+				pos = emit(pos, (const unsigned char[]){ 0x59, 0x29, 0xc1, 0x89, 0xc8 }, 5);	// pop rcx; sub ecx, eax; mov eax, ecx
+				break;
+			case OP_MUL:
+				pos = emit(pos, (const unsigned char[]){ 0x59, 0x0f, 0xaf, 0xc1 }, 4);	// pop rcx; imul eax, ecx
+				break;
+			case OP_DIV:
+				pos = emit(pos, (const unsigned char[]){ 0x85, 0xc0, 0x0f, 0x84, 0, 0, 0, 0 }, 8);	// test eax, eax; jz fail
+				jumps[njumps++] = pos;
+				pos = emit(pos, divide, sizeof(divide));
+				break;
+			case OP_NEG:
+				pos = emit(pos, (const unsigned char[]){ 0xf7, 0xd8 }, 2);	// neg eax
+				break;
+			case OP_SAVE:
+				pos = emit(pos, (const unsigned char[]){ 0x41, 0x89, 0x80 }, 3);	// mov [r8 + disp32], eax
+				pos = emit32(pos, *pc++ * (int32_t)sizeof(int64_t));
+				break;
+			case OP_RECALL:
+				pos = emit(pos, (const unsigned char[]){ 0x50, 0x41, 0x8b, 0x80 }, 4);	// push rax; mov eax, [r8 + disp32]
+				pos = emit32(pos, *pc++ * (int32_t)sizeof(int64_t));
+				break;
+			default:
+				free(jumps);
+				return NULL;
+		}
+	}
+
+	pos = emit(pos, store, sizeof(store));
+	emit32(pos - 9, slots);
+	next_row = pos;
+	pos = emit(pos, next, sizeof(next));
+	patch_rel32(pos, loop);
+	tail = pos;
+	patch_rel32(skip, tail);
+	pos = emit(pos, epilogue, sizeof(epilogue));
+	emit32(pos - sizeof(epilogue) + 3, slots);
+
+	// Rows that divide by zero get an error and move on to the next row
+	if(njumps > 0)
+	{
+		for(i = 0; i < njumps; i++)
+			patch_rel32(jumps[i], pos);
+		pos = emit(pos, fail, sizeof(fail));
+		emit32(pos - sizeof(fail) + 11, slots);
+		patch_rel32(pos, next_row);
+	}
+
+	free(jumps);
+	return pos;
+}
+
+jit_fn jit_compile(const program * prog, size_t * size)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t len = JIT_FIXED_BYTES + prog->len * JIT_OP_BYTES;
+	unsigned char * code;
+
+	if(prog->max_depth + prog->num_slots > JIT_MAX_DEPTH)
+		return NULL;
+
+	len = (len + page - 1) / page * page;
+	code = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(code == MAP_FAILED)
+		return NULL;
+
+	if(jit_emit(prog, code) == NULL || mprotect(code, len, PROT_READ | PROT_EXEC) == -1)
+	{
+		munmap(code, len);
+		return NULL;
+	}
+
+	*size = len;
+	return (jit_fn)code;
+}
+
+void jit_free(jit_fn fn, size_t size)
+{
+	munmap((void *)fn, size);
+}
+
+#else
+
+jit_fn jit_compile(const program * prog, size_t * size)
+{
+	return NULL;
+}
+
+void jit_free(jit_fn fn, size_t size)
+{
+}
+
+#endif
+
+/*
+ * FNV-1a hash of the program's code
+ */
+static uint64_t jit_hash(const program * prog)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for(i = 0; i < prog->len; i++)
+	{
+		hash ^= (uint32_t)prog->code[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*
+ * Empties an entry and gives it to the program
+ *
+ * return: false if out of memory
+ */
+static bool jit_entry_claim(struct jit_entry * e, const program * prog, uint64_t hash)
+{
+	if(e->fn != NULL)
+		jit_free(e->fn, e->size);
+	free(e->code);
+
+	e->code = malloc(prog->len * sizeof(int32_t));
+	if(e->code == NULL)
+		return false;
+	memcpy(e->code, prog->code, prog->len * sizeof(int32_t));
+	e->len = prog->len;
+	e->hash = hash;
+	e->hits = 0;
+	e->fn = NULL;
+	e->failed = false;
+	return true;
+}
+
+jit_fn jit_lookup(const program * prog, size_t evaluations)
+{
+	struct jit_entry * e;
+	uint64_t hash;
+
+	if(jit_threshold == 0)
+		return NULL;
+
+	if(jit_table == NULL)
+	{
+		jit_table = calloc(JIT_TABLE_SIZE, sizeof(struct jit_entry));
+		if(jit_table == NULL)
+			return NULL;
+	}
+
+	hash = jit_hash(prog);
+	e = &jit_table[hash & (JIT_TABLE_SIZE - 1)];
+	if(e->code == NULL || e->hash != hash || e->len != prog->len
+		|| memcmp(e->code, prog->code, prog->len * sizeof(int32_t)) != 0)
+	{
+		// A program holding the entry keeps it until it is out-evaluated
+		if(e->code != NULL && e->hits > evaluations)
+		{
+			e->hits -= evaluations;
+			return NULL;
+		}
+		if(!jit_entry_claim(e, prog, hash))
+		{
+			e->code = NULL;
+			return NULL;
+		}
+	}
+
+	e->hits += evaluations;
+	if(e->fn == NULL && !e->failed && e->hits >= jit_threshold)
+	{
+		e->fn = jit_compile(prog, &e->size);
+		if(e->fn == NULL)
+			e->failed = true;
+		else
+			atomic_fetch_add_explicit(&compiled, 1, memory_order_relaxed);
+	}
+	return e->fn;
+}
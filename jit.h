@@ -0,0 +1,77 @@
+/********************************************************************************
+ * jit.h
+ *
+ * Computer Science 3357a
+ * Native Code Compiler
+ *
+ * Author: Duncan Cai
+ *
+ * Compiles hot programs to x86-64 machine code in executable memory. Each
+ * thread counts how often the programs it runs are evaluated, and compiles
+ * one once it has been evaluated jit_threshold times. Elsewhere, or when a
+ * program cannot be compiled, programs stay with the interpreter.
+*******************************************************************************/
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "bytecode.h"
+
+#define JIT_TABLE_SIZE 64		// Programs whose evaluations each thread counts; a power of two
+#define JIT_MAX_DEPTH 4096		// Deeper programs, counting slots, are left to the interpreter
+
+/*
+ * Compiled program, called like run_program_columns; columns may be NULL
+ * if the program has no variables
+ */
+typedef void (*jit_fn)(const int32_t * const * columns, size_t rows, int32_t * results, unsigned char * statuses);
+
+/*
+ * Turns the compiler on; must be called before any thread uses it
+ *
+ * threshold: evaluations of a program before it is compiled
+ */
+void jit_init(unsigned long threshold);
+
+/*
+ * Returns true if jit_init was called
+ */
+bool jit_enabled();
+
+/*
+ * Counts evaluations of a program, and returns its native code once it
+ * is hot. The program is recognized by its code, so the same expression
+ * compiled again is the same program.
+ *
+ * prog: the program about to be evaluated
+ * evaluations: how many times (rows) it is about to be evaluated
+ *
+ * return: the compiled program, or NULL to use the interpreter
+ */
+jit_fn jit_lookup(const program * prog, size_t evaluations);
+
+/*
+ * Compiles a program to native code
+ *
+ * prog: a program produced by compile_expr or checked by program_verify
+ * size: set to the bytes mapped for the code
+ *
+ * return: the compiled program, or NULL if this platform or program is
+ * not supported
+ */
+jit_fn jit_compile(const program * prog, size_t * size);
+
+/*
+ * Unmaps a compiled program
+ */
+void jit_free(jit_fn fn, size_t size);
+
+/*
+ * Returns how many programs have been compiled by jit_lookup
+ */
+uint64_t jit_compiled();
+
+#endif
@@ -0,0 +1,708 @@
+/********************************************************************************
+ * loadgen.c
+ *
+ * Computer Science 3357a
+ * Load Generator
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the load generator: a single-threaded epoll loop over
+ * non-blocking connections, each carrying one request at a time. Latencies
+ * go into a log-linear histogram.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "loadgen.h"
+#include "histogram.h"
+
+#define MAX_EVENTS 256
+#define LG_RBUF_SIZE 256		// Response buffer a connection starts with; exact results may need more
+#define POOL_SIZE 1024			// Expressions generated when no file is given
+#define MAX_PENDING (1 << 20)	// Due requests that may wait for a free connection
+#define DRAIN_NS 2000000000ULL	// How long to wait for answers after the run
+#define NS_PER_SEC 1000000000ULL
+#define MAX_REPORTED 10			// Mismatched responses printed
+#define REPORTED_EXPR 60		// Characters of their expressions printed
+
+//A request of the pool
+struct lg_request
+{
+	char * text;				// The expression, ending with \r\n
+	size_t len;
+	char * expected;			// The response it should get, when replaying
+	uint64_t offset;			// When it was captured, after the first one
+};
+
+//A connection of the load generator
+struct lg_conn
+{
+	int fd;						// -1 while closed
+	bool connecting;			// Non-blocking connect still in progress
+	bool busy;					// A request is in flight
+	uint64_t due;				// When the request in flight was due
+	struct lg_request * req;	// The request being sent
+	size_t req_off;				// Bytes of the request already sent
+	char * rbuf;				// The response received so far
+	size_t rlen;
+	size_t rcap;
+};
+
+//State of a load generator run
+struct loadgen
+{
+	const struct loadgen_config * config;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int epfd;
+
+	struct lg_request * requests;
+	size_t num_requests;
+	size_t request_cap;
+	size_t next_request;
+	size_t scheduled;			// Requests of a replay given their due time
+
+	struct lg_conn * conns;
+	int * idle;					// Stack of idle connections
+	int num_idle;
+
+	uint64_t * pending;			// Ring of due times waiting for a connection
+	size_t pending_head;
+	size_t pending_tail;
+
+	struct histogram latency;
+	uint64_t ok;				// Answered with Status: ok
+	uint64_t errors;			// Answered with another status
+	uint64_t overloaded;		// Shed by the server with Status: overloaded
+	uint64_t failed;			// Connection failed before an answer
+	uint64_t missed;			// Due while the pending ring was full
+	uint64_t mismatched;		// Replayed requests answered differently
+	uint64_t skipped;			// Captured requests that cannot be replayed
+};
+
+/*
+ * Returns a monotonic time in nanoseconds
+ */
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Appends a request (the expression plus \r\n) to the pool
+ *
+ * return: the new request
+ */
+static struct lg_request * add_request(struct loadgen * lg, const char * expr, size_t len)
+{
+	struct lg_request * req;
+
+	if(lg->num_requests == lg->request_cap)
+	{
+		lg->request_cap = lg->request_cap > 0 ? lg->request_cap * 2 : 1024;
+		lg->requests = realloc(lg->requests, lg->request_cap * sizeof(struct lg_request));
+	}
+	req = lg->requests != NULL ? &lg->requests[lg->num_requests] : NULL;
+	if(req == NULL || (req->text = malloc(len + 2)) == NULL)
+	{
+		perror("Unable to allocate requests");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(req->text, expr, len);
+	memcpy(req->text + len, "\r\n", 2);
+	req->len = len + 2;
+	req->expected = NULL;
+	req->offset = 0;
+	lg->num_requests++;
+	return req;
+}
+
+/*
+ * Reads the non-empty lines of a file into the pool
+ */
+static void load_requests(struct loadgen * lg, const char * path)
+{
+	FILE * file = fopen(path, "r");
+	char * line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+
+	if(file == NULL)
+	{
+		perror("Unable to open expression file");
+		exit(EXIT_FAILURE);
+	}
+	while((len = getline(&line, &line_size, file)) != -1)
+	{
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			len--;
+		if(len > 0)
+			add_request(lg, line, len);
+	}
+	free(line);
+	fclose(file);
+
+	if(lg->num_requests == 0)
+	{
+		printf("The expression file has no expressions.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Decodes a JSON string in place, as written by the server's capture
+ *
+ * str: the character after the opening quote
+ *
+ * return: the decoded length, or -1 if the string does not end
+ */
+static ssize_t json_unescape(char * str)
+{
+	char * in = str, * out = str;
+	unsigned int code;
+
+	for(; *in != '"'; in++)
+	{
+		if(*in == '\0')
+			return -1;
+		if(*in != '\\')
+		{
+			*out++ = *in;
+			continue;
+		}
+		switch(*++in)
+		{
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				if(sscanf(in + 1, "%4x", &code) != 1)
+					return -1;
+				*out++ = code;
+				in += 4;
+				break;
+			case '\0':
+				return -1;
+			default:
+				*out++ = *in;
+		}
+	}
+	return out - str;
+}
+
+/*
+ * Returns the value of a key of a captured line, or NULL if it is absent
+ */
+static char * json_field(char * line, const char * key)
+{
+	char * value = strstr(line, key);
+	return value != NULL ? value + strlen(key) : NULL;
+}
+
+/*
+ * Reads a capture written by calc-server --capture into the pool, in the
+ * order the requests arrived, with the response each one got
+ */
+static void load_capture(struct loadgen * lg, const char * path)
+{
+	FILE * file = fopen(path, "r");
+	struct lg_request * req;
+	char * line = NULL, * expr, * status, * result, * end, * expected;
+	size_t line_size = 0, i, j;
+	ssize_t expr_len;
+	uint64_t first = 0, ts;
+	struct lg_request tmp;
+	bool cut;
+
+	if(file == NULL)
+	{
+		perror("Unable to open capture file");
+		exit(EXIT_FAILURE);
+	}
+	while(getline(&line, &line_size, file) != -1)
+	{
+		expr = json_field(line, "\"expr\":\"");
+		status = json_field(line, "\"status\":\"");
+		result = json_field(line, "\"result\":");
+		cut = json_field(line, "\"result_truncated\":true") != NULL;
+		if(json_field(line, "\"ts_ns\":") == NULL || expr == NULL || status == NULL
+			|| json_field(line, "\"truncated\":true") != NULL)
+		{
+			lg->skipped++;
+			continue;
+		}
+		ts = strtoull(json_field(line, "\"ts_ns\":"), NULL, 10);
+		if((end = strchr(status, '"')) == NULL)
+		{
+			lg->skipped++;
+			continue;
+		}
+		*end = '\0';
+		// An exact result is a string of digits; one cut short cannot be checked
+		expected = NULL;
+		if(strcmp(status, "ok") == 0 && result != NULL && *result == '"')
+		{
+			if(!cut && (end = strchr(result + 1, '"')) != NULL
+				&& asprintf(&expected, "Status: ok\r\nResult: %.*s\r\n", (int)(end - result - 1), result + 1) == -1)
+				expected = NULL;
+		}
+		else if(strcmp(status, "ok") == 0 && result != NULL)
+		{
+			if(asprintf(&expected, "Status: ok\r\nResult: %ld\r\n", strtol(result, NULL, 10)) == -1)
+				expected = NULL;
+		}
+		else if(asprintf(&expected, "Status: %s\r\n", status) == -1)
+			expected = NULL;
+
+		// Decode last; it overwrites the line
+		if((expr_len = json_unescape(expr)) < 0)
+		{
+			free(expected);
+			lg->skipped++;
+			continue;
+		}
+
+		req = add_request(lg, expr, expr_len);
+		req->expected = expected;
+		req->offset = ts;
+		if(lg->num_requests == 1 || ts < first)
+			first = ts;
+	}
+	free(line);
+	fclose(file);
+
+	if(lg->num_requests == 0)
+	{
+		printf("The capture file has no requests.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Threads flush their captures in turns, so lines are only nearly in
+	// order; an insertion sort is quick on that
+	for(i = 0; i < lg->num_requests; i++)
+	{
+		lg->requests[i].offset -= first;
+		tmp = lg->requests[i];
+		for(j = i; j > 0 && lg->requests[j - 1].offset > tmp.offset; j--)
+			lg->requests[j] = lg->requests[j - 1];
+		lg->requests[j] = tmp;
+	}
+}
+
+/*
+ * Fills the pool with random expressions of two to eight terms, some of
+ * them parenthesized. Divisors are non-zero literals, so every generated
+ * expression is valid. The seed is fixed so runs are repeatable.
+ */
+static void generate_requests(struct loadgen * lg)
+{
+	static const char ops[] = "+-*/";
+	char expr[256];
+	int i, t, terms, len;
+	char op;
+
+	srand(3357);
+	for(i = 0; i < POOL_SIZE; i++)
+	{
+		terms = 2 + rand() % 7;
+		len = sprintf(expr, "%d", rand() % 1000);
+		for(t = 1; t < terms; t++)
+		{
+			op = ops[rand() % 4];
+			if(op == '/')
+				len += sprintf(expr + len, "/%d", 1 + rand() % 99);
+			else if(rand() % 4 == 0)
+				len += sprintf(expr + len, "%c(%d+%d)", op, rand() % 1000, rand() % 1000);
+			else
+				len += sprintf(expr + len, "%c%d", op, rand() % 1000);
+		}
+		add_request(lg, expr, len);
+	}
+}
+
+/*
+ * Closes a connection's socket; it is reopened for its next request
+ */
+static void conn_close(struct lg_conn * c)
+{
+	if(c->fd != -1)
+		close(c->fd);
+	c->fd = -1;
+	c->connecting = false;
+}
+
+/*
+ * Marks the request of a connection done and returns it to the idle stack
+ */
+static void conn_finish(struct loadgen * lg, int index)
+{
+	struct lg_conn * c = &lg->conns[index];
+
+	c->busy = false;
+	if(!lg->config->keep_alive)
+		conn_close(c);
+	lg->idle[lg->num_idle++] = index;
+}
+
+static void conn_fail(struct loadgen * lg, int index)
+{
+	lg->failed++;
+	conn_close(&lg->conns[index]);
+	conn_finish(lg, index);
+}
+
+/*
+ * Checks whether the received bytes hold a whole response
+ *
+ * return: 0 if more is needed, 1 for Status: ok, 3 for Status: overloaded,
+ * 2 for any other status
+ */
+static int response_complete(const char * buf, size_t len)
+{
+	const char * end = memmem(buf, len, "\r\n", 2);
+
+	if(end == NULL)
+		return 0;
+	if(end - buf == 10 && memcmp(buf, "Status: ok", 10) == 0)
+		return memmem(end + 2, len - (end + 2 - buf), "\r\n", 2) != NULL ? 1 : 0;
+	if(end - buf == 18 && memcmp(buf, "Status: overloaded", 18) == 0)
+		return 3;
+	return 2;
+}
+
+/*
+ * Compares a replayed request's response with the captured one
+ */
+static void check_response(struct loadgen * lg, struct lg_conn * c)
+{
+	const char * expected = c->req->expected;
+	int len = c->req->len - 2;
+
+	if(strlen(expected) == c->rlen && memcmp(expected, c->rbuf, c->rlen) == 0)
+		return;
+
+	if(lg->mismatched++ < MAX_REPORTED)
+		printf("Mismatch for %.*s%s\nExpected:\n%sGot:\n%.*s\n", len < REPORTED_EXPR ? len : REPORTED_EXPR,
+			c->req->text, len > REPORTED_EXPR ? "..." : "", expected, (int)c->rlen, c->rbuf);
+}
+
+/*
+ * Sends what is left of the request and reads what there is of the answer
+ */
+static void conn_io(struct loadgen * lg, int index)
+{
+	struct lg_conn * c = &lg->conns[index];
+	int error = 0, outcome;
+	socklen_t error_len = sizeof(error);
+	ssize_t n;
+
+	if(!c->busy)
+		return;
+
+	if(c->connecting)
+	{
+		if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+		{
+			if(error == EINPROGRESS)
+				return;
+			conn_fail(lg, index);
+			return;
+		}
+		c->connecting = false;
+	}
+
+	while(c->req_off < c->req->len)
+	{
+		n = send(c->fd, c->req->text + c->req_off, c->req->len - c->req_off, MSG_NOSIGNAL);
+		if(n >= 0)
+			c->req_off += n;
+		else if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+			return;
+		else if(errno != EINTR)
+		{
+			conn_fail(lg, index);
+			return;
+		}
+	}
+
+	while(1)
+	{
+		if(c->rlen == c->rcap)
+		{
+			c->rcap = c->rcap > 0 ? c->rcap * 2 : LG_RBUF_SIZE;
+			if((c->rbuf = realloc(c->rbuf, c->rcap)) == NULL)
+			{
+				perror("Unable to allocate response buffer");
+				exit(EXIT_FAILURE);
+			}
+		}
+		n = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+		if(n > 0)
+		{
+			c->rlen += n;
+			outcome = response_complete(c->rbuf, c->rlen);
+			if(outcome == 0)
+				continue;
+		}
+		else if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		else if(n == -1 && errno == EINTR)
+			continue;
+		else
+			outcome = response_complete(c->rbuf, c->rlen);
+
+		if(outcome == 0)
+		{
+			conn_fail(lg, index);
+			return;
+		}
+
+		histogram_record(&lg->latency, now_ns() - c->due);
+		if(outcome == 1)
+			lg->ok++;
+		else if(outcome == 3)
+			lg->overloaded++;
+		else
+			lg->errors++;
+		if(c->req->expected != NULL)
+			check_response(lg, c);
+		conn_finish(lg, index);
+		return;
+	}
+}
+
+/*
+ * Starts the next request of the pool on an idle connection
+ *
+ * due: when the request was due, which latency is measured from
+ */
+static void conn_start(struct loadgen * lg, int index, uint64_t due)
+{
+	struct lg_conn * c = &lg->conns[index];
+	struct epoll_event event;
+
+	c->busy = true;
+	c->due = due;
+	c->req = &lg->requests[lg->next_request];
+	c->req_off = 0;
+	c->rlen = 0;
+	lg->next_request = (lg->next_request + 1) % lg->num_requests;
+
+	if(c->fd == -1)
+	{
+		c->fd = socket(lg->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if(c->fd == -1)
+		{
+			conn_fail(lg, index);
+			return;
+		}
+		if(connect(c->fd, (struct sockaddr *)&lg->addr, lg->addr_len) == -1 && errno != EINPROGRESS)
+		{
+			conn_fail(lg, index);
+			return;
+		}
+		c->connecting = true;
+
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.u32 = index;
+		if(epoll_ctl(lg->epfd, EPOLL_CTL_ADD, c->fd, &event) == -1)
+		{
+			conn_fail(lg, index);
+			return;
+		}
+	}
+
+	conn_io(lg, index);
+}
+
+/*
+ * Prints the results of the run
+ *
+ * open_loop: whether requests were sent on a schedule rather than as
+ * answers came back
+ */
+static void report(struct loadgen * lg, uint64_t elapsed, bool open_loop)
+{
+	double seconds = (double)elapsed / NS_PER_SEC;
+	uint64_t answered = lg->ok + lg->errors + lg->overloaded;
+
+	printf("Mode: %s loop, %d connections%s\n", open_loop ? "open" : "closed",
+		lg->config->connections, lg->config->keep_alive ? ", keep-alive" : "");
+	if(lg->config->replay_file != NULL && lg->config->speed > 0)
+		printf("Replay: %zu requests at %gx speed\n", lg->num_requests, lg->config->speed);
+	else if(lg->config->replay_file != NULL)
+		printf("Replay: %zu requests as fast as answered\n", lg->num_requests);
+	else if(lg->config->rate > 0)
+		printf("Target rate: %.0f req/s\n", lg->config->rate);
+	printf("Requests: %llu answered (%llu ok, %llu errors, %llu overloaded), %llu failed, %llu missed\n",
+		(unsigned long long)answered, (unsigned long long)lg->ok, (unsigned long long)lg->errors,
+		(unsigned long long)lg->overloaded,
+		(unsigned long long)lg->failed, (unsigned long long)lg->missed);
+	if(lg->config->replay_file != NULL)
+		printf("Responses: %llu differ from the capture, %llu captured requests skipped\n",
+			(unsigned long long)lg->mismatched, (unsigned long long)lg->skipped);
+	printf("Duration: %.3f s\n", seconds);
+	printf("Throughput: %.0f req/s\n", answered / seconds);
+	printf("Latency (us): p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f mean %.1f\n",
+		histogram_percentile(&lg->latency, 50) / 1000.0,
+		histogram_percentile(&lg->latency, 90) / 1000.0,
+		histogram_percentile(&lg->latency, 99) / 1000.0,
+		histogram_percentile(&lg->latency, 99.9) / 1000.0,
+		lg->latency.max / 1000.0,
+		answered > 0 ? (double)lg->latency.sum / answered / 1000.0 : 0.0);
+}
+
+int loadgen_run(struct addrinfo * addr, const struct loadgen_config * config)
+{
+	struct loadgen lg;
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec timeout;
+	uint64_t start, end, now, next_due, stopped = 0, interval = 0, failed;
+	bool replay = config->replay_file != NULL;
+	bool open_loop, generating;
+	size_t i;
+	int num_events, index;
+
+	memset(&lg, 0, sizeof(lg));
+	lg.config = config;
+	memcpy(&lg.addr, addr->ai_addr, addr->ai_addrlen);
+	lg.addr_len = addr->ai_addrlen;
+	freeaddrinfo(addr);
+
+	if(replay)
+		load_capture(&lg, config->replay_file);
+	else if(config->expr_file != NULL)
+		load_requests(&lg, config->expr_file);
+	else
+		generate_requests(&lg);
+
+	lg.conns = calloc(config->connections, sizeof(struct lg_conn));
+	lg.idle = calloc(config->connections, sizeof(int));
+	lg.pending = malloc(MAX_PENDING * sizeof(uint64_t));
+	lg.epfd = epoll_create1(0);
+	if(lg.conns == NULL || lg.idle == NULL || lg.pending == NULL || lg.epfd == -1)
+	{
+		perror("Unable to set up load generator");
+		exit(EXIT_FAILURE);
+	}
+	for(index = config->connections - 1; index >= 0; index--)
+	{
+		lg.conns[index].fd = -1;
+		lg.idle[lg.num_idle++] = index;
+	}
+	histogram_init(&lg.latency);
+
+	if(!replay && config->rate > 0)
+		interval = (uint64_t)(NS_PER_SEC / config->rate);
+	open_loop = replay ? config->speed > 0 : interval > 0;
+	start = now_ns();
+	end = start + (uint64_t)(config->duration * NS_PER_SEC);
+	next_due = start;
+
+	while(1)
+	{
+		now = now_ns();
+
+		// Open loop: requests fall due on schedule whether or not the
+		// server keeps up, and queue until a connection is free. A replay
+		// follows the captured arrival times, scaled by the speed.
+		if(replay && open_loop)
+		{
+			for(; lg.scheduled < lg.num_requests && lg.pending_tail - lg.pending_head < MAX_PENDING; lg.scheduled++)
+			{
+				next_due = start + (uint64_t)(lg.requests[lg.scheduled].offset / config->speed);
+				if(next_due > now)
+					break;
+				lg.pending[lg.pending_tail++ % MAX_PENDING] = next_due;
+			}
+		}
+		else if(open_loop && now < end)
+		{
+			for(; next_due <= now; next_due += interval)
+			{
+				if(lg.pending_tail - lg.pending_head < MAX_PENDING)
+					lg.pending[lg.pending_tail++ % MAX_PENDING] = next_due;
+				else
+					lg.missed++;
+			}
+		}
+
+		// Hand out work to idle connections. A connection whose connect
+		// fails at once goes straight back on the idle stack, so stop at
+		// the first failure rather than retry it on a clock that has not
+		// moved.
+		failed = lg.failed;
+		while(lg.num_idle > 0 && lg.failed == failed)
+		{
+			if(open_loop && lg.pending_head < lg.pending_tail)
+				conn_start(&lg, lg.idle[--lg.num_idle], lg.pending[lg.pending_head++ % MAX_PENDING]);
+			else if(!open_loop && (replay ? lg.scheduled < lg.num_requests : now < end))
+			{
+				lg.scheduled++;
+				conn_start(&lg, lg.idle[--lg.num_idle], now);
+			}
+			else
+				break;
+		}
+
+		// Wait for what is in flight, but not forever
+		generating = replay ? lg.scheduled < lg.num_requests || lg.pending_head < lg.pending_tail : now < end;
+		if(!generating && stopped == 0)
+			stopped = now;
+		if(!generating && (lg.num_idle == config->connections || now >= stopped + DRAIN_NS))
+			break;
+
+		// Wake up in time for the next due request; a millisecond timeout
+		// would make every open loop request late
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = 100000000;
+		if(open_loop && (replay ? lg.scheduled < lg.num_requests : now < end))
+			timeout.tv_nsec = next_due > now ? (long)(next_due - now < 100000000 ? next_due - now : 100000000) : 0;
+
+		num_events = epoll_pwait2(lg.epfd, events, MAX_EVENTS, &timeout, NULL);
+		if(num_events == -1 && errno != EINTR)
+		{
+			perror("Unable to wait for events");
+			exit(EXIT_FAILURE);
+		}
+		for(i = 0; i < (size_t)(num_events > 0 ? num_events : 0); i++)
+			conn_io(&lg, events[i].data.u32);
+	}
+
+	// Requests still unanswered after the drain period count as failed
+	for(i = 0; i < (size_t)config->connections; i++)
+	{
+		if(lg.conns[i].busy)
+			lg.failed++;
+		conn_close(&lg.conns[i]);
+		free(lg.conns[i].rbuf);
+	}
+	lg.missed += lg.pending_tail - lg.pending_head;
+
+	report(&lg, now_ns() - start, open_loop);
+
+	for(i = 0; i < lg.num_requests; i++)
+	{
+		free(lg.requests[i].text);
+		free(lg.requests[i].expected);
+	}
+	free(lg.requests);
+	free(lg.conns);
+	free(lg.idle);
+	free(lg.pending);
+	close(lg.epfd);
+
+	return lg.failed == 0 && lg.missed == 0 && lg.mismatched == 0 ? 0 : 1;
+}
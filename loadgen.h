@@ -0,0 +1,50 @@
+/********************************************************************************
+ * loadgen.h
+ *
+ * Computer Science 3357a
+ * Load Generator
+ *
+ * Author: Duncan Cai
+ *
+ * Drives many CTP connections against a server and reports throughput and
+ * latency percentiles, either with generated load or by replaying a capture
+*******************************************************************************/
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdbool.h>
+#include <netdb.h>
+
+//What load to generate
+struct loadgen_config
+{
+	int connections;			// Connections open at once
+	double rate;				// Requests per second (open loop), or 0 for closed loop
+	double duration;			// Seconds to generate load for
+	const char * expr_file;		// One expression per line, or NULL to generate them
+	bool keep_alive;			// Reuse connections (the server must run with --keep-alive)
+	const char * replay_file;	// Capture from calc-server --capture to replay, or NULL
+	double speed;				// Replay at this multiple of the captured pace, or 0 for closed loop
+};
+
+/*
+ * Generates load against the server and prints a report to stdout
+ *
+ * In closed loop every connection sends its next request as soon as the
+ * previous one is answered. In open loop requests are started at a fixed
+ * rate whatever the server does, and latency is measured from when each
+ * request was due, so queueing behind a slow server is counted.
+ *
+ * A replay sends every captured request once, in open loop at the
+ * captured times (scaled by the speed), and checks each response against
+ * the captured one. The duration and rate are then ignored.
+ *
+ * addr: address of the server; freed by this function
+ * config: the load to generate
+ *
+ * return: 0 if every request was answered (as captured, when replaying), 1 otherwise
+ */
+int loadgen_run(struct addrinfo * addr, const struct loadgen_config * config);
+
+#endif
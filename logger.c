@@ -0,0 +1,449 @@
+/********************************************************************************
+ * logger.c
+ *
+ * Computer Science 3357a
+ * Asynchronous Request Log
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of per-thread single-producer/single-consumer rings that a
+ * background thread drains into syslog. A full ring drops the record and
+ * counts it rather than making the serving thread wait.
+*******************************************************************************/
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "logger.h"
+#include "ctp.h"
+
+#define CACHE_LINE 64
+#define IDLE_SLEEP_NS 1000000	// How long the flusher sleeps when every ring is empty
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+//The ring of one producing thread
+struct log_ring
+{
+	_Atomic uint64_t head;								// Next record to write; producer only
+	_Alignas(CACHE_LINE) _Atomic uint64_t tail;			// Next record to flush; flusher only
+	_Alignas(CACHE_LINE) _Atomic uint64_t dropped;
+	struct log_ring * next;								// Next ring in the registry
+	_Alignas(CACHE_LINE) struct log_record records[LOG_RING_SIZE];
+};
+
+// Every ring ever created; rings are only ever added
+static _Atomic(struct log_ring *) rings = NULL;
+static __thread struct log_ring * thread_ring = NULL;
+static bool started = false;
+static FILE * capture_file = NULL;
+
+/*
+ * Returns the current time in nanoseconds since the epoch
+ */
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Formats a record to syslog
+ */
+static void log_format(const struct log_record * rec)
+{
+	char ip_address[INET_ADDRSTRLEN];
+	struct in_addr addr;
+
+	switch(rec->type)
+	{
+		case LOGREC_CLIENT:
+			addr.s_addr = rec->value;
+			inet_ntop(AF_INET, &addr, ip_address, sizeof(ip_address));
+			syslog(LOG_INFO, "Request received from client %s", ip_address);
+			break;
+		case LOGREC_EXPR:
+			syslog(LOG_INFO, "Expression was: %.*s%s", rec->len, rec->text, rec->truncated ? "..." : "");
+			break;
+		case LOGREC_STATUS:
+			if(rec->value == OK && rec->len > 0)
+				syslog(LOG_INFO, "Status: ok, result: %.*s%s", rec->len, rec->text, rec->truncated ? "..." : "");
+			else if(rec->value == OK)
+				syslog(LOG_INFO, "Status: ok, result: %" PRId64, rec->result);
+			else
+				syslog(LOG_INFO, "Status: %s", status_code_to_str(rec->value));
+			break;
+	}
+}
+
+/*
+ * Writes text as the inside of a JSON string
+ */
+static void capture_escape(const char * text, size_t len)
+{
+	unsigned char c;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+	{
+		c = text[i];
+		if(c == '"' || c == '\\')
+			fprintf(capture_file, "\\%c", c);
+		else if(c < 0x20 || c >= 0x7f)
+			fprintf(capture_file, "\\u%04x", c);
+		else
+			putc(c, capture_file);
+	}
+}
+
+/*
+ * Writes the bytes from start to end of the text a capture record and the
+ * records that follow it carry, as the inside of a JSON string
+ */
+static void capture_escape_range(struct log_ring * ring, uint64_t first, size_t used, size_t start, size_t end)
+{
+	size_t offset = 0, from, to, i;
+
+	for(i = 0; i < used; i++)
+	{
+		const struct log_record * part = &ring->records[(first + i) & (LOG_RING_SIZE - 1)];
+		from = start > offset ? start - offset : 0;
+		to = end - offset < part->len ? end - offset : part->len;
+		if(from < to)
+			capture_escape(part->text + from, to - from);
+		offset += part->len;
+		if(offset >= end)
+			break;
+	}
+}
+
+/*
+ * Writes a capture record, and the text records that follow it, as one
+ * line of the capture file
+ *
+ * return: the number of records used
+ */
+static size_t capture_format(struct log_ring * ring, uint64_t first)
+{
+	const struct log_record * rec = &ring->records[first & (LOG_RING_SIZE - 1)];
+	size_t used = 1 + rec->slots, total = 0, i;
+
+	for(i = 0; i < used; i++)
+		total += ring->records[(first + i) & (LOG_RING_SIZE - 1)].len;
+
+	fprintf(capture_file, "{\"ts_ns\":%llu,\"expr\":\"", (unsigned long long)rec->timestamp);
+	if(rec->type == LOGREC_CAPTURE_EXACT)
+	{
+		// The expression, then as much of the result as fit
+		capture_escape_range(ring, first, used, 0, rec->result);
+		fprintf(capture_file, "\",\"status\":\"ok\",\"result\":\"");
+		capture_escape_range(ring, first, used, rec->result, total);
+		fprintf(capture_file, "\"");
+		if(total - rec->result < (size_t)rec->value)
+			fprintf(capture_file, ",\"result_truncated\":true");
+	}
+	else
+	{
+		capture_escape_range(ring, first, used, 0, total);
+		fprintf(capture_file, "\",\"status\":\"%s\"", status_code_to_str(rec->value));
+		if(rec->value == OK)
+			fprintf(capture_file, ",\"result\":%" PRId64, rec->result);
+	}
+	if(rec->truncated)
+		fprintf(capture_file, ",\"truncated\":true");
+	fprintf(capture_file, "}\n");
+	return used;
+}
+
+/*
+ * Returns the calling thread's ring, creating and registering it on the
+ * thread's first record
+ */
+static struct log_ring * log_ring_get()
+{
+	struct log_ring * ring = thread_ring;
+
+	if(ring != NULL)
+		return ring;
+
+	ring = aligned_alloc(CACHE_LINE, sizeof(struct log_ring));
+	if(ring == NULL)
+		return NULL;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->dropped, 0);
+
+	// Push onto the registry without a lock
+	ring->next = atomic_load(&rings);
+	while(!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+		;
+	thread_ring = ring;
+	return ring;
+}
+
+/*
+ * Reserves the slots for the calling thread's next records, all or none
+ * (counting a drop) if its ring is too full. log_commit publishes them.
+ *
+ * count: the number of consecutive slots
+ * head_out: set to the position of the first slot
+ *
+ * return: the calling thread's ring, or NULL if nothing was reserved
+ */
+static struct log_ring * log_reserve(size_t count, uint64_t * head_out)
+{
+	struct log_ring * ring = log_ring_get();
+	uint64_t head, tail;
+
+	if(ring == NULL)
+		return NULL;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if(head - tail + count > LOG_RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	*head_out = head;
+	return ring;
+}
+
+static void log_commit(struct log_ring * ring, size_t count)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + count, memory_order_release);
+}
+
+/*
+ * Writes a record: into the thread's ring once the flusher runs,
+ * straight to syslog before that
+ */
+static void log_write(uint8_t type, int32_t value, int64_t result, const char * text, size_t len)
+{
+	struct log_record local;
+	struct log_record * rec = &local;
+	struct log_ring * ring = NULL;
+	uint64_t head;
+
+	if(started)
+	{
+		if((ring = log_reserve(1, &head)) == NULL)
+			return;
+		rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+	}
+
+	rec->type = type;
+	rec->value = value;
+	rec->result = result;
+	rec->timestamp = now_ns();
+	rec->truncated = len > LOG_TEXT_SIZE;
+	rec->len = rec->truncated ? LOG_TEXT_SIZE : len;
+	if(rec->len > 0)
+		memcpy(rec->text, text, rec->len);
+
+	if(ring != NULL)
+		log_commit(ring, 1);
+	else
+		log_format(rec);
+}
+
+/*
+ * Flushes the published records of a ring
+ *
+ * return: the number of records flushed
+ */
+static size_t log_ring_drain(struct log_ring * ring)
+{
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t count = head - tail;
+
+	while(tail != head)
+	{
+		// A capture record and its text are always published together
+		if(ring->records[tail & (LOG_RING_SIZE - 1)].type == LOGREC_CAPTURE
+			|| ring->records[tail & (LOG_RING_SIZE - 1)].type == LOGREC_CAPTURE_EXACT)
+			tail += capture_format(ring, tail);
+		else
+			log_format(&ring->records[tail++ & (LOG_RING_SIZE - 1)]);
+		// Hand the slot back straight away so the producer sees room sooner
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+	return count;
+}
+
+/*
+ * Entry point of the flusher thread
+ */
+static void * logger_main(void * arg)
+{
+	struct timespec idle = { 0, IDLE_SLEEP_NS };
+	struct log_ring * ring;
+	uint64_t reported = 0, dropped;
+	size_t flushed;
+
+	while(1)
+	{
+		flushed = 0;
+		for(ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+			flushed += log_ring_drain(ring);
+
+		dropped = logger_dropped();
+		if(dropped != reported)
+		{
+			syslog(LOG_WARNING, "%llu log records dropped", (unsigned long long)(dropped - reported));
+			reported = dropped;
+		}
+
+		if(flushed == 0)
+		{
+			// Nothing is left for now; put the captured lines on disk
+			if(capture_file != NULL)
+				fflush(capture_file);
+			nanosleep(&idle, NULL);
+		}
+	}
+	return NULL;
+}
+
+void logger_start()
+{
+	pthread_t thread;
+
+	if(pthread_create(&thread, NULL, logger_main, NULL) != 0)
+	{
+		perror("Unable to start logger");
+		exit(EXIT_FAILURE);
+	}
+	pthread_detach(thread);
+	started = true;
+}
+
+void logger_client(uint32_t addr)
+{
+	log_write(LOGREC_CLIENT, addr, 0, NULL, 0);
+}
+
+void logger_expression(const char * expr, size_t len)
+{
+	log_write(LOGREC_EXPR, 0, 0, expr, len);
+}
+
+void logger_status(int status_code, int64_t result)
+{
+	log_write(LOGREC_STATUS, status_code, result, NULL, 0);
+}
+
+void logger_status_digits(const char * digits, size_t len)
+{
+	log_write(LOGREC_STATUS, OK, 0, digits, len);
+}
+
+bool logger_capture_open(const char * path)
+{
+	capture_file = fopen(path, "w");
+	if(capture_file == NULL)
+		return false;
+	setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+	return true;
+}
+
+bool logger_capturing()
+{
+	return capture_file != NULL && started;
+}
+
+uint64_t logger_clock()
+{
+	return now_ns();
+}
+
+/*
+ * Writes a capture record and the text records that follow it, whose text
+ * is the expression and then the exact result, if any
+ *
+ * type: LOGREC_CAPTURE, or LOGREC_CAPTURE_EXACT if there are digits
+ * value: the status code, or for LOGREC_CAPTURE_EXACT the length of the result
+ * result: the result, or for LOGREC_CAPTURE_EXACT set to the bytes of
+ * expression kept
+ */
+static void capture_write(int type, const char * expr, size_t len, const char * digits, size_t digits_len,
+	uint64_t arrival, int32_t value, int64_t result)
+{
+	struct log_ring * ring;
+	struct log_record * rec;
+	uint64_t head;
+	size_t total, slots, chunk, offset, i;
+	bool truncated = len > LOG_CAPTURE_SLOTS * LOG_TEXT_SIZE;
+
+	if(!logger_capturing())
+		return;
+
+	if(truncated)
+		len = LOG_CAPTURE_SLOTS * LOG_TEXT_SIZE;
+	if(digits_len > LOG_CAPTURE_SLOTS * LOG_TEXT_SIZE - len)
+		digits_len = LOG_CAPTURE_SLOTS * LOG_TEXT_SIZE - len;
+	total = len + digits_len;
+	slots = total > 0 ? (total + LOG_TEXT_SIZE - 1) / LOG_TEXT_SIZE : 1;
+	if((ring = log_reserve(slots, &head)) == NULL)
+		return;
+
+	for(i = 0; i < slots; i++)
+	{
+		rec = &ring->records[(head + i) & (LOG_RING_SIZE - 1)];
+		offset = i * LOG_TEXT_SIZE;
+		chunk = total - offset < LOG_TEXT_SIZE ? total - offset : LOG_TEXT_SIZE;
+		rec->type = i == 0 ? type : LOGREC_TEXT;
+		rec->truncated = truncated;
+		rec->len = chunk;
+		rec->slots = slots - 1 - i;
+
+		// The chunk may straddle the end of the expression
+		if(offset < len)
+		{
+			memcpy(rec->text, expr + offset, offset + chunk <= len ? chunk : len - offset);
+			if(offset + chunk > len)
+				memcpy(rec->text + (len - offset), digits, offset + chunk - len);
+		}
+		else
+			memcpy(rec->text, digits + (offset - len), chunk);
+	}
+
+	rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+	rec->value = value;
+	rec->result = type == LOGREC_CAPTURE_EXACT ? (int64_t)len : result;
+	rec->timestamp = arrival;
+	log_commit(ring, slots);
+}
+
+void logger_capture(const char * expr, size_t len, uint64_t arrival, int status_code, int64_t result)
+{
+	capture_write(LOGREC_CAPTURE, expr, len, NULL, 0, arrival, status_code, result);
+}
+
+void logger_capture_digits(const char * expr, size_t len, uint64_t arrival, const char * digits, size_t digits_len)
+{
+	capture_write(LOGREC_CAPTURE_EXACT, expr, len, digits, digits_len, arrival, (int32_t)digits_len, 0);
+}
+
+uint64_t logger_dropped()
+{
+	struct log_ring * ring;
+	uint64_t dropped = 0;
+
+	for(ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	return dropped;
+}
@@ -0,0 +1,138 @@
+/********************************************************************************
+ * logger.h
+ *
+ * Computer Science 3357a
+ * Asynchronous Request Log
+ *
+ * Author: Duncan Cai
+ *
+ * Request/response logging that never blocks the serving threads. Each
+ * thread writes fixed-size binary records into its own lock-free ring and a
+ * background thread formats them to syslog, and to the capture file if
+ * requests are being captured.
+*******************************************************************************/
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING_SIZE 4096		// Records per thread; must be a power of two
+#define LOG_TEXT_SIZE 96		// Expression bytes kept per record
+#define LOG_CAPTURE_SLOTS 64	// Most records one captured request may span
+
+//Kinds of log record
+#define LOGREC_CLIENT 1		// A client connected
+#define LOGREC_EXPR 2		// The expression of a request
+#define LOGREC_STATUS 3		// The status (and result) of a request, the result as text if exact
+#define LOGREC_CAPTURE 4	// A whole request for the capture file
+#define LOGREC_TEXT 5		// More text of the capture record before it
+#define LOGREC_CAPTURE_EXACT 6	// A whole request whose exact result follows its expression
+
+//A log record, formatted later by the background thread
+struct log_record
+{
+	uint8_t type;
+	uint8_t truncated;		// Text was cut to LOG_TEXT_SIZE bytes
+	uint16_t len;			// Bytes of text
+	int32_t value;			// Status code, client IPv4 address, or length of an exact result
+	uint32_t slots;			// LOGREC_TEXT records that follow this one
+	int64_t result;			// Result of a successful request, or bytes of expression before an exact result
+	uint64_t timestamp;		// Nanoseconds since the epoch
+	char text[LOG_TEXT_SIZE];
+};
+
+/*
+ * Starts the background thread that flushes the rings to syslog
+ * Until it is started, records are written to syslog directly
+ */
+void logger_start();
+
+/*
+ * Logs that a client connected
+ *
+ * addr: client IPv4 address in network byte order
+ */
+void logger_client(uint32_t addr);
+
+/*
+ * Logs the expression of a request
+ *
+ * expr: the expression (need not be terminated)
+ * len: length of the expression
+ */
+void logger_expression(const char * expr, size_t len);
+
+/*
+ * Logs the outcome of a request
+ *
+ * status_code: the status of the request
+ * result: the result, meaningful only if status_code is OK
+ */
+void logger_status(int status_code, int64_t result);
+
+/*
+ * Logs the success of a request whose exact result does not fit in 64
+ * bits; only the first LOG_TEXT_SIZE digits are kept
+ *
+ * digits: the result in decimal (need not be terminated)
+ * len: length of the result
+ */
+void logger_status_digits(const char * digits, size_t len);
+
+/*
+ * Starts capturing every request that reaches the parser to a file, one
+ * JSON object per line, written by the background thread
+ * Must be called before logger_start
+ *
+ * path: the capture file, which is truncated
+ *
+ * return: true if the file could be opened
+ */
+bool logger_capture_open(const char * path);
+
+/*
+ * Returns whether requests are being captured
+ */
+bool logger_capturing();
+
+/*
+ * Returns the current time in nanoseconds since the epoch
+ */
+uint64_t logger_clock();
+
+/*
+ * Captures a request and its outcome. Expressions longer than one record
+ * are carried by the records that follow it, up to LOG_CAPTURE_SLOTS.
+ *
+ * expr: the expression (need not be terminated)
+ * len: length of the expression
+ * arrival: when the request was received, from logger_clock
+ * status_code: the status of the request
+ * result: the result, meaningful only if status_code is OK
+ */
+void logger_capture(const char * expr, size_t len, uint64_t arrival, int status_code, int64_t result);
+
+/*
+ * Captures a successful request whose exact result does not fit in 64
+ * bits; the result is written as a JSON string. It shares the records with
+ * the expression, and what does not fit in them is cut and marked so.
+ *
+ * expr: the expression (need not be terminated)
+ * len: length of the expression
+ * arrival: when the request was received, from logger_clock
+ * digits: the result in decimal (need not be terminated)
+ * digits_len: length of the result
+ */
+void logger_capture_digits(const char * expr, size_t len, uint64_t arrival, const char * digits, size_t digits_len);
+
+/*
+ * Returns the number of records dropped because a ring was full
+ *
+ * return: the number of dropped records
+ */
+uint64_t logger_dropped();
+
+#endif
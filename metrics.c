@@ -0,0 +1,263 @@
+/********************************************************************************
+ * metrics.c
+ *
+ * Computer Science 3357a
+ * Runtime Metrics
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the metrics. Each thread owns a block of counters that
+ * only it writes, using relaxed atomic loads and stores (plain moves on
+ * x86), and a scrape only ever reads them. Blocks are registered in a
+ * lock-free list like the logger's rings.
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "histogram.h"
+#include "ctp.h"
+
+#define CACHE_LINE 64
+
+//The counters of one thread
+struct metrics_block
+{
+	_Atomic uint64_t stages[METRIC_STAGES][HIST_BUCKETS];
+	_Atomic uint64_t stage_sum[METRIC_STAGES];		// Nanoseconds
+	_Atomic uint64_t stage_max[METRIC_STAGES];
+	_Atomic uint64_t statuses[METRICS_MAX_STATUS];
+	_Atomic uint64_t opened;
+	_Atomic uint64_t closed;
+	_Atomic uint64_t dropped[METRIC_DROP_REASONS];
+	_Atomic int64_t ready;
+	struct metrics_block * next;					// Next block in the registry
+};
+
+// Upper bounds of the exported histogram buckets, in nanoseconds
+static const uint64_t bounds[] =
+{
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000,
+	500000000, 1000000000
+};
+
+static const char * stage_names[METRIC_STAGES] = { "accept", "recv", "parse", "eval", "send" };
+static const char * drop_names[METRIC_DROP_REASONS] = { "timeout", "per-ip-limit" };
+
+// Names of the status codes a response can have; codes without one are not exported
+static const char * status_names[METRICS_MAX_STATUS] =
+{
+	[OK] = "ok", [MISMATCH] = "mismatch", [INVALID_EXPR] = "invalid-expr",
+	[MAX_LENGTH_EXCEEDED] = "max-length-exceeded", [MALFORMED_REQ] = "malformed-req",
+	[OVERLOADED] = "overloaded", [OVERFLOW] = "overflow",
+};
+
+bool metrics_enabled = false;
+
+// Every block ever created; blocks are only ever added
+static _Atomic(struct metrics_block *) blocks = NULL;
+static __thread struct metrics_block * thread_block = NULL;
+
+/*
+ * Returns the calling thread's block, creating and registering it on the
+ * thread's first update
+ */
+static struct metrics_block * metrics_block_get()
+{
+	struct metrics_block * block = thread_block;
+
+	if(block != NULL)
+		return block;
+
+	block = aligned_alloc(CACHE_LINE, sizeof(struct metrics_block));
+	if(block == NULL)
+		return NULL;
+	memset(block, 0, sizeof(struct metrics_block));
+
+	block->next = atomic_load(&blocks);
+	while(!atomic_compare_exchange_weak(&blocks, &block->next, block))
+		;
+	thread_block = block;
+	return block;
+}
+
+/*
+ * Adds to a counter that only the calling thread writes
+ */
+static inline void counter_add(_Atomic uint64_t * counter, uint64_t n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline uint64_t counter_get(_Atomic uint64_t * counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+uint64_t metrics_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t metrics_stage(int stage, uint64_t start)
+{
+	struct metrics_block * block;
+	uint64_t now, elapsed;
+
+	if(start == 0 || (block = metrics_block_get()) == NULL)
+		return 0;
+
+	now = metrics_clock();
+	elapsed = now - start;
+	counter_add(&block->stages[stage][histogram_bucket(elapsed)], 1);
+	counter_add(&block->stage_sum[stage], elapsed);
+	if(elapsed > counter_get(&block->stage_max[stage]))
+		atomic_store_explicit(&block->stage_max[stage], elapsed, memory_order_relaxed);
+	return now;
+}
+
+void metrics_status(int status_code)
+{
+	struct metrics_block * block;
+
+	if(!metrics_enabled || status_code < 0 || status_code >= METRICS_MAX_STATUS)
+		return;
+	if((block = metrics_block_get()) != NULL)
+		counter_add(&block->statuses[status_code], 1);
+}
+
+void metrics_connection_opened()
+{
+	struct metrics_block * block;
+
+	if(metrics_enabled && (block = metrics_block_get()) != NULL)
+		counter_add(&block->opened, 1);
+}
+
+void metrics_connection_closed()
+{
+	struct metrics_block * block;
+
+	if(metrics_enabled && (block = metrics_block_get()) != NULL)
+		counter_add(&block->closed, 1);
+}
+
+void metrics_connection_dropped(int reason)
+{
+	struct metrics_block * block;
+
+	if(metrics_enabled && (block = metrics_block_get()) != NULL)
+		counter_add(&block->dropped[reason], 1);
+}
+
+void metrics_ready(int depth)
+{
+	struct metrics_block * block;
+
+	if(metrics_enabled && (block = metrics_block_get()) != NULL)
+		atomic_store_explicit(&block->ready, depth, memory_order_relaxed);
+}
+
+/*
+ * Writes one stage's histogram, its buckets cumulative as Prometheus wants
+ */
+static void format_stage(FILE * out, const char * stage, const struct histogram * h)
+{
+	uint64_t seen = 0;
+	size_t b;
+	int i = 0;
+
+	// A bucket is only counted under a bound it lies wholly below
+	for(b = 0; b < sizeof(bounds) / sizeof(bounds[0]); b++)
+	{
+		for(; i < HIST_BUCKETS && histogram_bucket_max(i) <= bounds[b]; i++)
+			seen += h->counts[i];
+		fprintf(out, "calc_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+			stage, bounds[b] / 1e9, (unsigned long long)seen);
+	}
+	fprintf(out, "calc_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+		stage, (unsigned long long)h->total);
+	fprintf(out, "calc_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage, h->sum / 1e9);
+	fprintf(out, "calc_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stage, (unsigned long long)h->total);
+}
+
+void metrics_format(FILE * out)
+{
+	struct histogram * stages = malloc(METRIC_STAGES * sizeof(struct histogram));
+	uint64_t statuses[METRICS_MAX_STATUS] = { 0 };
+	uint64_t dropped[METRIC_DROP_REASONS] = { 0 };
+	uint64_t opened = 0, closed = 0, count;
+	int64_t ready = 0;
+	struct metrics_block * block;
+	int s, i;
+
+	if(stages == NULL)
+		return;
+	for(s = 0; s < METRIC_STAGES; s++)
+		histogram_init(&stages[s]);
+
+	// Add up the blocks; each read may be a moment stale, never torn
+	for(block = atomic_load(&blocks); block != NULL; block = block->next)
+	{
+		for(s = 0; s < METRIC_STAGES; s++)
+		{
+			for(i = 0; i < HIST_BUCKETS; i++)
+			{
+				count = counter_get(&block->stages[s][i]);
+				stages[s].counts[i] += count;
+				stages[s].total += count;
+			}
+			stages[s].sum += counter_get(&block->stage_sum[s]);
+			if(counter_get(&block->stage_max[s]) > stages[s].max)
+				stages[s].max = counter_get(&block->stage_max[s]);
+		}
+		for(i = 0; i < METRICS_MAX_STATUS; i++)
+			statuses[i] += counter_get(&block->statuses[i]);
+		opened += counter_get(&block->opened);
+		closed += counter_get(&block->closed);
+		for(i = 0; i < METRIC_DROP_REASONS; i++)
+			dropped[i] += counter_get(&block->dropped[i]);
+		ready += atomic_load_explicit(&block->ready, memory_order_relaxed);
+	}
+
+	fprintf(out, "# HELP calc_requests_total Requests answered, by response status.\n");
+	fprintf(out, "# TYPE calc_requests_total counter\n");
+	for(i = 0; i < METRICS_MAX_STATUS; i++)
+	{
+		if(status_names[i] != NULL && (i == OK || statuses[i] > 0))
+			fprintf(out, "calc_requests_total{status=\"%s\"} %llu\n", status_names[i], (unsigned long long)statuses[i]);
+	}
+
+	fprintf(out, "# HELP calc_connections_accepted_total Connections accepted.\n");
+	fprintf(out, "# TYPE calc_connections_accepted_total counter\n");
+	fprintf(out, "calc_connections_accepted_total %llu\n", (unsigned long long)opened);
+	fprintf(out, "# HELP calc_connections_active Connections currently open.\n");
+	fprintf(out, "# TYPE calc_connections_active gauge\n");
+	fprintf(out, "calc_connections_active %lld\n", (long long)(opened - closed));
+	fprintf(out, "# HELP calc_connections_dropped_total Connections dropped by the server, by reason.\n");
+	fprintf(out, "# TYPE calc_connections_dropped_total counter\n");
+	for(i = 0; i < METRIC_DROP_REASONS; i++)
+		fprintf(out, "calc_connections_dropped_total{reason=\"%s\"} %llu\n", drop_names[i], (unsigned long long)dropped[i]);
+	fprintf(out, "# HELP calc_ready_queue_depth Ready connections not yet served in the current event batches.\n");
+	fprintf(out, "# TYPE calc_ready_queue_depth gauge\n");
+	fprintf(out, "calc_ready_queue_depth %lld\n", (long long)ready);
+
+	fprintf(out, "# HELP calc_stage_duration_seconds Time spent in each stage of serving requests.\n");
+	fprintf(out, "# TYPE calc_stage_duration_seconds histogram\n");
+	for(s = 0; s < METRIC_STAGES; s++)
+		format_stage(out, stage_names[s], &stages[s]);
+
+	fprintf(out, "# HELP calc_stage_duration_max_seconds Longest time spent in each stage.\n");
+	fprintf(out, "# TYPE calc_stage_duration_max_seconds gauge\n");
+	for(s = 0; s < METRIC_STAGES; s++)
+		fprintf(out, "calc_stage_duration_max_seconds{stage=\"%s\"} %.9f\n", stage_names[s], stages[s].max / 1e9);
+
+	free(stages);
+}
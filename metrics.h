@@ -0,0 +1,92 @@
+/********************************************************************************
+ * metrics.h
+ *
+ * Computer Science 3357a
+ * Runtime Metrics
+ *
+ * Author: Duncan Cai
+ *
+ * Counters and per-stage latency histograms of the server. Every thread
+ * updates its own block of counters without locks or shared cache lines;
+ * a scrape adds the blocks up and formats them for Prometheus.
+*******************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//Stages of serving a request that are timed
+#define METRIC_ACCEPT 0		// A non-blocking accept
+#define METRIC_RECV 1		// A recv that returned data or end of file
+#define METRIC_PARSE 2		// Compiling an expression
+#define METRIC_EVAL 3		// Running the compiled expression
+#define METRIC_SEND 4		// A send
+#define METRIC_STAGES 5
+
+#define METRICS_MAX_STATUS 16	// Status codes counted are below this
+
+//Reasons a connection is dropped by the server
+#define METRIC_DROP_TIMEOUT 0	// A read, write or idle timeout expired
+#define METRIC_DROP_LIMIT 1		// Its client already had too many connections
+#define METRIC_DROP_REASONS 2
+
+// Set at startup to turn metrics on
+extern bool metrics_enabled;
+
+// Start time of a stage, or 0 while metrics are off
+#define METRICS_START() (__builtin_expect(metrics_enabled, false) ? metrics_clock() : 0)
+
+/*
+ * Returns a monotonic time in nanoseconds
+ */
+uint64_t metrics_clock();
+
+/*
+ * Records how long a stage took
+ *
+ * stage: one of the METRIC_ stages
+ * start: what METRICS_START() returned when the stage began
+ *
+ * return: the current time, to start the next stage with, or 0 if start was 0
+ */
+uint64_t metrics_stage(int stage, uint64_t start);
+
+/*
+ * Counts an answered request
+ *
+ * status_code: the status of the response
+ */
+void metrics_status(int status_code);
+
+/*
+ * Counts a connection opened or closed by the calling thread
+ */
+void metrics_connection_opened();
+void metrics_connection_closed();
+
+/*
+ * Counts a connection the calling thread dropped
+ *
+ * reason: one of the METRIC_DROP_ reasons
+ */
+void metrics_connection_dropped(int reason);
+
+/*
+ * Sets the number of connections the calling thread has yet to serve in
+ * its current batch of ready events
+ *
+ * depth: the number of connections
+ */
+void metrics_ready(int depth);
+
+/*
+ * Writes every metric in the Prometheus text exposition format
+ *
+ * out: the stream to write to
+ */
+void metrics_format(FILE * out);
+
+#endif
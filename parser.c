@@ -7,14 +7,27 @@
  * Author: Duncan Cai
  * 
  * Implementation of expression parser using shunting yard algorithm.
+ * Expressions are compiled to postfix bytecode, which is then run. The
+ * precedence climbing engine in climb.c can be chosen to compile instead;
+ * the shunting yard still compiles whatever it rejects. Long expressions
+ * that are mostly whitespace are tokenized first (see token.h) so the
+ * shunting yard can jump over the whitespace, or reject an invalid
+ * character without walking up to it.
 *******************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <syslog.h>
 #include "parser.h"
+#include "bignum.h"
+#include "climb.h"
+#include "dag.h"
+#include "token.h"
 #include "stack.h"
+#include "trace.h"
+#include "metrics.h"
 
 #define UNARY_MIN	'~'
 
@@ -24,6 +37,15 @@
 #define IS_LEFT_P	3
 #define IS_RIGHT_P 4
 
+int _compile_expr(stack * ops_stk, const char * expr, program * prog);
+
+// Storage kept by each thread between calls when stack reuse is on
+static __thread stack * thread_ops_stk = NULL;
+static __thread program * thread_prog = NULL;
+static __thread struct token_index thread_tokens;	// Index of this thread's last long expression
+static bool reuse_stacks = true;
+static int parser_engine = PARSER_SHUNTING_YARD;
+
 /*
  * Returns true if given char is a digit
  */
@@ -32,6 +54,14 @@ bool is_num(char c)
 	return c >= '0' && c <= '9';
 }
 
+/*
+ * Returns true if given char can start a variable name
+ */
+bool is_alpha(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
 /*
  * Returns true if given char is an operator
  */
@@ -53,16 +83,16 @@ int precedence(char c)
 }
 
 /*
- * Inspects operator and performs the operation on the operand stack
+ * Inspects operator and emits the operation into the program
  *
- * num_stk: the operand stack
+ * prog: the program being compiled
+ * depth: the operand stack depth at this point of the program
  * op: the operator
  *
  * returns: status code indicating any errors; if OK, then no errors
  * otherwise, describes the error
  */
-int operate(stack * num_stk, char op) {
-	int a, b;
+int emit_operator(program * prog, size_t * depth, char op) {
 	//The given operator is not valid
 	if(!is_op(op))
 	{
@@ -71,9 +101,10 @@ int operate(stack * num_stk, char op) {
 	// The given operator is unary
 	else if(op == UNARY_MIN)
 	{
-		if(stack_size(num_stk) > 0)
+		if(*depth > 0)
 		{
-			stack_push(num_stk, -stack_pop(num_stk));
+			TRACE("emit %c", op);
+			program_emit(prog, OP_NEG);
 			return OK;
 		}
 		else
@@ -83,48 +114,114 @@ int operate(stack * num_stk, char op) {
 		}
 	}
 	// If not unary, operand stack must have at least two elements
-	else if(stack_size(num_stk) >= 2)
-	{
-		b = stack_pop(num_stk);
-		a = stack_pop(num_stk);
-	}
-	else
+	else if(*depth < 2)
 	{
 		syslog(LOG_ERR, "Insufficient elements in operand stack");
 		return INVALID_EXPR;
 	}
-	int result;
-	syslog(LOG_DEBUG, "eval %d %c %d\n", a, op, b);
+
+	TRACE("emit %c", op);
 	switch(op)
 	{
 		case '+':
-			result = a + b;
+			program_emit(prog, OP_ADD);
 			break;
 		case '-':
-			result = a - b;
+			program_emit(prog, OP_SUB);
 			break;
 		case '*':
-			result = a * b;
+			program_emit(prog, OP_MUL);
 			break;
 		case '/':
-			if(b == 0)
-			{
-				syslog(LOG_ERR, "Cannot divide by zero");
-				return INVALID_EXPR;
-			}	
-			result = a / b;
+			program_emit(prog, OP_DIV);
 			break;
 		default:
 			return INVALID_EXPR;
 	}
-	stack_push(num_stk, result);
+	(*depth)--;
 	return OK;
 }
 
+void parser_set_stack_reuse(bool reuse)
+{
+	reuse_stacks = reuse;
+}
+
+void parser_set_engine(int engine)
+{
+	parser_engine = engine;
+}
+
+/*
+ * Creates the operator stack used by _compile_expr
+ *
+ * return: the operator stack
+ */
+static stack * parser_stack_init()
+{
+	stack * ops_stk = stack_init();
+
+	// For tracing
+	ops_stk->push_format = "pushed %c";
+	ops_stk->pop_format = "popped %c";
+	return ops_stk;
+}
+
+int compile_expr(const char * expr, program * prog)
+{
+	stack * ops_stk; // The operator stack
+	int status_code, run_status;
+	int64_t ignored;
+
+	// A well-formed expression needs no operator stack at all
+	if(parser_engine == PARSER_CLIMBING)
+	{
+		program_clear(prog);
+		if(climb_compile(expr, prog))
+		{
+			dag_optimize(prog);
+			return OK;
+		}
+	}
+
+	if(reuse_stacks)
+	{
+		if(thread_ops_stk == NULL)
+			thread_ops_stk = parser_stack_init();
+		ops_stk = thread_ops_stk;
+		stack_clear(ops_stk);
+	}
+	else
+		ops_stk = parser_stack_init();
+
+	program_clear(prog);
+	status_code = _compile_expr(ops_stk, expr, prog);
+
+	// Operators run in the order they were emitted, so a division by zero
+	// (or an overflow) emitted before a mismatch was found is the error the
+	// expression has (which cannot be known before variables are bound)
+	if(status_code == MISMATCH && prog->num_vars == 0)
+	{
+		run_status = run_program(prog, &ignored);
+		// Exact arithmetic cannot overflow; only a division by zero counts
+		if(run_status == OVERFLOW && program_arith() == ARITH_BIG)
+			run_status = run_program_big(prog, NULL, NULL);
+		if(run_status != OK)
+			status_code = run_status;
+	}
+
+	if(status_code == OK)
+		dag_optimize(prog);
+
+	if(!reuse_stacks)
+		stack_free(ops_stk);
+	return status_code;
+}
+
 /*
  * Parses the given expression and stores it in result
- * The actual parsing is done in _parse_expr, this method
- * just ensures that the stacks are always freed
+ * The expression is compiled by compile_expr and then run, in this
+ * thread's reused program unless stack reuse is off
  *
  * expr: the expression to be parsed
  * result: a pointer to the result variable
@@ -133,43 +230,122 @@ int operate(stack * num_stk, char op) {
  * If OK, then parse was successful and result is stored in result
  * Otherwise, parse failed and can be due to MISMATCH or INVALID_EXPR
  */
-int parse_expr(const char * expr, int * result)
+int parse_expr(const char * expr, int64_t * result)
 {
-	// Create stacks
-	stack * num_stk = stack_init(); // The operand stack
-	stack * ops_stk = stack_init(); // The operator stack
+	program * prog;
+	int status_code;
+	uint64_t start = METRICS_START();
 
-	// For logging debug messages
-	num_stk->push_format = "pushed %d";
-	num_stk->pop_format = "popped %d";
-	ops_stk->push_format = "pushed %c";
-	ops_stk->pop_format = "popped %c";
+	if(reuse_stacks)
+	{
+		if(thread_prog == NULL)
+			thread_prog = program_init();
+		prog = thread_prog;
+	}
+	else
+		prog = program_init();
+
+	status_code = compile_expr(expr, prog);
+	start = metrics_stage(METRIC_PARSE, start);
+	if(status_code == OK)
+	{
+		status_code = run_program(prog, result);
+		metrics_stage(METRIC_EVAL, start);
+	}
+
+	if(!reuse_stacks)
+		program_free(prog);
+	return status_code;
+}
+
+int parse_expr_big(const char * expr, const char ** digits, size_t * len)
+{
+	program * prog;
+	int status_code;
+	uint64_t start = METRICS_START();
+
+	if(reuse_stacks)
+	{
+		if(thread_prog == NULL)
+			thread_prog = program_init();
+		prog = thread_prog;
+	}
+	else
+		prog = program_init();
 
-	// Parse the expression
-	int status_code = _parse_expr(num_stk, ops_stk, expr, result);
+	status_code = compile_expr(expr, prog);
+	start = metrics_stage(METRIC_PARSE, start);
+	if(status_code == OK)
+	{
+		status_code = run_program_big(prog, digits, len);
+		metrics_stage(METRIC_EVAL, start);
+	}
 
-	// Free stacks
-	stack_free(num_stk);
-	stack_free(ops_stk);
+	if(!reuse_stacks)
+		program_free(prog);
 	return status_code;
 }
 
 /*
- * Parses the given expression and stores it in result
+ * Whether compiling the tokens before the first invalid character of an
+ * expression could fail with a status other than INVALID_EXPR, which that
+ * character gives: by closing a parenthesis that was never opened, or in
+ * checked arithmetic by a literal that may not fit in 64 bits
+ *
+ * index: the tokens before the character, from a tokenize that stopped at it
+ */
+static bool prefix_may_fail(const char * expr, const struct token_index * index)
+{
+	long open = 0;
+	size_t i;
+	char c;
+
+	for(i = 0; i < index->count; i++)
+	{
+		c = expr[index->starts[i]];
+		if(c == '(')
+			open++;
+		else if(c == ')' && --open < 0)
+			return true;
+		// A literal runs at most to the next token; any of 18 digits fits
+		else if(is_num(c) && program_arith() == ARITH_CHECKED && index->starts[i + 1] - index->starts[i] > 18)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Compiles the given expression into prog
  *
- * num_stk: the operand stack
  * ops_stk: the operator stack
- * expr: the expression to be parsed
- * result: a pointer to the result
+ * expr: the expression to be compiled
+ * prog: the program, which must be empty
  *
  * return: a status code (described above)
  */
-int _parse_expr(stack * num_stk, stack * ops_stk, const char * expr, int * result)
+int _compile_expr(stack * ops_stk, const char * expr, program * prog)
 {
 	int tmp;
+	int start;
 	int status_code; // Stores the status code to be returned
 	int last_token = NONE; // Stores the type of the last token read
+	size_t depth = 0; // Operand stack depth when the program gets here
 	int i = 0;
+	const uint32_t * tokens = NULL; // Where tokens start, if indexed
+	size_t next = 0; // First token that may not have been reached
+	size_t len;
+
+	// Index a long, mostly blank expression so whitespace is jumped over.
+	// One with an invalid character is only walked if an error before
+	// that character could be the one reported.
+	if(strnlen(expr, TOKEN_MIN_LEN) == TOKEN_MIN_LEN && token_spacious(expr))
+	{
+		len = strlen(expr);
+		if(tokenize(expr, len, &thread_tokens))
+			tokens = thread_tokens.starts;
+		else if(thread_tokens.invalid < len && !prefix_may_fail(expr, &thread_tokens))
+			return INVALID_EXPR;
+	}
 
 	// Iterate through the expression char by char
 	while(expr[i] != '\0')
@@ -177,20 +353,63 @@ int _parse_expr(stack * num_stk, stack * ops_stk, const char * expr, int * resul
 		//Ignore spaces and newlines
 		if(expr[i] == ' ' || expr[i] == '\n' || expr[i] == '\r')
 		{
-			i++;
+			if(tokens == NULL)
+				i++;
+			else
+			{
+				while(tokens[next] < (uint32_t)i)
+					next++;
+				i = tokens[next];
+			}
 			continue;
 		}
 
 		//Parse number token and push onto stack
 		if(is_num(expr[i]))
 		{
+			start = i;
 			tmp = expr[i] - '0';
 			while(is_num(expr[i + 1]))
 			{
 				tmp = tmp * 10 + (int)(expr[i + 1] - '0');
 				i++;
 			}
-			stack_push(num_stk, tmp);
+			// Checked and exact arithmetic read literals of ten digits or more again
+			if(i + 1 - start > 9 && program_arith() != ARITH_WRAP)
+			{
+				TRACE("emit %.*s", i + 1 - start, expr + start);
+				if(!program_emit_literal(prog, expr + start, i + 1 - start))
+				{
+					syslog(LOG_ERR, "Literal does not fit in 64 bits");
+					return OVERFLOW;
+				}
+			}
+			else
+			{
+				TRACE("emit %d", tmp);
+				program_emit(prog, OP_PUSH);
+				program_emit(prog, tmp);
+			}
+			if(++depth > prog->max_depth)
+				prog->max_depth = depth;
+			last_token = IS_OPERAND;
+		}
+		//Parse variable name and push its value onto stack
+		else if(is_alpha(expr[i]))
+		{
+			start = i;
+			while(is_alpha(expr[i + 1]) || is_num(expr[i + 1]))
+				i++;
+			if((tmp = program_variable(prog, expr + start, i + 1 - start)) < 0)
+			{
+				syslog(LOG_ERR, "Too many variables or name too long");
+				return INVALID_EXPR;
+			}
+			TRACE("emit %s", prog->vars[tmp]);
+			program_emit(prog, OP_LOAD);
+			program_emit(prog, tmp);
+			if(++depth > prog->max_depth)
+				prog->max_depth = depth;
 			last_token = IS_OPERAND;
 		}
 		//If token is minus, then check if unary
@@ -202,12 +421,12 @@ int _parse_expr(stack * num_stk, stack * ops_stk, const char * expr, int * resul
 		//If operator, then place onto stack according to precedence
 		else if(is_op(expr[i]))
 		{
-			// Remove higher precedence operators and perform them
+			// Remove higher precedence operators and emit them
 			while(!stack_empty(ops_stk) && is_op(stack_top(ops_stk)))
 			{
 				if(precedence(expr[i]) <= precedence(stack_top(ops_stk)))
 				{
-					if((status_code = operate(num_stk, stack_pop(ops_stk))) != OK)
+					if((status_code = emit_operator(prog, &depth, stack_pop(ops_stk))) != OK)
 						return status_code;
 				} else break;
 			}
@@ -220,13 +439,13 @@ int _parse_expr(stack * num_stk, stack * ops_stk, const char * expr, int * resul
 			stack_push(ops_stk, expr[i]);
 			last_token = IS_LEFT_P;
 		}
-		//If right parenthesis, evaluate stack until left parenthesis
+		//If right parenthesis, emit operators until left parenthesis
 		else if(expr[i] == ')')
 		{
-			syslog(LOG_DEBUG, "encountered )\n");
+			TRACE("encountered )\n");
 			while(!stack_empty(ops_stk) && stack_top(ops_stk) != '(')
 			{
-				if((status_code = operate(num_stk, stack_pop(ops_stk))) != OK)
+				if((status_code = emit_operator(prog, &depth, stack_pop(ops_stk))) != OK)
 					return status_code;
 			}
 			// Pop out the remaining left bracket
@@ -246,19 +465,21 @@ int _parse_expr(stack * num_stk, stack * ops_stk, const char * expr, int * resul
 			return INVALID_EXPR;
 		}
 
-		syslog(LOG_DEBUG, "OPS: ");
-		stack_log(ops_stk, "%c");
-		syslog(LOG_DEBUG, "NUM: ");
-		stack_log(num_stk, "%d");
+		if(TRACE_ENABLED())
+		{
+			syslog(LOG_DEBUG, "OPS: ");
+			stack_log(ops_stk, "%c");
+			syslog(LOG_DEBUG, "NUM: %zu operands", depth);
+		}
 		
 		i++;
 	}
 
-	//Evaluate remaining stack
+	//Emit remaining stack
 	while(!stack_empty(ops_stk))
 	{
 		if(is_op(stack_top(ops_stk))) {
-			if((status_code = operate(num_stk, stack_pop(ops_stk))) != OK)
+			if((status_code = emit_operator(prog, &depth, stack_pop(ops_stk))) != OK)
 				return status_code;
 		} else if(stack_top(ops_stk) == '(') {
 			return MISMATCH;
@@ -266,20 +487,16 @@ int _parse_expr(stack * num_stk, stack * ops_stk, const char * expr, int * resul
 	}
 
 	//There should only be one item left in num stack
-	if(stack_size(num_stk) == 0)
+	if(depth == 0)
 	{
 		syslog(LOG_ERR, "Operand stack is empty");
 		return INVALID_EXPR;
 	}
-	else if(stack_size(num_stk) > 1)
+	else if(depth > 1)
 	{
 		syslog(LOG_ERR, "Operands remaining in stack");
 		return INVALID_EXPR;
 	}
-	else
-	{
-		*result = stack_pop(num_stk);
-	}
 
 	return OK;
 
@@ -12,9 +12,32 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stdbool.h>
+#include "bytecode.h"
+
 #define OK				1
 #define MISMATCH		2
 #define INVALID_EXPR	3
+#define OVERFLOW		7	// Only in checked or exact arithmetic; 4 to 6 are in ctp.h
+
+//Engines compile_expr can use
+#define PARSER_SHUNTING_YARD	0	// Operator stack, one character at a time
+#define PARSER_CLIMBING			1	// Precedence climbing, falling back to the shunting yard for errors
+
+/*
+ * Compiles the given expression into a program that run_program evaluates
+ * The program can be kept and run again without parsing the expression
+ * Names (a letter or underscore, then letters, digits and underscores) are
+ * variables, indexed in prog->vars in the order they first appear
+ * Once dag_init is called, long programs are rebuilt by dag_optimize
+ *
+ * expr: the expression to be compiled
+ * prog: the program, whose previous contents are replaced
+ *
+ * return: status code; OK if the program is ready to run, otherwise
+ * MISMATCH, INVALID_EXPR or OVERFLOW as parse_expr would report
+ */
+int compile_expr(const char * expr, program * prog);
 
 /*
  * Parses the given expression and stores it in result
@@ -24,8 +47,42 @@
  *
  * return: status code indicating the result of the parsing
  * If OK, then parse was successful and result is stored in result
- * Otherwise, parse failed and can be due to MISMATCH or INVALID_EXPR
+ * Otherwise, parse failed and can be due to MISMATCH or INVALID_EXPR,
+ * which includes an expression with variables, as nothing binds them, or
+ * in checked arithmetic to OVERFLOW, which includes a literal that does
+ * not fit in 64 bits
+ */
+int parse_expr(const char * expr, int64_t * result);
+
+/*
+ * Parses the given expression and evaluates it exactly, for one that
+ * parse_expr found to overflow in exact arithmetic (ARITH_BIG)
+ *
+ * expr: the expression to be parsed
+ * digits: set to the result in decimal; valid until this thread's next
+ * exact evaluation
+ * len: set to the length of the result, which is no more than the number
+ * of characters of the expression other than whitespace
+ *
+ * return: status code; OK, MISMATCH or INVALID_EXPR
+ */
+int parse_expr_big(const char * expr, const char ** digits, size_t * len);
+
+/*
+ * Chooses whether parse_expr reuses per-thread stacks and programs across
+ * calls (the default), so a typical expression needs no heap allocation,
+ * or creates and frees them on every call
+ *
+ * reuse: true to reuse per-thread stacks
+ */
+void parser_set_stack_reuse(bool reuse);
+
+/*
+ * Chooses the engine compile_expr uses. Both compile an expression to the
+ * same program and report the same status for it.
+ *
+ * engine: PARSER_SHUNTING_YARD (the default) or PARSER_CLIMBING
  */
-int parse_expr(const char * expr, int * result);
+void parser_set_engine(int engine);
 
 #endif
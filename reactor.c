@@ -0,0 +1,368 @@
+/********************************************************************************
+ * reactor.c
+ *
+ * Computer Science 3357a
+ * Event-driven Server Loop
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of an edge-triggered epoll reactor. Every connection owns
+ * its own read and write buffers so a slow client never blocks the others.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "reactor.h"
+#include "logger.h"
+#include "metrics.h"
+#include "iplimit.h"
+#include "admission.h"
+
+#define MAX_EVENTS 256
+
+#define CONN_OPEN 0
+#define CONN_CLOSE 1
+
+//State of one event loop
+struct reactor
+{
+	int epfd;
+	int sockfd;						// The listening socket
+	struct timer_wheel timers;		// Timeouts of the connections
+	uint64_t now;					// Tick of the latest events
+};
+
+/*
+ * Raises the soft limit on open descriptors to the hard limit so the
+ * reactor can hold thousands of connections
+ */
+static void raise_fd_limit()
+{
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/*
+ * Switches the given descriptor to non-blocking mode
+ */
+static void set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		perror("Unable to make socket non-blocking");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Closes a connection and frees it
+ * Closing the descriptor also removes it from the epoll set
+ */
+static void connection_close(struct reactor* r, struct connection* conn)
+{
+	timer_cancel(&r->timers, &conn->timer);
+	admission_close();
+	iplimit_release(conn->addr);
+	close(conn->fd);
+	ctp_session_free(&conn->session);
+	free(conn);
+	metrics_connection_closed();
+}
+
+/*
+ * Arms the connection's timer for the state it is waiting in: for its
+ * responses to be sent, for the rest of a request, or for a new request.
+ * A request's deadline is fixed when it starts, so trickling bytes does
+ * not extend it.
+ */
+static void connection_schedule(struct reactor* r, struct connection* conn)
+{
+	struct ctp_session* s = &conn->session;
+	unsigned timeout;
+	uint64_t since = r->now;
+
+	if(s->woff < s->wlen)
+		timeout = ctp_config.write_timeout;
+	else if(s->rlen > s->rstart)
+	{
+		if(conn->request_start == 0)
+			conn->request_start = r->now;
+		since = conn->request_start;
+		timeout = ctp_config.read_timeout;
+	}
+	else
+		timeout = ctp_config.idle_timeout;
+
+	if(s->rlen == s->rstart)
+		conn->request_start = 0;
+
+	if(timeout > 0)
+		timer_set(&r->timers, &conn->timer, since + timer_ticks(timeout));
+	else
+		timer_cancel(&r->timers, &conn->timer);
+}
+
+/*
+ * Drops a connection whose timer fired
+ */
+static void connection_expire(struct timer* t, void* arg)
+{
+	struct connection* conn = (struct connection*)((char*)t - offsetof(struct connection, timer));
+
+	metrics_connection_dropped(METRIC_DROP_TIMEOUT);
+	connection_close(arg, conn);
+}
+
+/*
+ * Accepts every pending connection on the listening socket and registers
+ * each one with the epoll instance
+ */
+static void accept_connections(struct reactor* r)
+{
+	struct sockaddr_in client_addr;		// Remote IP that is connecting to us
+	socklen_t addr_len;
+	struct epoll_event event;
+	struct connection* conn;
+	int connectionfd;
+	uint64_t start;
+
+	while(1)
+	{
+		addr_len = sizeof(client_addr);
+		start = METRICS_START();
+		connectionfd = accept4(r->sockfd, (struct sockaddr*)&client_addr, &addr_len, SOCK_NONBLOCK);
+		if(connectionfd == -1)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			// Anything other than an empty queue (e.g. out of descriptors)
+			// is reported, and the remaining connections wait in the backlog
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("Unable to accept connection");
+			return;
+		}
+
+		metrics_stage(METRIC_ACCEPT, start);
+		logger_client(client_addr.sin_addr.s_addr);
+
+		// An overloaded server answers at once rather than queue the client
+		if(!admission_open())
+		{
+			admission_refuse(connectionfd);
+			continue;
+		}
+
+		// A client over its limit is refused before anything is allocated
+		if(!iplimit_acquire(client_addr.sin_addr.s_addr))
+		{
+			metrics_connection_dropped(METRIC_DROP_LIMIT);
+			admission_close();
+			close(connectionfd);
+			continue;
+		}
+
+		conn = malloc(sizeof(struct connection));
+		if(conn == NULL)
+		{
+			iplimit_release(client_addr.sin_addr.s_addr);
+			admission_close();
+			close(connectionfd);
+			continue;
+		}
+		conn->fd = connectionfd;
+		conn->addr = client_addr.sin_addr.s_addr;
+		conn->request_start = 0;
+		ctp_session_init(&conn->session);
+		timer_init(&conn->timer);
+
+		// Edge-triggered for both directions, so the registration never changes
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, connectionfd, &event) == -1)
+		{
+			perror("Unable to register connection");
+			iplimit_release(conn->addr);
+			admission_close();
+			close(connectionfd);
+			free(conn);
+			continue;
+		}
+		metrics_connection_opened();
+
+		// Until it sends anything the connection is idle
+		connection_schedule(r, conn);
+	}
+}
+
+/*
+ * Sends as much of the pending responses as the socket accepts
+ *
+ * return: CONN_OPEN once everything is sent or the socket is full,
+ * CONN_CLOSE if the peer is gone
+ */
+static int connection_write(struct connection* conn)
+{
+	struct ctp_session* s = &conn->session;
+	ssize_t bytes_sent;
+	uint64_t start;
+
+	while(s->woff < s->wlen)
+	{
+		start = METRICS_START();
+		bytes_sent = send(conn->fd, s->wbuf + s->woff, s->wlen - s->woff, MSG_NOSIGNAL);
+		metrics_stage(METRIC_SEND, start);
+		if(bytes_sent >= 0)
+			s->woff += bytes_sent;
+		else if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return CONN_OPEN;
+		else if(errno != EINTR)
+			return CONN_CLOSE;
+	}
+	return CONN_OPEN;
+}
+
+/*
+ * Drives a connection as far as it can go without blocking: answers every
+ * buffered request, flushes the responses, then reads more. Being
+ * edge-triggered, it only returns once the socket would block.
+ *
+ * return: CONN_OPEN to keep waiting, CONN_CLOSE to drop the connection
+ */
+static int connection_advance(struct connection* conn)
+{
+	struct ctp_session* s = &conn->session;
+	bool eof = false;
+	bool more;
+	ssize_t bytes_read;
+	size_t space;
+	char* rspace;
+	uint64_t start;
+
+	while(1)
+	{
+		// Answer everything already received before going back to the kernel
+		more = ctp_session_process(s, eof);
+
+		if(connection_write(conn) == CONN_CLOSE)
+			return CONN_CLOSE;
+
+		// Still waiting on the socket; EPOLLOUT will bring us back
+		if(s->woff < s->wlen)
+			return CONN_OPEN;
+
+		if(s->closing)
+			return CONN_CLOSE;
+		if(more)
+			continue;
+
+		rspace = ctp_session_rspace(s, &space);
+		if(rspace == NULL)
+			return CONN_CLOSE;
+
+		start = METRICS_START();
+		bytes_read = recv(conn->fd, rspace, space, 0);
+		if(bytes_read >= 0)
+			metrics_stage(METRIC_RECV, start);
+		if(bytes_read > 0)
+			s->rlen += bytes_read;
+		else if(bytes_read == 0)
+			eof = true;
+		else if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return CONN_OPEN;
+		else if(errno != EINTR)
+			return CONN_CLOSE;
+	}
+}
+
+/*
+ * Advances a connection after epoll reported activity on it
+ */
+static void connection_ready(struct reactor* r, struct connection* conn, uint32_t events)
+{
+	if((events & EPOLLERR) || connection_advance(conn) == CONN_CLOSE)
+		connection_close(r, conn);
+	else
+		connection_schedule(r, conn);
+}
+
+void reactor_run(int sockfd)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event event;
+	struct reactor r;
+	uint64_t ready_since;
+	int num_events, i;
+
+	raise_fd_limit();
+	set_nonblocking(sockfd);
+
+	r.sockfd = sockfd;
+	r.now = timer_clock();
+	timer_wheel_init(&r.timers, r.now);
+
+	r.epfd = epoll_create1(0);
+	if(r.epfd == -1)
+	{
+		perror("Unable to create epoll instance");
+		exit(EXIT_FAILURE);
+	}
+
+	// The listening socket is level-triggered and identified by a NULL pointer
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if(epoll_ctl(r.epfd, EPOLL_CTL_ADD, sockfd, &event) == -1)
+	{
+		perror("Unable to register listening socket");
+		exit(EXIT_FAILURE);
+	}
+
+	while(1)
+	{
+		// Wake up when the next connection can time out, if none is ready sooner
+		num_events = epoll_wait(r.epfd, events, MAX_EVENTS, timer_wait_ms(&r.timers));
+		if(num_events == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("Unable to wait for events");
+			exit(EXIT_FAILURE);
+		}
+		r.now = timer_clock();
+		ready_since = admission_clock();
+
+		for(i = 0; i < num_events; i++)
+		{
+			metrics_ready(num_events - i);
+			if(events[i].data.ptr == NULL)
+				accept_connections(&r);
+			else
+			{
+				// Every event of the batch has been waiting since the wait returned
+				admission_ready(ready_since);
+				connection_ready(&r, events[i].data.ptr, events[i].events);
+			}
+		}
+		metrics_ready(0);
+
+		// Connections served just now had their timers moved first
+		timer_advance(&r.timers, r.now, connection_expire, &r);
+	}
+}
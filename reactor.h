@@ -0,0 +1,39 @@
+/********************************************************************************
+ * reactor.h
+ *
+ * Computer Science 3357a
+ * Event-driven Server Loop
+ *
+ * Author: Duncan Cai
+ *
+ * Non-blocking epoll reactor that multiplexes CTP connections on one thread
+*******************************************************************************/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ctp.h"
+#include "timer.h"
+
+//A client connection owned by the reactor
+struct connection
+{
+	int fd;
+	uint32_t addr;				// Client IPv4 address in network byte order
+	struct ctp_session session;	// Read and write buffers of the connection
+	struct timer timer;			// Fires when the connection times out
+	uint64_t request_start;		// Tick the unfinished request started on, or 0
+};
+
+/*
+ * Runs the event loop on the given listening socket; never returns
+ * The listening socket is switched to non-blocking mode
+ * Connections that exceed the read, write or idle timeout are dropped
+ *
+ * sockfd: the listening socket
+ */
+void reactor_run(int sockfd);
+
+#endif
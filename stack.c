@@ -2,72 +2,95 @@
  * stack.c
  * 
  * Computer Science 3357a
- * Linked Stack Implementation
+ * Array Stack Implementation
  *
  * Author: Duncan Cai
  * 
- * Implementation of a linked stack.
+ * Implementation of a stack on a contiguous array that doubles when full.
+ * Small stacks live entirely in the stack container, so pushing and popping
+ * never touch the allocator.
 *******************************************************************************/
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <syslog.h>
 #include "stack.h"
+#include "trace.h"
 
 stack* stack_init()
 {
 	stack* stk = malloc(sizeof(stack));
-	stk->head = NULL;
+	if(stk == NULL)
+		exit(EXIT_FAILURE);
+	stk->_data = stk->_inline;
+	stk->_capacity = STACK_INLINE_SIZE;
 	stk->push_format = NULL;
 	stk->pop_format = NULL;
 	stk->_num_elements = 0;
 	return stk;
 }
 
-void stack_push(stack* stk, int data)
+/*
+ * Doubles the storage of a full stack
+ */
+static void stack_grow(stack* stk)
 {
-	struct node* tmp = malloc(sizeof(struct node));
-	if(tmp == NULL)
+	size_t capacity = stk->_capacity * 2;
+	int* data;
+
+	if(stk->_data == stk->_inline)
+	{
+		data = malloc(capacity * sizeof(int));
+		if(data != NULL)
+			memcpy(data, stk->_inline, sizeof(stk->_inline));
+	}
+	else
+	{
+		data = realloc(stk->_data, capacity * sizeof(int));
+	}
+	if(data == NULL)
 		exit(EXIT_FAILURE);
-	tmp->data = data;
-	tmp->next = stk->head;
-	stk->head = tmp;
-	stk->_num_elements++;
-	if(stk->push_format != NULL)
+	stk->_data = data;
+	stk->_capacity = capacity;
+}
+
+void stack_push(stack* stk, int data)
+{
+	if(stk->_num_elements == stk->_capacity)
+		stack_grow(stk);
+	stk->_data[stk->_num_elements++] = data;
+	if(TRACE_ENABLED() && stk->push_format != NULL)
 		syslog(LOG_DEBUG, stk->push_format, data);
 }
 
 int stack_pop(stack* stk)
 {
-	struct node* tmp = stk->head;
-	stk->head = tmp->next;
-	int element = tmp->data;
-	free(tmp);
-	stk->_num_elements--;
-	if(stk->pop_format != NULL)
+	int element = stk->_data[--stk->_num_elements];
+	if(TRACE_ENABLED() && stk->pop_format != NULL)
 		syslog(LOG_DEBUG, stk->pop_format, element);
 	return element;
 }
 
 void stack_log(stack* stk, const char * format)
 {
-	struct node* current = stk->head;
-	if(current == NULL)
+	size_t i = stk->_num_elements;
+	if(i == 0)
 	{
 		syslog(LOG_DEBUG, "empty");
 	} else {
-		while(current != NULL)
+		// Top of the stack first
+		while(i > 0)
 		{
-			syslog(LOG_DEBUG, format, current->data);
-			current = current->next;
+			syslog(LOG_DEBUG, format, stk->_data[--i]);
 		}
 	}
 }
 
 int stack_top(stack* stk)
 {
-	return stk->head->data;
+	return stk->_data[stk->_num_elements - 1];
 }
 
 size_t stack_size(stack* stk)
@@ -76,14 +99,17 @@ size_t stack_size(stack* stk)
 }
 
 bool stack_empty(stack* stk) {
-	return stk->head == NULL;
+	return stk->_num_elements == 0;
+}
+
+void stack_clear(stack* stk)
+{
+	stk->_num_elements = 0;
 }
 
 void stack_free(stack* stk)
 {
-	while(!stack_empty(stk))
-	{
-		stack_pop(stk);
-	}
+	if(stk->_data != stk->_inline)
+		free(stk->_data);
 	free(stk);
 }
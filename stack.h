@@ -13,20 +13,19 @@
 #define STACK_H
 #include <stdbool.h>
 
-//A stack node
-struct node
-{
-	int data;
-	struct node* next;	
-};
+#include <stddef.h>
+
+#define STACK_INLINE_SIZE 32	// Elements held before the stack allocates
 
 //A stack container
 typedef struct
 {
-	struct node* head;
+	int* _data;				// Contiguous storage, bottom of the stack first
+	size_t _capacity;		// Number of elements _data can hold
 	size_t _num_elements;	// Stores the stack size
-	const char * push_format; // Syslogs on every push according to this format
-	const char * pop_format; // Syslogs on every pop according to this format
+	const char * push_format; // Traces every push according to this format
+	const char * pop_format; // Traces every pop according to this format
+	int _inline[STACK_INLINE_SIZE];	// Storage used until the stack outgrows it
 } stack;
 
 /*
@@ -90,7 +89,14 @@ size_t stack_size(stack* s);
 bool stack_empty(stack* s);
 
 /*
- * Frees memory allocated to stack and its nodes
+ * Removes every element but keeps the storage for reuse
+ *
+ * s: pointer to stack
+ */
+void stack_clear(stack* s);
+
+/*
+ * Frees memory allocated to stack and its storage
  *
  * s: pointer to stack
  *
@@ -0,0 +1,594 @@
+/********************************************************************************
+ * test.c
+ *
+ * Computer Science 3357a
+ * Differential Tests
+ *
+ * Author: Duncan Cai
+ *
+ * Runs randomly generated expressions through each faster path and the path
+ * it stands in for, and reports every expression on which the two disagree:
+ * programs compiled to native code against the interpreter over the same
+ * columns, programs rebuilt as DAGs against the programs they were rebuilt
+ * from in every arithmetic, precedence climbing against the shunting yard,
+ * and exact arithmetic against 64-bit results where those fit and against
+ * decimal arithmetic done here where they do not. The generator has a fixed
+ * seed, so a failure can be reproduced. Prints one JSON object per test and
+ * exits nonzero if any expression failed.
+ *
+ * Usage: calc-test [FILTER]   (runs only tests whose name contains FILTER)
+*******************************************************************************/
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "parser.h"
+#include "jit.h"
+#include "bignum.h"
+#include "dag.h"
+
+#define SEED 3357					// Seed of the expression generator
+#define CASES 20000					// Expressions per test
+#define MAX_EXPR 65536
+#define MAX_DEPTH 7					// Deepest a generated expression nests
+#define POOL_SIZE 16				// Subexpressions kept to be written again
+#define ROWS (COLUMN_BLOCK + 45)	// Rows of variable bindings; crosses a block
+#define MAX_DIGITS 1500				// Longest operand of the decimal cases
+
+//What a test generates, and how it checks one expression
+struct test
+{
+	const char * name;
+	const char * (*gen)(const struct test * t);
+	bool (*check)(struct test * t, const char * expr);	// Whether the paths agree on it
+	bool vars;						// Expressions may use x, y and z
+	bool big;						// Expressions may have literals longer than 64 bits
+	bool corrupt;					// Some expressions have a character dropped or replaced
+	int arith;						// Arithmetic programs are run with
+	size_t dag_threshold;			// Words of code before a program is rebuilt, 0 for never
+	bool schoolbook;				// Multiply exactly by schoolbook only
+};
+
+//An expression being generated
+struct gen
+{
+	bool vars;
+	bool big;
+	char * out;
+	size_t len;
+	bool full;						// Ran out of room; the expression is discarded
+};
+
+static uint64_t rng_state = SEED;
+
+static char pool[POOL_SIZE][MAX_EXPR];
+static uint32_t pool_len;
+
+static char expected[2 * MAX_DIGITS + 3];	// Result the decimal cases should give
+
+static int32_t column_x[ROWS], column_y[ROWS], column_z[ROWS];
+
+/*
+ * Returns a pseudo-random number below n (xorshift64*)
+ */
+static uint32_t rng(uint32_t n)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (uint32_t)((rng_state * 2685821657736338717ULL) >> 32) % n;
+}
+
+/*
+ * Appends text to the expression being generated
+ */
+static void gen_append(struct gen * g, const char * text, size_t len)
+{
+	if(g->full || g->len + len >= MAX_EXPR)
+	{
+		g->full = true;
+		return;
+	}
+	memcpy(g->out + g->len, text, len);
+	g->len += len;
+	g->out[g->len] = '\0';
+}
+
+/*
+ * Writes a random number of the given number of digits, without leading
+ * zeros
+ */
+static size_t gen_digits(char * out, size_t digits)
+{
+	size_t i;
+
+	out[0] = '1' + rng(9);
+	for(i = 1; i < digits; i++)
+		out[i] = '0' + rng(10);
+	out[digits] = '\0';
+	return digits;
+}
+
+/*
+ * Appends a literal, a variable, or a value at the edge of 32 or 64 bits
+ */
+static void gen_leaf(struct gen * g)
+{
+	static const char * edges[] = { "0", "1", "2", "2147483647", "2147483648", "4294967296", "9223372036854775807" };
+	static const char * names[] = { "x", "y", "z" };
+	char buf[48];
+	uint32_t r = rng(10);
+
+	if(g->big && r == 9)
+		gen_append(g, buf, gen_digits(buf, 10 + rng(31)));
+	else if(g->vars && r < 4)
+		gen_append(g, names[r % 3], 1);
+	else if(r < 6)
+	{
+		r = rng(sizeof(edges) / sizeof(edges[0]));
+		gen_append(g, edges[r], strlen(edges[r]));
+	}
+	else
+		gen_append(g, buf, sprintf(buf, "%u", rng(21)));
+}
+
+/*
+ * Appends an expression at most depth operators deep. Some are kept in the
+ * pool and written again later, as generated text repeats subexpressions.
+ */
+static void gen_expr(struct gen * g, int depth)
+{
+	size_t start = g->len;
+	uint32_t r;
+	bool paren;
+
+	if(pool_len > 0 && rng(10) < 3)
+	{
+		r = rng(pool_len);
+		gen_append(g, pool[r], strlen(pool[r]));
+		return;
+	}
+
+	r = rng(10);
+	if(depth == 0 || r < 2)
+		gen_leaf(g);
+	else if(r < 3)
+	{
+		gen_append(g, "-", 1);
+		gen_expr(g, depth - 1);
+	}
+	else
+	{
+		// Without parentheses, precedence decides what the operands are
+		paren = rng(3) != 0;
+		if(paren)
+			gen_append(g, "(", 1);
+		gen_expr(g, depth - 1);
+		if(rng(8) == 0)
+			gen_append(g, " ", 1);
+		gen_append(g, &"+-*/"[rng(4)], 1);
+		gen_expr(g, depth - 1);
+		if(paren)
+			gen_append(g, ")", 1);
+	}
+
+	if(!g->full && rng(2) == 0)
+	{
+		r = pool_len < POOL_SIZE ? pool_len++ : rng(POOL_SIZE);
+		memcpy(pool[r], g->out + start, g->len - start);
+		pool[r][g->len - start] = '\0';
+	}
+}
+
+/*
+ * Generates the next expression for a test
+ */
+static const char * gen_next(const struct test * t)
+{
+	static const char replacements[] = "()+-*/ 7x#";
+	static char expr[MAX_EXPR];
+	struct gen g = { t->vars, t->big, expr, 0, false };
+	size_t i;
+
+	do
+	{
+		g.len = 0;
+		g.full = false;
+		pool_len = 0;
+		gen_expr(&g, 1 + rng(MAX_DEPTH));
+	}
+	while(g.full);
+
+	// Drop or replace one character, for the parsers' errors
+	if(t->corrupt && rng(4) == 0)
+	{
+		i = rng(g.len);
+		if(rng(2) == 0)
+			memmove(expr + i, expr + i + 1, g.len - i);
+		else
+			expr[i] = replacements[rng(sizeof(replacements) - 1)];
+	}
+	return expr;
+}
+
+/*
+ * Strips leading zeros from a number of len digits, least significant
+ * first, and writes it most significant first
+ */
+static void dec_write(const unsigned char * digits, size_t len, char * out)
+{
+	while(len > 1 && digits[len - 1] == 0)
+		len--;
+	while(len > 0)
+		*out++ = '0' + digits[--len];
+	*out = '\0';
+}
+
+/*
+ * Adds two non-negative decimal numbers, one digit at a time
+ */
+static void dec_add(const char * a, const char * b, char * out)
+{
+	static unsigned char sum[2 * MAX_DIGITS + 2];
+	size_t la = strlen(a), lb = strlen(b), i;
+	int carry = 0;
+
+	for(i = 0; i < la || i < lb || carry; i++)
+	{
+		carry += (i < la ? a[la - 1 - i] - '0' : 0) + (i < lb ? b[lb - 1 - i] - '0' : 0);
+		sum[i] = carry % 10;
+		carry /= 10;
+	}
+	dec_write(sum, i, out);
+}
+
+/*
+ * Multiplies two non-negative decimal numbers by schoolbook, one digit at
+ * a time
+ */
+static void dec_mul(const char * a, const char * b, char * out)
+{
+	static unsigned product[2 * MAX_DIGITS + 2];
+	static unsigned char digits[2 * MAX_DIGITS + 2];
+	size_t la = strlen(a), lb = strlen(b), i, j;
+
+	memset(product, 0, (la + lb) * sizeof(product[0]));
+	for(i = 0; i < la; i++)
+		for(j = 0; j < lb; j++)
+			product[i + j] += (a[la - 1 - i] - '0') * (b[lb - 1 - j] - '0');
+	for(i = 0; i < la + lb; i++)
+	{
+		if(i + 1 < la + lb)
+			product[i + 1] += product[i] / 10;
+		digits[i] = product[i] % 10;
+	}
+	dec_write(digits, la + lb, out);
+}
+
+/*
+ * Generates a product, a sum, a quotient or a remainder of operands of up
+ * to MAX_DIGITS digits, and works out the result it should have in
+ * expected. A dividend is made as b*q+r with r shorter than b, so both the
+ * quotient and the remainder are known.
+ */
+static const char * gen_decimal(const struct test * t)
+{
+	static char expr[8 * MAX_DIGITS], a[MAX_DIGITS + 1], b[MAX_DIGITS + 1], r[MAX_DIGITS + 1];
+	static char n[2 * MAX_DIGITS + 2], value[2 * MAX_DIGITS + 2];
+	size_t la = 1 + rng(rng(8) == 0 ? MAX_DIGITS : 60), lb = 1 + rng(rng(8) == 0 ? MAX_DIGITS : 60);
+	const char * sign = rng(2) == 0 ? "-" : "";
+
+	gen_digits(a, la);
+	gen_digits(b, lb);
+	if(lb > 1)
+		gen_digits(r, 1 + rng(lb - 1));
+	else
+		strcpy(r, "0");
+	dec_mul(b, a, n);
+	dec_add(n, r, n);
+
+	switch(rng(4))
+	{
+		case 0:
+			sprintf(expr, "%s%s*%s", sign, a, b);
+			dec_mul(a, b, value);
+			break;
+		case 1:
+			sprintf(expr, "%s+%s", a, b);
+			sign = "";
+			dec_add(a, b, value);
+			break;
+		case 2:
+			sprintf(expr, "%s%s/%s", sign, n, b);
+			strcpy(value, a);
+			break;
+		default:
+			sprintf(expr, "%s-%s/%s*%s", n, n, b, b);
+			sign = "";
+			strcpy(value, r);
+			break;
+	}
+	sprintf(expected, "%s%s", strcmp(value, "0") != 0 ? sign : "", value);
+	return expr;
+}
+
+/*
+ * Fills the columns x, y and z are bound to; x and z are small, so
+ * products and divisions by zero are common
+ */
+static void columns_init()
+{
+	size_t i;
+
+	for(i = 0; i < ROWS; i++)
+	{
+		column_x[i] = (int32_t)rng(7) - 3;
+		column_y[i] = (int32_t)rng(100001) - 50000;
+		column_z[i] = (int32_t)(i % 3) - 1;
+	}
+}
+
+/*
+ * Points each variable of the program at its column
+ */
+static void columns_bind(const program * prog, const int32_t ** columns)
+{
+	int i;
+
+	for(i = 0; i < prog->num_vars; i++)
+		columns[i] = prog->vars[i][0] == 'x' ? column_x : prog->vars[i][0] == 'y' ? column_y : column_z;
+}
+
+/*
+ * Compiles the expression to native code and runs it over the columns,
+ * against run_program_columns. Only programs too deep for the compiler
+ * may be left to the interpreter.
+ */
+static bool check_jit(struct test * t, const char * expr)
+{
+	static int32_t expected_results[ROWS], results[ROWS];
+	static unsigned char expected_statuses[ROWS], statuses[ROWS];
+	static program * prog;
+	const int32_t * columns[PROGRAM_MAX_VARS];
+	size_t size;
+	jit_fn fn;
+
+	if(prog == NULL)
+		prog = program_init();
+	if(compile_expr(expr, prog) != OK)
+		return true;
+
+	columns_bind(prog, columns);
+	run_program_columns(prog, columns, ROWS, expected_results, expected_statuses);
+	fn = jit_compile(prog, &size);
+	if(fn == NULL)
+	{
+#if defined(__x86_64__)
+		return prog->max_depth + prog->num_slots > JIT_MAX_DEPTH;
+#else
+		return true;
+#endif
+	}
+
+	memset(results, 0, sizeof(results));
+	fn(prog->num_vars > 0 ? columns : NULL, ROWS, results, statuses);
+	jit_free(fn, size);
+	return memcmp(results, expected_results, sizeof(results)) == 0
+		&& memcmp(statuses, expected_statuses, sizeof(statuses)) == 0;
+}
+
+/*
+ * Returns whether two programs are the same, word for word
+ */
+static bool programs_equal(const program * a, const program * b)
+{
+	int i;
+
+	if(a->len != b->len || a->max_depth != b->max_depth || a->num_slots != b->num_slots || a->num_vars != b->num_vars)
+		return false;
+	for(i = 0; i < a->num_vars; i++)
+		if(strcmp(a->vars[i], b->vars[i]) != 0)
+			return false;
+	return memcmp(a->code, b->code, a->len * sizeof(a->code[0])) == 0;
+}
+
+/*
+ * Compiles the expression by precedence climbing and by the shunting
+ * yard, which must report the same status and, if OK, the same program
+ */
+static bool check_engines(struct test * t, const char * expr)
+{
+	static program * climbed, * shunted;
+	int status_code;
+
+	if(climbed == NULL)
+	{
+		climbed = program_init();
+		shunted = program_init();
+	}
+	parser_set_engine(PARSER_CLIMBING);
+	status_code = compile_expr(expr, climbed);
+	parser_set_engine(PARSER_SHUNTING_YARD);
+	if(compile_expr(expr, shunted) != status_code)
+		return false;
+	return status_code != OK || programs_equal(climbed, shunted);
+}
+
+/*
+ * Compiles the expression as it is and rebuilt as a DAG, and runs both in
+ * the test's arithmetic: on their own if they have no variables, exactly
+ * as well in exact arithmetic, and over the columns if they have
+ */
+static bool check_dag(struct test * t, const char * expr)
+{
+	static int64_t wide[ROWS], rebuilt_wide[ROWS];
+	static int32_t results[ROWS], rebuilt_results[ROWS];
+	static unsigned char statuses[ROWS], rebuilt_statuses[ROWS];
+	static char digits[MAX_EXPR];
+	static program * plain, * rebuilt;
+	const int32_t * columns[PROGRAM_MAX_VARS];
+	const char * rebuilt_digits;
+	int64_t result = 0, rebuilt_result = 0;
+	size_t len = 0, rebuilt_len = 0;
+	int status_code;
+
+	if(plain == NULL)
+	{
+		plain = program_init();
+		rebuilt = program_init();
+	}
+	dag_init(0);
+	status_code = compile_expr(expr, plain);
+	dag_init(t->dag_threshold);
+	if(compile_expr(expr, rebuilt) != status_code)
+		return false;
+	if(status_code != OK)
+		return true;
+
+	if(plain->num_vars > 0)
+	{
+		columns_bind(plain, columns);
+		if(t->arith == ARITH_WRAP)
+		{
+			run_program_columns(plain, columns, ROWS, results, statuses);
+			run_program_columns(rebuilt, columns, ROWS, rebuilt_results, rebuilt_statuses);
+			return memcmp(results, rebuilt_results, sizeof(results)) == 0
+				&& memcmp(statuses, rebuilt_statuses, sizeof(statuses)) == 0;
+		}
+		run_program_columns_checked(plain, columns, ROWS, wide, statuses);
+		run_program_columns_checked(rebuilt, columns, ROWS, rebuilt_wide, rebuilt_statuses);
+		return memcmp(wide, rebuilt_wide, sizeof(wide)) == 0
+			&& memcmp(statuses, rebuilt_statuses, sizeof(statuses)) == 0;
+	}
+
+	status_code = run_program(plain, &result);
+	if(run_program(rebuilt, &rebuilt_result) != status_code || (status_code == OK && result != rebuilt_result))
+		return false;
+	if(t->arith != ARITH_BIG)
+		return true;
+
+	// The digits are only valid until the next exact evaluation
+	status_code = run_program_big(plain, &rebuilt_digits, &len);
+	if(status_code == OK)
+		memcpy(digits, rebuilt_digits, len);
+	if(run_program_big(rebuilt, &rebuilt_digits, &rebuilt_len) != status_code)
+		return false;
+	return status_code != OK || (len == rebuilt_len && memcmp(digits, rebuilt_digits, len) == 0);
+}
+
+/*
+ * Runs the expression exactly, against its result in the test's 64-bit
+ * arithmetic wherever that does not overflow: a checked status of OK or
+ * INVALID_EXPR must be the exact one
+ */
+static bool check_exact(struct test * t, const char * expr)
+{
+	static program * prog;
+	const char * digits;
+	char buf[24];
+	int64_t result = 0;
+	size_t len;
+	int status_code;
+
+	if(prog == NULL)
+		prog = program_init();
+	if(compile_expr(expr, prog) != OK)
+		return true;
+	status_code = run_program(prog, &result);
+	if(status_code == OVERFLOW)
+		return true;
+	if(run_program_big(prog, &digits, &len) != status_code)
+		return false;
+	return status_code != OK || (len == (size_t)sprintf(buf, "%lld", (long long)result) && memcmp(digits, buf, len) == 0);
+}
+
+/*
+ * Evaluates the expression as the server does in exact arithmetic, against
+ * the result gen_decimal worked out
+ */
+static bool check_decimal(struct test * t, const char * expr)
+{
+	const char * digits = NULL;
+	char buf[24];
+	int64_t result;
+	size_t len = 0;
+	int status_code = parse_expr(expr, &result);
+
+	if(status_code == OVERFLOW)
+		status_code = parse_expr_big(expr, &digits, &len);
+	else if(status_code == OK)
+	{
+		len = sprintf(buf, "%lld", (long long)result);
+		digits = buf;
+	}
+	return status_code == OK && len == strlen(expected) && memcmp(digits, expected, len) == 0;
+}
+
+/*
+ * Runs a test over CASES expressions and prints its result as a JSON
+ * object; failing expressions go to stderr
+ *
+ * return: the number of expressions that failed
+ */
+static int test_run(struct test * t)
+{
+	const char * expr;
+	int i, failures = 0;
+
+	for(i = 0; i < CASES; i++)
+	{
+		expr = t->gen(t);
+		if(!t->check(t, expr) && failures++ < 10)
+			fprintf(stderr, "%s: %.200s\n", t->name, expr);
+	}
+
+	printf("{\"name\":\"%s\",\"cases\":%d,\"failures\":%d}\n", t->name, CASES, failures);
+	fflush(stdout);
+	return failures;
+}
+
+int main(int argc, char ** argv)
+{
+	const char * filter = argc > 1 ? argv[1] : NULL;
+	int failures = 0;
+	size_t i;
+
+	struct test tests[] =
+	{
+		{ "jit/constants", gen_next, check_jit, false, false, false, ARITH_WRAP },
+		{ "jit/columns", gen_next, check_jit, true, false, false, ARITH_WRAP },
+		{ "jit/columns_dag", gen_next, check_jit, true, false, false, ARITH_WRAP, 1 },
+		{ "engines/wrap", gen_next, check_engines, true, false, true, ARITH_WRAP },
+		{ "engines/checked", gen_next, check_engines, true, true, true, ARITH_CHECKED },
+		{ "engines/big", gen_next, check_engines, true, true, true, ARITH_BIG },
+		{ "dag/wrap", gen_next, check_dag, false, false, false, ARITH_WRAP, 1 },
+		{ "dag/wrap_columns", gen_next, check_dag, true, false, false, ARITH_WRAP, 1 },
+		{ "dag/checked", gen_next, check_dag, false, false, false, ARITH_CHECKED, 1 },
+		{ "dag/checked_columns", gen_next, check_dag, true, false, false, ARITH_CHECKED, 1 },
+		{ "dag/big", gen_next, check_dag, false, true, false, ARITH_BIG, 1 },
+		{ "dag/big_columns", gen_next, check_dag, true, true, false, ARITH_BIG, 1 },
+		{ "exact/64_bits", gen_next, check_exact, false, false, false, ARITH_BIG },
+		{ "exact/checked", gen_next, check_exact, false, false, false, ARITH_CHECKED },
+		{ "exact/decimal", gen_decimal, check_decimal, false, false, false, ARITH_BIG },
+		{ "exact/decimal_schoolbook", gen_decimal, check_decimal, false, false, false, ARITH_BIG, 0, true },
+	};
+
+	// Parse errors are logged; keep syslog out of the output
+	setlogmask(LOG_UPTO(LOG_CRIT));
+	columns_init();
+
+	for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		if(filter != NULL && strstr(tests[i].name, filter) == NULL)
+			continue;
+		program_set_arith(tests[i].arith);
+		dag_init(tests[i].dag_threshold);
+		big_set_karatsuba(!tests[i].schoolbook);
+		failures += test_run(&tests[i]);
+	}
+
+	return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+/********************************************************************************
+ * timer.c
+ *
+ * Computer Science 3357a
+ * Timer Wheel
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the timer wheel. Level 0 has a slot per tick; each
+ * level above has a slot per 64 ticks of the level below. When a level
+ * wraps, the next slot of the level above is cascaded down, so a timer is
+ * moved at most TIMER_LEVELS - 1 times before it fires.
+*******************************************************************************/
+
+#include <time.h>
+
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_DELTA ((1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+uint64_t timer_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+uint64_t timer_ticks(unsigned ms)
+{
+	return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void timer_wheel_init(struct timer_wheel * w, uint64_t now)
+{
+	int level, slot;
+
+	w->now = now;
+	w->count = 0;
+	for(level = 0; level < TIMER_LEVELS; level++)
+		for(slot = 0; slot < TIMER_SLOTS; slot++)
+			w->slots[level][slot] = NULL;
+}
+
+void timer_init(struct timer * t)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+}
+
+/*
+ * Links a timer into the slot its expiry falls in, as seen from w->now
+ */
+static void wheel_place(struct timer_wheel * w, struct timer * t)
+{
+	uint64_t delta;
+	struct timer ** slot;
+	int level = 0;
+
+	if(t->expires < w->now)
+		t->expires = w->now;
+	delta = t->expires - w->now;
+	if(delta > TIMER_MAX_DELTA)
+	{
+		t->expires = w->now + TIMER_MAX_DELTA;
+		delta = TIMER_MAX_DELTA;
+	}
+	while(delta >= TIMER_SLOTS && level < TIMER_LEVELS - 1)
+	{
+		delta >>= TIMER_LEVEL_BITS;
+		level++;
+	}
+
+	slot = &w->slots[level][(t->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK];
+	t->next = *slot;
+	if(t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+/*
+ * Unlinks an armed timer
+ */
+static void wheel_unlink(struct timer * t)
+{
+	*t->pprev = t->next;
+	if(t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+void timer_set(struct timer_wheel * w, struct timer * t, uint64_t expires)
+{
+	if(t->pprev != NULL)
+		wheel_unlink(t);
+	else
+		w->count++;
+
+	// The slot of w->now has already fired
+	t->expires = expires > w->now ? expires : w->now + 1;
+	wheel_place(w, t);
+}
+
+void timer_cancel(struct timer_wheel * w, struct timer * t)
+{
+	if(t->pprev == NULL)
+		return;
+	wheel_unlink(t);
+	w->count--;
+}
+
+/*
+ * Moves every timer of a slot of an upper level to the levels below
+ */
+static void wheel_cascade(struct timer_wheel * w, int level, int index)
+{
+	struct timer * t = w->slots[level][index];
+	struct timer * next;
+
+	w->slots[level][index] = NULL;
+	for(; t != NULL; t = next)
+	{
+		next = t->next;
+		wheel_place(w, t);
+	}
+}
+
+void timer_advance(struct timer_wheel * w, uint64_t now, void (*expire)(struct timer * t, void * arg), void * arg)
+{
+	struct timer * list;
+	struct timer * t;
+	int level, index;
+
+	// Nothing can fire, so there is nothing to walk through
+	if(w->count == 0 && now > w->now)
+		w->now = now;
+
+	while(w->now < now)
+	{
+		w->now++;
+
+		// Each level that wraps pulls the next slot of the level above down
+		for(level = 1; level < TIMER_LEVELS; level++)
+		{
+			if(((w->now >> (TIMER_LEVEL_BITS * (level - 1))) & TIMER_MASK) != 0)
+				break;
+			wheel_cascade(w, level, (w->now >> (TIMER_LEVEL_BITS * level)) & TIMER_MASK);
+		}
+
+		// Detach the slot first, so callbacks can cancel the timers in it
+		index = w->now & TIMER_MASK;
+		list = w->slots[0][index];
+		w->slots[0][index] = NULL;
+		if(list != NULL)
+			list->pprev = &list;
+
+		while((t = list) != NULL)
+		{
+			wheel_unlink(t);
+			w->count--;
+			expire(t, arg);
+		}
+	}
+}
+
+int timer_wait_ms(const struct timer_wheel * w)
+{
+	uint64_t next = 0, base, tick;
+	int level, shift, i;
+
+	if(w->count == 0)
+		return -1;
+
+	// The first occupied slot of level 0 fires within a turn of it
+	for(i = 1; i <= TIMER_SLOTS; i++)
+	{
+		if(w->slots[0][(w->now + i) & TIMER_MASK] != NULL)
+		{
+			next = w->now + i;
+			break;
+		}
+	}
+
+	// A slot of an upper level has work once it is cascaded down, which
+	// happens when the level below wraps to it
+	for(level = 1; level < TIMER_LEVELS; level++)
+	{
+		shift = TIMER_LEVEL_BITS * level;
+		for(i = 1; i <= TIMER_SLOTS; i++)
+		{
+			base = (w->now >> shift) + i;
+			tick = base << shift;
+			if(next != 0 && tick >= next)
+				break;
+			if(w->slots[level][base & TIMER_MASK] != NULL)
+			{
+				next = tick;
+				break;
+			}
+		}
+	}
+
+	return next != 0 ? (int)((next - w->now) * TIMER_TICK_MS) : -1;
+}
@@ -0,0 +1,105 @@
+/********************************************************************************
+ * timer.h
+ *
+ * Computer Science 3357a
+ * Timer Wheel
+ *
+ * Author: Duncan Cai
+ *
+ * Hierarchical timer wheel for connection timeouts. Setting, moving and
+ * cancelling a timer are O(1), so every connection can keep one armed and
+ * move it on every event. Each event loop owns its wheel; nothing is locked.
+*******************************************************************************/
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10					// Resolution of the wheel
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)	// Slots per level
+#define TIMER_LEVELS 4						// Timers reach 2^24 ticks (46 hours) ahead
+
+//A timer, embedded in whatever it times out
+struct timer
+{
+	struct timer * next;
+	struct timer ** pprev;		// The pointer to this timer, or NULL while not armed
+	uint64_t expires;			// Tick the timer fires on
+};
+
+//A wheel of timers
+struct timer_wheel
+{
+	uint64_t now;				// Last tick whose timers were fired
+	size_t count;				// Timers armed
+	struct timer * slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/*
+ * Returns the current tick of the monotonic clock
+ */
+uint64_t timer_clock();
+
+/*
+ * Empties a wheel
+ *
+ * w: pointer to wheel
+ * now: the current tick
+ */
+void timer_wheel_init(struct timer_wheel * w, uint64_t now);
+
+/*
+ * Marks a timer as not armed
+ *
+ * t: pointer to timer
+ */
+void timer_init(struct timer * t);
+
+/*
+ * Arms a timer, or moves it if it is already armed
+ *
+ * w: pointer to wheel
+ * t: pointer to timer
+ * expires: tick to fire on; ticks already past fire on the next one
+ */
+void timer_set(struct timer_wheel * w, struct timer * t, uint64_t expires);
+
+/*
+ * Disarms a timer if it is armed
+ *
+ * w: pointer to wheel
+ * t: pointer to timer
+ */
+void timer_cancel(struct timer_wheel * w, struct timer * t);
+
+/*
+ * Fires every timer due by the given tick, disarming each before its
+ * callback runs. Callbacks may set and cancel any timer.
+ *
+ * w: pointer to wheel
+ * now: the current tick
+ * expire: called with each timer that fires
+ * arg: passed to expire
+ */
+void timer_advance(struct timer_wheel * w, uint64_t now, void (*expire)(struct timer * t, void * arg), void * arg);
+
+/*
+ * Returns how long an event loop may sleep before timer_advance has work:
+ * until the first occupied slot fires or is cascaded down
+ *
+ * w: pointer to wheel
+ *
+ * return: milliseconds, or -1 if no timer is armed
+ */
+int timer_wait_ms(const struct timer_wheel * w);
+
+/*
+ * Converts milliseconds to ticks, rounding up
+ */
+uint64_t timer_ticks(unsigned ms);
+
+#endif
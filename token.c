@@ -0,0 +1,214 @@
+/********************************************************************************
+ * token.c
+ *
+ * Computer Science 3357a
+ * Expression Tokenizer
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the tokenizer. Each block of bytes becomes three masks
+ * with a bit per byte: word characters, operators and parentheses, and
+ * whitespace. A byte in none of them is invalid. Tokens start at every
+ * operator and at every word character that does not follow another, so
+ * their offsets are read off the masks a set bit at a time.
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "token.h"
+
+//Kinds of character
+#define K_INVALID	0
+#define K_SPACE		1
+#define K_WORD		2
+#define K_PUNCT		3
+
+static const unsigned char char_kind[256] =
+{
+	[' '] = K_SPACE, ['\n'] = K_SPACE, ['\r'] = K_SPACE,
+	['0' ... '9'] = K_WORD, ['a' ... 'z'] = K_WORD, ['A' ... 'Z'] = K_WORD, ['_'] = K_WORD,
+	['+'] = K_PUNCT, ['-'] = K_PUNCT, ['*'] = K_PUNCT, ['/'] = K_PUNCT, ['('] = K_PUNCT, [')'] = K_PUNCT,
+};
+
+static bool use_simd = true;
+
+void token_set_simd(bool simd)
+{
+	use_simd = simd;
+}
+
+bool token_spacious(const char * expr)
+{
+	int i, spaces = 0;
+
+	for(i = 0; i < TOKEN_SAMPLE; i++)
+		spaces += char_kind[(unsigned char)expr[i]] == K_SPACE;
+	return spaces * 2 > TOKEN_SAMPLE;
+}
+
+/*
+ * Makes room for a token at every byte and the terminator
+ */
+static bool index_reserve(struct token_index * index, size_t len)
+{
+	uint32_t * starts;
+
+	if(len + 1 <= index->capacity)
+		return true;
+	starts = realloc(index->starts, (len + 1) * sizeof(uint32_t));
+	if(starts == NULL)
+		return false;
+	index->starts = starts;
+	index->capacity = len + 1;
+	return true;
+}
+
+/*
+ * Records the tokens of a block of bytes from its masks
+ *
+ * base: offset of the block
+ * bits: bytes in the block
+ * carry: whether the byte before the block is a word character; updated
+ * for the next block
+ *
+ * return: false if the block has an invalid byte; only the tokens before
+ * it are recorded
+ */
+static inline bool index_block(struct token_index * index, uint32_t base, int bits,
+	uint32_t word, uint32_t punct, uint32_t space, uint32_t * carry)
+{
+	uint32_t starts;
+	uint32_t invalid = ~(word | punct | space) & (bits == 32 ? 0xffffffffu : (1u << bits) - 1);
+	uint32_t * out = index->starts + index->count;
+
+	starts = punct | (word & ~((word << 1) | *carry));
+	if(invalid != 0)
+		starts &= (1u << __builtin_ctz(invalid)) - 1;
+	*carry = word >> (bits - 1);
+	while(starts != 0)
+	{
+		*out++ = base + __builtin_ctz(starts);
+		starts &= starts - 1;
+	}
+	index->count = out - index->starts;
+
+	if(invalid != 0)
+	{
+		index->invalid = base + __builtin_ctz(invalid);
+		return false;
+	}
+	return true;
+}
+
+#if defined(__x86_64__)
+
+/*
+ * Classifies the bytes of the expression 16 at a time, as far as whole
+ * blocks go, with SSE2 (which every x86-64 processor has)
+ *
+ * return: the offset it stopped at, or -1 at an invalid byte (see
+ * index_block)
+ */
+static long tokenize_sse2(const char * expr, size_t len, struct token_index * index, uint32_t * carry)
+{
+	const __m128i under = _mm_set1_epi8('_');
+	size_t i;
+
+	for(i = 0; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(expr + i));
+		__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), lower));
+		// The operators and parentheses are '(' to '/', except ',' and '.'
+		__m128i punct = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')), _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+			_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('(' - 1)), _mm_cmpgt_epi8(_mm_set1_epi8('/' + 1), v)));
+		__m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+		__m128i word = _mm_or_si128(_mm_or_si128(digit, alpha), _mm_cmpeq_epi8(v, under));
+
+		if(!index_block(index, i, 16, _mm_movemask_epi8(word), _mm_movemask_epi8(punct), _mm_movemask_epi8(space), carry))
+			return -1;
+	}
+	return i;
+}
+
+/*
+ * Like tokenize_sse2, 32 bytes at a time with AVX2
+ */
+__attribute__((target("avx2")))
+static long tokenize_avx2(const char * expr, size_t len, struct token_index * index, uint32_t * carry)
+{
+	const __m256i under = _mm256_set1_epi8('_');
+	size_t i;
+
+	for(i = 0; i + 32 <= len; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(expr + i));
+		__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+		__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+		__m256i punct = _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))),
+			_mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('(' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('/' + 1), v)));
+		__m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+		__m256i word = _mm256_or_si256(_mm256_or_si256(digit, alpha), _mm256_cmpeq_epi8(v, under));
+
+		if(!index_block(index, i, 32, _mm256_movemask_epi8(word), _mm256_movemask_epi8(punct), _mm256_movemask_epi8(space), carry))
+			return -1;
+	}
+	return i;
+}
+
+#endif
+
+bool tokenize(const char * expr, size_t len, struct token_index * index)
+{
+	uint32_t carry = 0;		// The last byte classified is a word character
+	long done = 0;
+	size_t i;
+	int kind;
+
+	index->count = 0;
+	index->invalid = len;
+	if(len > UINT32_MAX || !index_reserve(index, len))
+		return false;
+
+#if defined(__x86_64__)
+	if(use_simd)
+	{
+		if(__builtin_cpu_supports("avx2"))
+			done = tokenize_avx2(expr, len, index, &carry);
+		else
+			done = tokenize_sse2(expr, len, index, &carry);
+		if(done < 0)
+		{
+			index->starts[index->count] = index->invalid;
+			return false;
+		}
+	}
+#endif
+
+	// The bytes after the last whole block, or all of them without vectors
+	for(i = done; i < len; i++)
+	{
+		kind = char_kind[(unsigned char)expr[i]];
+		if(kind == K_INVALID)
+		{
+			index->invalid = i;
+			index->starts[index->count] = i;
+			return false;
+		}
+		if(kind == K_PUNCT || (kind == K_WORD && !carry))
+			index->starts[index->count++] = i;
+		carry = kind == K_WORD;
+	}
+
+	index->starts[index->count] = len;
+	return true;
+}
@@ -0,0 +1,66 @@
+/********************************************************************************
+ * token.h
+ *
+ * Computer Science 3357a
+ * Expression Tokenizer
+ *
+ * Author: Duncan Cai
+ *
+ * Vectorized pre-pass over long expressions. Bytes are classified 16 or 32
+ * at a time into digits and letters, operators and parentheses, whitespace
+ * and everything else, and the offset of every token is recorded so the
+ * parser never looks at whitespace.
+*******************************************************************************/
+
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TOKEN_MIN_LEN 256		// Shorter expressions are parsed without an index
+#define TOKEN_SAMPLE 64			// Leading bytes that decide whether an index pays
+
+//Where the tokens of an expression start
+struct token_index
+{
+	uint32_t * starts;			// Offset of each token, then the offset of the terminator
+	size_t count;				// Tokens, not counting the terminator
+	size_t capacity;
+	size_t invalid;				// Offset of the first byte that can be in no token, or the length
+};
+
+/*
+ * Finds the tokens of an expression: each run of digits, letters and
+ * underscores, and each operator and parenthesis
+ *
+ * expr: the expression
+ * len: its length
+ * index: filled with the tokens; its storage is reused between calls
+ *
+ * return: false if the expression holds a character that can be in no
+ * token, is too long for 32-bit offsets or memory runs out, in which case
+ * the index is incomplete. At such a character it holds the tokens before
+ * it, ended by its offset, which invalid is set to.
+ */
+bool tokenize(const char * expr, size_t len, struct token_index * index);
+
+/*
+ * Whether whitespace is most of the start of an expression, so that
+ * jumping over it would pay for tokenizing. Single spaces between tokens
+ * are cheaper to step over than to jump.
+ *
+ * expr: the expression, at least TOKEN_SAMPLE bytes long
+ */
+bool token_spacious(const char * expr);
+
+/*
+ * Chooses whether tokenize may use vector instructions (the default), or
+ * classifies one byte at a time as it does where there are none
+ *
+ * simd: true to use vector instructions the processor supports
+ */
+void token_set_simd(bool simd);
+
+#endif
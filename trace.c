@@ -0,0 +1,14 @@
+/********************************************************************************
+ * trace.c
+ *
+ * Computer Science 3357a
+ * Debug Tracing
+ *
+ * Author: Duncan Cai
+ *
+ * Runtime switch for debug tracing.
+*******************************************************************************/
+
+#include "trace.h"
+
+bool trace_enabled = false;
@@ -0,0 +1,31 @@
+/********************************************************************************
+ * trace.h
+ *
+ * Computer Science 3357a
+ * Debug Tracing
+ *
+ * Author: Duncan Cai
+ *
+ * Debug tracing for the hot paths. Tracing is off until trace_enabled is
+ * set, and costs one predictable branch while off. Building with
+ * -DCALC_NO_TRACE removes every trace call and its arguments entirely.
+*******************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <syslog.h>
+
+// Set at startup to turn tracing on
+extern bool trace_enabled;
+
+#ifdef CALC_NO_TRACE
+#define TRACE_ENABLED() false
+#define TRACE(...) ((void)0)
+#else
+#define TRACE_ENABLED() __builtin_expect(trace_enabled, false)
+#define TRACE(...) do { if(TRACE_ENABLED()) syslog(LOG_DEBUG, __VA_ARGS__); } while(0)
+#endif
+
+#endif
@@ -0,0 +1,742 @@
+/********************************************************************************
+ * uring.c
+ *
+ * Computer Science 3357a
+ * io_uring Server Loop
+ *
+ * Author: Duncan Cai
+ *
+ * Implementation of the io_uring loop, on the raw system calls. Receives
+ * land in a ring of buffers registered with the kernel and are copied into
+ * the connection's session; a response that ends the connection is sent
+ * with its close linked behind it. Completions carry the connection pointer
+ * with the kind of operation in its low bits.
+*******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "ctp.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timer.h"
+#include "iplimit.h"
+#include "admission.h"
+
+#define BUF_GROUP 0			// Buffer group of the provided receive buffers
+
+//Kinds of operation, kept in the low bits of the user data
+#define TAG_ACCEPT 0
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_CLOSE 3
+#define TAG_CANCEL 4
+#define TAG_MASK 7
+
+//A client connection owned by the ring
+struct uring_conn
+{
+	int fd;
+	uint32_t addr;				// Client IPv4 address in network byte order
+	struct ctp_session session;	// Read and write buffers of the connection
+	struct timer timer;			// Fires when the connection times out
+	uint64_t request_start;		// Tick the unfinished request started on, or 0
+	int inflight;				// Operations submitted and not yet completed
+	bool receiving;				// A receive is armed
+	bool cancelling;			// The armed receive is being cancelled
+	bool sending;				// A send is in flight; the write buffer must not move
+	bool eof;					// The peer will send nothing more
+	bool closed;				// The close has been submitted
+	bool dropped;				// Timed out; every operation is being cancelled
+};
+
+//The rings shared with the kernel and the provided buffers
+struct uring
+{
+	int fd;
+	int listenfd;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;			// Tail including entries not yet published
+	unsigned to_submit;			// Entries published since the last enter
+	struct io_uring_sqe * sqes;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe * cqes;
+	struct io_uring_cqe * reaped;	// Completions taken off the queue and not yet handled
+	size_t num_reaped;
+	size_t reaped_cap;
+	void * sq_ring;
+	size_t sq_ring_size;
+	void * cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_buf_ring * buf_ring;
+	unsigned short buf_tail;
+	char * bufs;
+	bool multishot_recv;		// Cleared if the kernel only has one-shot receives
+	bool accepted;				// A connection was accepted, so no fallback is possible
+	struct timer_wheel timers;	// Timeouts of the connections
+	uint64_t now;				// Tick of the latest completions
+	uint64_t ready_since;		// When the latest completions were reaped, for admission
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void * arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Gives a provided buffer back to the kernel
+ */
+static void uring_recycle(struct uring * r, unsigned short bid)
+{
+	struct io_uring_buf * buf = &r->buf_ring->bufs[r->buf_tail & (URING_BUFS - 1)];
+
+	buf->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&r->buf_ring->tail, ++r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unmaps the rings and frees the receive buffers, for the fall back to epoll
+ */
+static void uring_free(struct uring * r)
+{
+	close(r->fd);
+	munmap(r->sq_ring, r->sq_ring_size);
+	munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	munmap(r->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+	free(r->bufs);
+	free(r->reaped);
+}
+
+/*
+ * Creates the rings and registers the provided buffers
+ *
+ * return: false if the kernel does not support them
+ */
+static bool uring_init(struct uring * r, int sockfd)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	memset(r, 0, sizeof(struct uring));
+	r->listenfd = sockfd;
+	r->multishot_recv = true;
+
+	// Only this thread submits, and completions need not interrupt it
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+	r->fd = io_uring_setup(URING_ENTRIES, &p);
+	if(r->fd == -1 && errno == EINVAL)
+	{
+		memset(&p, 0, sizeof(p));
+		r->fd = io_uring_setup(URING_ENTRIES, &p);
+	}
+	if(r->fd == -1)
+		return false;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		perror("Unable to map io_uring");
+		exit(EXIT_FAILURE);
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->sq_mask = *(unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+	// Submission slots map one to one onto the entries
+	for(i = 0; i < p.sq_entries; i++)
+		r->sq_array[i] = i;
+
+	r->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	r->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+	r->reaped_cap = p.cq_entries;
+	r->reaped = malloc(r->reaped_cap * sizeof(struct io_uring_cqe));
+	if(r->buf_ring == MAP_FAILED || r->bufs == NULL || r->reaped == NULL)
+	{
+		perror("Unable to allocate receive buffers");
+		exit(EXIT_FAILURE);
+	}
+
+	// Provided buffer rings need Linux 5.19; older kernels use epoll
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = BUF_GROUP;
+	if(io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		uring_free(r);
+		return false;
+	}
+
+	for(i = 0; i < URING_BUFS; i++)
+		uring_recycle(r, i);
+	return true;
+}
+
+/*
+ * Submits every queued entry and waits for at least min_complete
+ * completions, or until the next connection can time out
+ *
+ * return: false if the kernel took nothing because the completion queue
+ * is full
+ */
+static bool uring_submit(struct uring * r, unsigned min_complete)
+{
+	int wait = timer_wait_ms(&r->timers);
+	struct __kernel_timespec ts = { wait / 1000, wait % 1000 * 1000000LL };
+	struct io_uring_getevents_arg arg;
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	int submitted;
+
+	memset(&arg, 0, sizeof(arg));
+	if(min_complete > 0 && wait >= 0)
+	{
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+
+	while(1)
+	{
+		if(flags & IORING_ENTER_EXT_ARG)
+			submitted = io_uring_enter(r->fd, r->to_submit, min_complete, flags, &arg, sizeof(arg));
+		else
+			submitted = io_uring_enter(r->fd, r->to_submit, min_complete, flags, NULL, 0);
+		if(submitted >= 0)
+		{
+			r->to_submit -= submitted;
+			return true;
+		}
+		// The completion queue is full and has to be reaped first, or the
+		// wait reached the next timeout
+		if(errno == EBUSY)
+			return false;
+		if(errno == ETIME)
+			return true;
+		if(errno != EINTR)
+		{
+			perror("Unable to submit to io_uring");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Takes every completion off the queue, so the kernel can post more, and
+ * keeps them to be handled in order
+ *
+ * return: the number of completions taken
+ */
+static unsigned uring_reap(struct uring * r)
+{
+	unsigned head = *r->cq_head;
+	unsigned count = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - head;
+	struct io_uring_cqe * reaped;
+	unsigned i;
+
+	if(r->num_reaped + count > r->reaped_cap)
+	{
+		reaped = realloc(r->reaped, 2 * (r->num_reaped + count) * sizeof(struct io_uring_cqe));
+		if(reaped == NULL)
+		{
+			perror("Unable to reap io_uring completions");
+			exit(EXIT_FAILURE);
+		}
+		r->reaped = reaped;
+		r->reaped_cap = 2 * (r->num_reaped + count);
+	}
+	for(i = 0; i < count; i++)
+		r->reaped[r->num_reaped++] = r->cqes[(head + i) & r->cq_mask];
+	__atomic_store_n(r->cq_head, head + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+/*
+ * Makes sure the next count entries fit in the submission queue, so they
+ * are submitted together. Completions that hold up the submission are
+ * reaped to be handled later, as handling them here could queue more.
+ */
+static void uring_reserve(struct uring * r, unsigned count)
+{
+	while(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_entries - count)
+	{
+		if(uring_submit(r, 0) || uring_reap(r) > 0)
+			continue;
+		// Completions the kernel could not post wait in its overflow list
+		// and are only moved to the queue on a wait for events
+		if(io_uring_enter(r->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR && errno != EBUSY)
+		{
+			perror("Unable to flush io_uring completions");
+			exit(EXIT_FAILURE);
+		}
+		if(uring_reap(r) == 0 && !uring_submit(r, 0))
+		{
+			fprintf(stderr, "io_uring submission queue is stuck\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Returns an empty submission entry, submitting the queue first if full
+ * The entry is published at once; it is submitted by the next enter
+ */
+static struct io_uring_sqe * uring_sqe(struct uring * r, uint8_t opcode, int fd, struct uring_conn * conn, int tag)
+{
+	struct io_uring_sqe * sqe;
+
+	uring_reserve(r, 1);
+
+	sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (uint64_t)(uintptr_t)conn | tag;
+	if(conn != NULL)
+		conn->inflight++;
+
+	__atomic_store_n(r->sq_tail, ++r->sqe_tail, __ATOMIC_RELEASE);
+	r->to_submit++;
+	return sqe;
+}
+
+/*
+ * Arms the accept that keeps producing a completion per connection
+ */
+static void uring_accept(struct uring * r)
+{
+	struct io_uring_sqe * sqe = uring_sqe(r, IORING_OP_ACCEPT, r->listenfd, NULL, TAG_ACCEPT);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/*
+ * Arms a receive into the provided buffers
+ */
+static void conn_recv(struct uring * r, struct uring_conn * c)
+{
+	struct io_uring_sqe * sqe = uring_sqe(r, IORING_OP_RECV, c->fd, c, TAG_RECV);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	if(r->multishot_recv)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	c->receiving = true;
+}
+
+/*
+ * Stops the armed receive; its last completion arrives with -ECANCELED
+ */
+static void conn_cancel_recv(struct uring * r, struct uring_conn * c)
+{
+	struct io_uring_sqe * sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, c, TAG_CANCEL);
+	sqe->addr = (uint64_t)(uintptr_t)c | TAG_RECV;
+	c->cancelling = true;
+}
+
+/*
+ * Closes the connection once the operations before it have run
+ */
+static void conn_close(struct uring * r, struct uring_conn * c)
+{
+	if(c->receiving && !c->cancelling)
+		conn_cancel_recv(r, c);
+	uring_sqe(r, IORING_OP_CLOSE, c->fd, c, TAG_CLOSE);
+	c->closed = true;
+}
+
+/*
+ * Sends the pending responses; when they are the last ones, the close is
+ * linked behind the send so both go to the kernel together
+ */
+static void conn_send(struct uring * r, struct uring_conn * c, bool last)
+{
+	struct ctp_session * s = &c->session;
+	struct io_uring_sqe * sqe;
+
+	// A link only holds within one submission, so the cancel of the
+	// receive goes first and the send and close are submitted together
+	if(last)
+	{
+		uring_reserve(r, 3);
+		if(c->receiving && !c->cancelling)
+			conn_cancel_recv(r, c);
+	}
+
+	sqe = uring_sqe(r, IORING_OP_SEND, c->fd, c, TAG_SEND);
+	sqe->addr = (uint64_t)(uintptr_t)(s->wbuf + s->woff);
+	sqe->len = s->wlen - s->woff;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	c->sending = true;
+
+	if(last)
+	{
+		// A short send breaks the link, and the close is then resubmitted
+		sqe->flags = IOSQE_IO_LINK;
+		conn_close(r, c);
+	}
+}
+
+/*
+ * Answers every buffered request and sends the responses, or arms a
+ * receive if it needs more input. Nothing happens while a send is in
+ * flight, since answering would move the write buffer.
+ */
+static void conn_advance(struct uring * r, struct uring_conn * c)
+{
+	struct ctp_session * s = &c->session;
+
+	if(c->closed || c->sending)
+		return;
+
+	// Requests left over for lack of output room are answered once this
+	// send completes
+	ctp_session_process(s, c->eof);
+
+	if(s->woff < s->wlen)
+		conn_send(r, c, s->closing);
+	else if(s->closing)
+		conn_close(r, c);
+	else if(!c->receiving && !c->eof)
+		conn_recv(r, c);
+}
+
+/*
+ * Copies a received buffer into the session's read buffer
+ *
+ * return: false if the read buffer could not grow
+ */
+static bool conn_store(struct uring_conn * c, const char * data, size_t len)
+{
+	size_t space;
+	char * rspace;
+
+	while(len > 0)
+	{
+		rspace = ctp_session_rspace(&c->session, &space);
+		if(rspace == NULL)
+			return false;
+		if(space > len)
+			space = len;
+		memcpy(rspace, data, space);
+		c->session.rlen += space;
+		data += space;
+		len -= space;
+	}
+	return true;
+}
+
+/*
+ * Handles a receive completion
+ */
+static void conn_received(struct uring * r, struct uring_conn * c, int res, unsigned flags)
+{
+	unsigned short bid;
+
+	if(!(flags & IORING_CQE_F_MORE))
+	{
+		c->receiving = false;
+		c->cancelling = false;
+	}
+
+	if(res > 0)
+	{
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if(!c->closed && !conn_store(c, r->bufs + (size_t)bid * URING_BUF_SIZE, res))
+			c->session.closing = true;
+		uring_recycle(r, bid);
+
+		// A client that sends while ignoring its responses is not read
+		// further until it catches up
+		if(c->sending && c->receiving && !c->cancelling
+		   && c->session.rlen - c->session.rstart > URING_RBUF_LIMIT)
+			conn_cancel_recv(r, c);
+	}
+	else if(res == -EINVAL && r->multishot_recv)
+	{
+		// Multishot receives need Linux 6.0; rearm as one-shot receives
+		r->multishot_recv = false;
+	}
+	else if(res != -ENOBUFS && res != -ECANCELED)
+	{
+		// End of file, or the connection failed
+		c->eof = true;
+	}
+
+	conn_advance(r, c);
+}
+
+/*
+ * Handles a send completion
+ */
+static void conn_sent(struct uring * r, struct uring_conn * c, int res)
+{
+	c->sending = false;
+	if(res < 0)
+	{
+		if(!c->closed)
+			conn_close(r, c);
+		return;
+	}
+	c->session.woff += res;
+	conn_advance(r, c);
+}
+
+/*
+ * Arms the connection's timer for the state it is waiting in, as the
+ * reactor does. A connection being closed only times out while its last
+ * responses are still being sent.
+ */
+static void conn_schedule(struct uring * r, struct uring_conn * c)
+{
+	struct ctp_session * s = &c->session;
+	unsigned timeout;
+	uint64_t since = r->now;
+
+	if(c->dropped || (c->closed && !c->sending))
+		timeout = 0;
+	else if(s->woff < s->wlen)
+		timeout = ctp_config.write_timeout;
+	else if(s->rlen > s->rstart)
+	{
+		if(c->request_start == 0)
+			c->request_start = r->now;
+		since = c->request_start;
+		timeout = ctp_config.read_timeout;
+	}
+	else
+		timeout = ctp_config.idle_timeout;
+
+	if(s->rlen == s->rstart)
+		c->request_start = 0;
+
+	if(timeout > 0)
+		timer_set(&r->timers, &c->timer, since + timer_ticks(timeout));
+	else
+		timer_cancel(&r->timers, &c->timer);
+}
+
+/*
+ * Drops a connection whose timer fired: cancels whatever it has in flight,
+ * a send included, and closes it
+ */
+static void conn_expire(struct timer * t, void * arg)
+{
+	struct uring * r = arg;
+	struct uring_conn * c = (struct uring_conn *)((char *)t - offsetof(struct uring_conn, timer));
+	struct io_uring_sqe * sqe;
+
+	metrics_connection_dropped(METRIC_DROP_TIMEOUT);
+	c->dropped = true;
+	c->cancelling = true;
+
+	sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, c->fd, c, TAG_CANCEL);
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	if(!c->closed)
+		conn_close(r, c);
+}
+
+/*
+ * Handles an accept completion
+ *
+ * return: false if the kernel does not support multishot accept
+ */
+static bool uring_accepted(struct uring * r, int res, unsigned flags)
+{
+	struct sockaddr_in client_addr;
+	socklen_t addr_len = sizeof(client_addr);
+	struct uring_conn * c;
+
+	if(res == -EINVAL && !r->accepted)
+		return false;
+
+	// Multishot accept stops on errors such as running out of descriptors
+	if(!(flags & IORING_CQE_F_MORE))
+		uring_accept(r);
+
+	if(res < 0)
+	{
+		if(res != -EINTR && res != -ECONNABORTED)
+		{
+			errno = -res;
+			perror("Unable to accept connection");
+		}
+		return true;
+	}
+	r->accepted = true;
+
+	// The multishot accept shares one address buffer between connections,
+	// so each client address is asked for separately
+	if(getpeername(res, (struct sockaddr *)&client_addr, &addr_len) != 0)
+		client_addr.sin_addr.s_addr = 0;
+	logger_client(client_addr.sin_addr.s_addr);
+
+	// An overloaded server answers at once rather than queue the client
+	if(!admission_open())
+	{
+		admission_refuse(res);
+		return true;
+	}
+
+	// A client over its limit is refused before anything is allocated
+	if(!iplimit_acquire(client_addr.sin_addr.s_addr))
+	{
+		metrics_connection_dropped(METRIC_DROP_LIMIT);
+		admission_close();
+		close(res);
+		return true;
+	}
+
+	c = malloc(sizeof(struct uring_conn));
+	if(c == NULL)
+	{
+		iplimit_release(client_addr.sin_addr.s_addr);
+		admission_close();
+		close(res);
+		return true;
+	}
+	memset(c, 0, sizeof(struct uring_conn));
+	c->fd = res;
+	c->addr = client_addr.sin_addr.s_addr;
+	ctp_session_init(&c->session);
+	timer_init(&c->timer);
+	metrics_connection_opened();
+
+	conn_advance(r, c);
+	conn_schedule(r, c);
+	return true;
+}
+
+/*
+ * Dispatches a completion to the connection it belongs to, and frees the
+ * connection once it is closed and nothing refers to it any more
+ *
+ * return: false if the loop must fall back to epoll
+ */
+static bool uring_complete(struct uring * r, const struct io_uring_cqe * cqe)
+{
+	struct uring_conn * c = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)TAG_MASK);
+	int tag = cqe->user_data & TAG_MASK;
+
+	if(tag == TAG_ACCEPT)
+		return uring_accepted(r, cqe->res, cqe->flags);
+
+	// A multishot receive holds its reference until its last completion
+	if(tag != TAG_RECV || !(cqe->flags & IORING_CQE_F_MORE))
+		c->inflight--;
+
+	// Every completion of the batch has been waiting since it was reaped
+	admission_ready(r->ready_since);
+
+	switch(tag)
+	{
+		case TAG_RECV:
+			conn_received(r, c, cqe->res, cqe->flags);
+			break;
+		case TAG_SEND:
+			conn_sent(r, c, cqe->res);
+			break;
+		case TAG_CLOSE:
+			// The send it was linked to fell short
+			if(cqe->res == -ECANCELED)
+				uring_sqe(r, IORING_OP_CLOSE, c->fd, c, TAG_CLOSE);
+			break;
+	}
+
+	if(c->closed && c->inflight == 0)
+	{
+		timer_cancel(&r->timers, &c->timer);
+		admission_close();
+		iplimit_release(c->addr);
+		ctp_session_free(&c->session);
+		free(c);
+		metrics_connection_closed();
+	}
+	else
+		conn_schedule(r, c);
+	return true;
+}
+
+void uring_run(int sockfd)
+{
+	struct uring r;
+	struct io_uring_cqe cqe;
+	size_t i;
+
+	if(!uring_init(&r, sockfd))
+		return;
+
+	r.now = timer_clock();
+	timer_wheel_init(&r.timers, r.now);
+
+	uring_accept(&r);
+
+	while(1)
+	{
+		uring_submit(&r, 1);
+		r.now = timer_clock();
+		r.ready_since = admission_clock();
+
+		// The queue is emptied before anything is handled, so a handler
+		// that submits never finds it full of what was already seen. One
+		// that has to reap adds to the end of what is being handled.
+		uring_reap(&r);
+		for(i = 0; i < r.num_reaped; i++)
+		{
+			cqe = r.reaped[i];
+			if(!uring_complete(&r, &cqe))
+			{
+				// Nothing was accepted yet, so nothing is lost
+				uring_free(&r);
+				return;
+			}
+		}
+		r.num_reaped = 0;
+
+		timer_advance(&r.timers, r.now, conn_expire, &r);
+	}
+}
@@ -0,0 +1,31 @@
+/********************************************************************************
+ * uring.h
+ *
+ * Computer Science 3357a
+ * io_uring Server Loop
+ *
+ * Author: Duncan Cai
+ *
+ * Completion-based server loop on io_uring: one multishot accept, multishot
+ * receives into a ring of provided buffers, and responses sent by linked
+ * operations, so many requests share each system call
+*******************************************************************************/
+
+#ifndef URING_H
+#define URING_H
+
+#define URING_ENTRIES 1024			// Submission queue entries
+#define URING_BUFS 512				// Provided receive buffers; must be a power of two
+#define URING_BUF_SIZE 2048			// Bytes per provided buffer
+#define URING_RBUF_LIMIT 65536		// Unanswered bytes a connection may hold while its output is blocked
+
+/*
+ * Runs the event loop on the given listening socket
+ * Returns only if the kernel lacks the io_uring features the loop needs,
+ * before any connection is accepted, so the caller can fall back to epoll
+ *
+ * sockfd: the listening socket
+ */
+void uring_run(int sockfd);
+
+#endif